@@ -0,0 +1,155 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <exception>
+
+#include "Eigen.h"
+#include "PointCloud.h"
+#include "ICPOptimizer.h"
+#include "ThreadPool.h"
+
+/**
+ * A single registration request: align source to target, starting from initialPose.
+ */
+struct RegistrationJob {
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	std::shared_ptr<const PointCloud> source;
+	std::shared_ptr<const PointCloud> target;
+	Matrix4f initialPose = Matrix4f::Identity();
+};
+
+typedef std::vector<RegistrationJob, Eigen::aligned_allocator<RegistrationJob>> RegistrationJobs;
+
+
+/**
+ * Runs many ICP registrations concurrently on a shared thread pool.
+ * Every job gets its own optimizer (and with it its own working memory). The search index of a target
+ * is built once, by the first job that needs it, and then shared read-only by all jobs with that target.
+ */
+class BatchRegistration {
+public:
+	explicit BatchRegistration(unsigned nThreads = 0) :
+		m_bUsePointToPlaneConstraints{ false },
+		m_nIterations{ 20 },
+		m_maxDistance{ 0.005f },
+		m_pool{ nThreads }
+	{ }
+
+	void setMatchingMaxDistance(float maxDistance) {
+		m_maxDistance = maxDistance;
+	}
+
+	void usePointToPlaneConstraints(bool bUsePointToPlaneConstraints) {
+		m_bUsePointToPlaneConstraints = bUsePointToPlaneConstraints;
+	}
+
+	void setNbOfIterations(unsigned nIterations) {
+		m_nIterations = nIterations;
+	}
+
+	/**
+	 * Queues a registration. The settings are captured at submission time.
+	 */
+	std::future<Matrix4f> submit(const RegistrationJob& job) {
+		const bool bUsePointToPlaneConstraints = m_bUsePointToPlaneConstraints;
+		const unsigned nIterations = m_nIterations;
+		const float maxDistance = m_maxDistance;
+		auto sharedJob = std::allocate_shared<RegistrationJob>(Eigen::aligned_allocator<RegistrationJob>(), job);
+
+		return m_pool.submit([this, sharedJob, bUsePointToPlaneConstraints, nIterations, maxDistance]() -> Matrix4f {
+			ICPOptimizer optimizer;
+			optimizer.setVerbose(false);
+			optimizer.setMatchingMaxDistance(maxDistance);
+			optimizer.usePointToPlaneConstraints(bUsePointToPlaneConstraints);
+			optimizer.setNbOfIterations(nIterations);
+
+			auto index = getIndex(optimizer, sharedJob->target, maxDistance);
+			return optimizer.estimatePose(*sharedJob->source, *sharedJob->target, *index, sharedJob->initialPose);
+		});
+	}
+
+	std::vector<std::future<Matrix4f>> submit(const RegistrationJobs& jobs) {
+		std::vector<std::future<Matrix4f>> results;
+		results.reserve(jobs.size());
+		for (const auto& job : jobs) {
+			results.push_back(submit(job));
+		}
+		return results;
+	}
+
+	/**
+	 * Drops the cached target indices (running jobs keep theirs alive until they finish).
+	 */
+	void clearIndexCache() {
+		std::lock_guard<std::mutex> lock(m_indexMutex);
+		m_indices.clear();
+	}
+
+private:
+	typedef std::shared_ptr<const NearestNeighborSearch> IndexPtr;
+
+	struct CachedIndex {
+		// Keeps the target alive while its index is cached, so the address can't be reused by another cloud.
+		std::shared_ptr<const PointCloud> target;
+		float maxDistance;
+		std::shared_future<IndexPtr> index;
+	};
+
+	bool m_bUsePointToPlaneConstraints;
+	unsigned m_nIterations;
+	float m_maxDistance;
+
+	std::mutex m_indexMutex;
+	std::multimap<const PointCloud*, CachedIndex> m_indices;
+
+	// Declared last, so the workers are joined before the index cache is destroyed.
+	ThreadPool m_pool;
+
+	IndexPtr getIndex(const ICPOptimizer& optimizer, const std::shared_ptr<const PointCloud>& target, float maxDistance) {
+		std::promise<IndexPtr> promise;
+		std::shared_future<IndexPtr> cachedIndex;
+		{
+			std::lock_guard<std::mutex> lock(m_indexMutex);
+			auto range = m_indices.equal_range(target.get());
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second.maxDistance == maxDistance) {
+					cachedIndex = it->second.index;
+					break;
+				}
+			}
+			if (!cachedIndex.valid())
+				m_indices.insert({ target.get(), CachedIndex{ target, maxDistance, promise.get_future().share() } });
+		}
+
+		if (cachedIndex.valid())
+			return cachedIndex.get();
+
+		// This job is the first one with this target, it builds the index while the others wait for it.
+		std::shared_ptr<NearestNeighborSearch> index = ICPOptimizer::createNearestNeighborSearch();
+		index->setVerbose(false);
+		index->setMatchingMaxDistance(maxDistance);
+		try {
+			optimizer.buildIndex(*index, *target);
+		}
+		catch (...) {
+			// The waiting jobs get the exception, later jobs build the index again.
+			promise.set_exception(std::current_exception());
+			std::lock_guard<std::mutex> lock(m_indexMutex);
+			auto range = m_indices.equal_range(target.get());
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second.maxDistance == maxDistance) {
+					m_indices.erase(it);
+					break;
+				}
+			}
+			throw;
+		}
+		promise.set_value(index);
+
+		return index;
+	}
+};
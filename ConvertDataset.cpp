@@ -0,0 +1,90 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+
+#include "Eigen.h"
+#include "VirtualSensor.h"
+#include "FrameStore.h"
+
+// Converts a TUM RGB-D sequence into a frame store (see FrameStore), which VirtualSensor::init() opens instead
+// of the dataset directory. The images are decoded once here instead of in every run.
+//
+// Usage: convert_dataset <dataset dir> <output .frames file> [--uint16] [--no-color] [--associate <max difference>]
+//   --uint16     stores depth as uint16 (scaled by 5000 like the PNGs) instead of metric float, half the size
+//   --no-color   stores depth only
+//   --associate  pairs depth and color images by timestamp (see VirtualSensor::setTimeStampAssociation())
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cout << "Usage: " << argv[0] << " <dataset dir> <output .frames file> [--uint16] [--no-color] [--associate <max difference>]" << std::endl;
+		return -1;
+	}
+
+	std::string datasetDir = argv[1];
+	if (datasetDir.back() != '/')
+		datasetDir += '/';
+	const std::string filenameOut = argv[2];
+
+	FrameStore::DepthFormat depthFormat = FrameStore::DEPTH_FLOAT32;
+	bool withColor = true;
+	double maxTimeStampDifference = 0.0;
+	for (int i = 3; i < argc; ++i) {
+		const std::string option = argv[i];
+		if (option == "--uint16") {
+			depthFormat = FrameStore::DEPTH_UINT16;
+		}
+		else if (option == "--no-color") {
+			withColor = false;
+		}
+		else if (option == "--associate" && i + 1 < argc) {
+			maxTimeStampDifference = std::atof(argv[++i]);
+		}
+		else {
+			std::cout << "Unknown option " << option << std::endl;
+			return -1;
+		}
+	}
+
+	VirtualSensor sensor;
+	sensor.setTimeStampAssociation(maxTimeStampDifference);
+	if (!sensor.init(datasetDir)) {
+		std::cout << "Failed to initialize the sensor!\nCheck file path!" << std::endl;
+		return -1;
+	}
+	sensor.setChannels(withColor ? VirtualSensor::CHANNEL_DEPTH | VirtualSensor::CHANNEL_COLOR : VirtualSensor::CHANNEL_DEPTH);
+	const unsigned int nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	sensor.setPrefetching(2 * nThreads, nThreads);
+
+	FrameStoreWriter writer;
+	if (!writer.open(filenameOut, depthFormat, 5000.0f,
+		sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(),
+		withColor ? sensor.getColorImageWidth() : 0, withColor ? sensor.getColorImageHeight() : 0, sensor.getColorIntrinsics(), sensor.getColorExtrinsics()))
+		return -1;
+
+	unsigned int nFrames = 0;
+	while (sensor.processNextFrame()) {
+		const float* depth = sensor.getDepth();
+		const unsigned char* color = withColor ? sensor.getColorRGBX() : nullptr;
+		if (!depth || (withColor && !color)) {
+			std::cout << "Failed to decode frame " << sensor.getCurrentFrameCnt() << "!" << std::endl;
+			return -1;
+		}
+		if (!writer.addFrame(depth, color, sensor.getDepthTimeStamp(), sensor.getColorTimeStamp(), sensor.getTrajectory())) {
+			std::cout << "Failed to write frame " << sensor.getCurrentFrameCnt() << "!" << std::endl;
+			return -1;
+		}
+		++nFrames;
+	}
+	if (nFrames < sensor.getNbOfFrames()) {
+		std::cout << "Failed to read frame " << nFrames << "!" << std::endl;
+		return -1;
+	}
+
+	if (!writer.close()) {
+		std::cout << "Failed to write " << filenameOut << "!" << std::endl;
+		return -1;
+	}
+	std::cout << "Wrote " << nFrames << " frames to " << filenameOut << std::endl;
+	return 0;
+}
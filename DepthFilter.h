@@ -0,0 +1,135 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "Eigen.h"
+#include "Parallel.h"
+
+/**
+ * Edge-preserving smoothing of depth maps: a separable approximation of the bilateral filter (a horizontal and
+ * a vertical 1D bilateral pass). Neighbors are weighted by their pixel distance and by their depth difference
+ * to the center pixel, so depth discontinuities are kept. Invalid (MINF) pixels don't contribute and stay invalid.
+ * Both passes work on whole rows with Eigen array expressions (vectorized) and are parallel over the rows; the
+ * intermediate image is kept between frames.
+ */
+class BilateralDepthFilter {
+public:
+	/**
+	 * spatialSigma is in pixels, rangeSigma in meters. The kernel radius is 2 * spatialSigma (rounded up).
+	 */
+	explicit BilateralDepthFilter(float spatialSigma = 1.5f, float rangeSigma = 0.03f) {
+		setSpatialSigma(spatialSigma);
+		setRangeSigma(rangeSigma);
+	}
+
+	void setSpatialSigma(float spatialSigma) {
+		m_radius = std::max(1, int(std::ceil(2.f * spatialSigma)));
+		m_spatialWeights.resize(2 * m_radius + 1);
+		for (int k = -m_radius; k <= m_radius; ++k)
+			m_spatialWeights[k + m_radius] = std::exp(-0.5f * k * k / (spatialSigma * spatialSigma));
+	}
+
+	void setRangeSigma(float rangeSigma) {
+		m_rangeFactor = -0.5f / (rangeSigma * rangeSigma);
+	}
+
+	/**
+	 * Filters depthMap into filteredDepthMap (both width x height, they must not overlap).
+	 */
+	void apply(const float* depthMap, float* filteredDepthMap, unsigned width, unsigned height) {
+		const int w = int(width);
+		const int h = int(height);
+		m_intermediateDepth.resize(size_t(w) * h);
+		m_intermediateValid.resize(size_t(w) * h);
+
+		// Horizontal pass: row v of the input into row v of the intermediate image (kept split into depth and mask).
+		#pragma omp parallel num_threads(Parallel::getNumThreads())
+		{
+			RowBuffers buffers(w);
+
+			#pragma omp for schedule(static)
+			for (int v = 0; v < h; ++v) {
+				buffers.load(depthMap + size_t(v) * w);
+				for (int k = -m_radius; k <= m_radius; ++k) {
+					// Pixels u with a neighbor u + k inside the row (none if the row is narrower than the offset).
+					const int begin = std::max(0, -k);
+					const int n = w - std::abs(k);
+					if (n <= 0)
+						continue;
+					buffers.accumulate(begin, n, buffers.depth.data() + begin + k, buffers.valid.data() + begin + k, m_spatialWeights[k + m_radius], m_rangeFactor);
+				}
+
+				Eigen::Map<Eigen::ArrayXf> depth(m_intermediateDepth.data() + size_t(v) * w, w);
+				Eigen::Map<Eigen::ArrayXf> valid(m_intermediateValid.data() + size_t(v) * w, w);
+				depth = (buffers.valid > 0.f).select(buffers.weightedSum / buffers.weightSum, 0.f);
+				valid = buffers.valid;
+			}
+		}
+
+		// Vertical pass: rows v - radius .. v + radius of the intermediate image into row v of the output.
+		#pragma omp parallel num_threads(Parallel::getNumThreads())
+		{
+			RowBuffers buffers(w);
+
+			#pragma omp for schedule(static)
+			for (int v = 0; v < h; ++v) {
+				buffers.depth = Eigen::Map<const Eigen::ArrayXf>(m_intermediateDepth.data() + size_t(v) * w, w);
+				buffers.valid = Eigen::Map<const Eigen::ArrayXf>(m_intermediateValid.data() + size_t(v) * w, w);
+				buffers.weightedSum.setZero();
+				buffers.weightSum.setZero();
+				for (int k = -m_radius; k <= m_radius; ++k) {
+					if (v + k < 0 || v + k >= h)
+						continue;
+					const size_t neighborRow = size_t(v + k) * w;
+					buffers.accumulate(0, w, m_intermediateDepth.data() + neighborRow, m_intermediateValid.data() + neighborRow, m_spatialWeights[k + m_radius], m_rangeFactor);
+				}
+
+				Eigen::Map<Eigen::ArrayXf> output(filteredDepthMap + size_t(v) * w, w);
+				output = (buffers.valid > 0.f).select(buffers.weightedSum / buffers.weightSum, MINF);
+			}
+		}
+	}
+
+private:
+	int m_radius;
+	float m_rangeFactor;
+	std::vector<float> m_spatialWeights;
+
+	// Result of the horizontal pass: depth (0 where invalid) and validity mask (1 or 0).
+	std::vector<float> m_intermediateDepth;
+	std::vector<float> m_intermediateValid;
+
+	/**
+	 * Weighted sums of one output row. Invalid pixels have depth 0 and mask 0, so they are masked by multiplication.
+	 */
+	struct RowBuffers {
+		Eigen::ArrayXf depth, valid, weights, weightedSum, weightSum;
+
+		explicit RowBuffers(int width) : depth(width), valid(width), weights(width), weightedSum(width), weightSum(width) {}
+
+		void load(const float* row) {
+			const Eigen::Map<const Eigen::ArrayXf> input(row, depth.size());
+			valid = input.isFinite().cast<float>();
+			depth = input.isFinite().select(input, 0.f);
+			weightedSum.setZero();
+			weightSum.setZero();
+		}
+
+		/**
+		 * Adds the neighbors (n pixels of depth and mask) of the pixels begin .. begin + n - 1 of the row.
+		 */
+		void accumulate(int begin, int n, const float* neighborDepthData, const float* neighborValidData, float spatialWeight, float rangeFactor) {
+			const Eigen::Map<const Eigen::ArrayXf> neighborDepth(neighborDepthData, n);
+			const Eigen::Map<const Eigen::ArrayXf> neighborValid(neighborValidData, n);
+			auto w = weights.head(n);
+			// The range weight exp(-x) is approximated by (1 - x / 8)^8, which is 0 beyond 4 range sigmas: only
+			// multiplications, so it vectorizes without a SIMD exponential.
+			w = ((neighborDepth - depth.segment(begin, n)).square() * (0.125f * rangeFactor) + 1.f).max(0.f);
+			w = spatialWeight * neighborValid * w.square().square().square();
+			weightedSum.segment(begin, n) += w * neighborDepth;
+			weightSum.segment(begin, n) += w;
+		}
+	};
+};
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include "Eigen.h"
+#include "MappedFile.h"
+
+/**
+ * Packed RGB-D sequence in one memory-mapped file: per frame the depth image (metric float, or uint16 with a
+ * depth scale), optionally the RGBX color image, the depth and color timestamps and the associated ground-truth
+ * trajectory. Frames are accessed by index, without decoding or copying.
+ * The file holds a FrameStoreHeader, the images (every one starting at a multiple of kAlignment bytes) and the
+ * frame table (one FrameRecord per frame) at the end. Files are written by FrameStoreWriter.
+ */
+class FrameStore {
+public:
+	enum DepthFormat : uint32_t { DEPTH_FLOAT32 = 0, DEPTH_UINT16 = 1 };
+
+	/**
+	 * Header of the frame store (native byte order, checked with the byte order mark).
+	 */
+	struct FrameStoreHeader {
+		enum : uint32_t { kVersion = 1, kByteOrderMark = 0x01020304, kAlignment = 64 };
+
+		char magic[8] = { 'I', 'C', 'P', 'F', 'R', 'A', 'M', 'E' };
+		uint32_t version = kVersion;
+		uint32_t byteOrderMark = kByteOrderMark;
+		uint64_t fileSize = 0;
+		uint32_t nFrames = 0;
+		uint32_t depthFormat = DEPTH_FLOAT32;
+		uint32_t depthWidth = 0;
+		uint32_t depthHeight = 0;
+		uint32_t colorWidth = 0;
+		uint32_t colorHeight = 0;
+		// Stored depth values are divided by depthScale (uint16 depth only).
+		float depthScale = 1.f;
+		uint32_t hasColor = 0;
+		float depthIntrinsics[9] = {};
+		float colorIntrinsics[9] = {};
+		float depthExtrinsics[16] = {};
+		float colorExtrinsics[16] = {};
+		uint64_t frameTableOffset = 0;
+	};
+
+	struct FrameRecord {
+		double depthTimeStamp = 0.0;
+		double colorTimeStamp = 0.0;
+		float trajectory[16] = {};
+		uint64_t depthOffset = 0;
+		uint64_t colorOffset = 0;
+	};
+
+	/**
+	 * Maps a frame store, returns nullptr if the file can't be read or isn't a valid frame store.
+	 * The mapping is copy-on-write, so the frame buffers returned by the non-const accessors may be modified in
+	 * place without touching the file.
+	 */
+	static std::shared_ptr<FrameStore> open(const std::string& filename) {
+		std::shared_ptr<FrameStore> store{ new FrameStore() };
+		store->m_file = MappedFile::open(filename, true);
+		if (!store->m_file) {
+			std::cout << "ERROR: unable to read frame store " << filename << "!" << std::endl;
+			return nullptr;
+		}
+
+		if (store->m_file->size() < sizeof(FrameStoreHeader)) {
+			std::cout << "ERROR: " << filename << " is not a frame store!" << std::endl;
+			return nullptr;
+		}
+		std::memcpy(&store->m_header, store->m_file->data(), sizeof(FrameStoreHeader));
+		if (!store->isValid()) {
+			std::cout << "ERROR: " << filename << " is not a frame store of version " << FrameStoreHeader::kVersion << "!" << std::endl;
+			return nullptr;
+		}
+		return store;
+	}
+
+	unsigned int getNbOfFrames() const {
+		return m_header.nFrames;
+	}
+
+	DepthFormat getDepthFormat() const {
+		return DepthFormat(m_header.depthFormat);
+	}
+
+	float getDepthScale() const {
+		return m_header.depthScale;
+	}
+
+	bool hasColor() const {
+		return m_header.hasColor != 0;
+	}
+
+	unsigned int getDepthImageWidth() const {
+		return m_header.depthWidth;
+	}
+
+	unsigned int getDepthImageHeight() const {
+		return m_header.depthHeight;
+	}
+
+	unsigned int getColorImageWidth() const {
+		return m_header.colorWidth;
+	}
+
+	unsigned int getColorImageHeight() const {
+		return m_header.colorHeight;
+	}
+
+	Matrix3f getDepthIntrinsics() const {
+		return Eigen::Map<const Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(m_header.depthIntrinsics);
+	}
+
+	Matrix3f getColorIntrinsics() const {
+		return Eigen::Map<const Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(m_header.colorIntrinsics);
+	}
+
+	Matrix4f getDepthExtrinsics() const {
+		return Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(m_header.depthExtrinsics);
+	}
+
+	Matrix4f getColorExtrinsics() const {
+		return Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(m_header.colorExtrinsics);
+	}
+
+	double getDepthTimeStamp(unsigned int frameIdx) const {
+		return record(frameIdx).depthTimeStamp;
+	}
+
+	double getColorTimeStamp(unsigned int frameIdx) const {
+		return record(frameIdx).colorTimeStamp;
+	}
+
+	/**
+	 * Ground-truth trajectory transformation associated with the frame (as VirtualSensor::getTrajectory()).
+	 */
+	Matrix4f getTrajectory(unsigned int frameIdx) const {
+		return Eigen::Map<const Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(record(frameIdx).trajectory);
+	}
+
+	/**
+	 * Metric depth of a frame (MINF for invalid pixels) inside the mapping, nullptr for uint16 depth.
+	 */
+	const float* getDepth(unsigned int frameIdx) const {
+		if (getDepthFormat() != DEPTH_FLOAT32)
+			return nullptr;
+		return reinterpret_cast<const float*>(m_file->data() + record(frameIdx).depthOffset);
+	}
+
+	float* getDepth(unsigned int frameIdx) {
+		if (getDepthFormat() != DEPTH_FLOAT32)
+			return nullptr;
+		return reinterpret_cast<float*>(m_file->writableData() + record(frameIdx).depthOffset);
+	}
+
+	/**
+	 * Raw uint16 depth of a frame inside the mapping (0 for invalid pixels), nullptr for float depth.
+	 */
+	const uint16_t* getRawDepth(unsigned int frameIdx) const {
+		if (getDepthFormat() != DEPTH_UINT16)
+			return nullptr;
+		return reinterpret_cast<const uint16_t*>(m_file->data() + record(frameIdx).depthOffset);
+	}
+
+	/**
+	 * Writes the metric depth of a frame (MINF for invalid pixels) into depth, for either depth format.
+	 */
+	void copyDepth(unsigned int frameIdx, float* depth) const {
+		const size_t nPixels = size_t(m_header.depthWidth) * m_header.depthHeight;
+		if (getDepthFormat() == DEPTH_FLOAT32) {
+			std::memcpy(depth, getDepth(frameIdx), nPixels * sizeof(float));
+			return;
+		}
+
+		const uint16_t* rawDepth = getRawDepth(frameIdx);
+		const float depthScale = m_header.depthScale;
+		for (size_t i = 0; i < nPixels; ++i)
+			depth[i] = rawDepth[i] == 0 ? MINF : float(rawDepth[i]) / depthScale;
+	}
+
+	/**
+	 * RGBX color image of a frame inside the mapping, nullptr if the store has no color.
+	 */
+	const unsigned char* getColorRGBX(unsigned int frameIdx) const {
+		if (!hasColor())
+			return nullptr;
+		return reinterpret_cast<const unsigned char*>(m_file->data() + record(frameIdx).colorOffset);
+	}
+
+	unsigned char* getColorRGBX(unsigned int frameIdx) {
+		if (!hasColor())
+			return nullptr;
+		return reinterpret_cast<unsigned char*>(m_file->writableData() + record(frameIdx).colorOffset);
+	}
+
+	static uint64_t alignOffset(uint64_t offset) {
+		const uint64_t alignment = FrameStoreHeader::kAlignment;
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+private:
+	std::shared_ptr<MappedFile> m_file;
+	FrameStoreHeader m_header;
+
+	FrameStore() {}
+
+	const FrameRecord& record(unsigned int frameIdx) const {
+		return reinterpret_cast<const FrameRecord*>(m_file->data() + m_header.frameTableOffset)[frameIdx];
+	}
+
+	bool isValid() const {
+		const FrameStoreHeader reference;
+		if (std::memcmp(m_header.magic, reference.magic, sizeof(m_header.magic)) != 0 || m_header.version != FrameStoreHeader::kVersion ||
+			m_header.byteOrderMark != FrameStoreHeader::kByteOrderMark || m_header.fileSize > m_file->size())
+			return false;
+		if (m_header.depthFormat != DEPTH_FLOAT32 && m_header.depthFormat != DEPTH_UINT16)
+			return false;
+		// Counts are checked against the file size before they are multiplied, so no size can wrap around.
+		const uint64_t fileSize = m_header.fileSize;
+		if (m_header.frameTableOffset % FrameStoreHeader::kAlignment != 0 || m_header.frameTableOffset > fileSize ||
+			m_header.nFrames > (fileSize - m_header.frameTableOffset) / sizeof(FrameRecord))
+			return false;
+
+		const uint64_t depthPixels = uint64_t(m_header.depthWidth) * m_header.depthHeight;
+		const uint64_t colorPixels = uint64_t(m_header.colorWidth) * m_header.colorHeight;
+		if (depthPixels > fileSize / sizeof(float) || (hasColor() && colorPixels > fileSize / 4))
+			return false;
+		const uint64_t depthBytes = depthPixels * (getDepthFormat() == DEPTH_FLOAT32 ? sizeof(float) : sizeof(uint16_t));
+		const uint64_t colorBytes = colorPixels * 4;
+		for (unsigned int i = 0; i < m_header.nFrames; ++i) {
+			const FrameRecord& frame = record(i);
+			if (frame.depthOffset == 0 || frame.depthOffset % FrameStoreHeader::kAlignment != 0 || !isInFile(frame.depthOffset, depthBytes))
+				return false;
+			if (hasColor() && (frame.colorOffset == 0 || frame.colorOffset % FrameStoreHeader::kAlignment != 0 || !isInFile(frame.colorOffset, colorBytes)))
+				return false;
+		}
+		return true;
+	}
+
+	// whether the section [offset, offset + bytes) lies in the file (without overflow)
+	bool isInFile(uint64_t offset, uint64_t bytes) const {
+		return offset <= m_header.fileSize && bytes <= m_header.fileSize - offset;
+	}
+};
+
+
+/**
+ * Writes a frame store (see FrameStore) frame by frame: open(), addFrame() for every frame, close().
+ */
+class FrameStoreWriter {
+public:
+	~FrameStoreWriter() {
+		if (m_stream.is_open())
+			close();
+	}
+
+	/**
+	 * Creates the file. uint16 depth is stored as round(depth * depthScale), color is only stored if
+	 * colorWidth and colorHeight are not 0.
+	 */
+	bool open(const std::string& filename, FrameStore::DepthFormat depthFormat, float depthScale,
+		unsigned int depthWidth, unsigned int depthHeight, const Matrix3f& depthIntrinsics, const Matrix4f& depthExtrinsics,
+		unsigned int colorWidth, unsigned int colorHeight, const Matrix3f& colorIntrinsics, const Matrix4f& colorExtrinsics) {
+		m_stream.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!m_stream.is_open()) {
+			std::cout << "ERROR: unable to write output file " << filename << "!" << std::endl;
+			return false;
+		}
+
+		m_header = FrameStore::FrameStoreHeader();
+		m_header.depthFormat = depthFormat;
+		m_header.depthScale = depthFormat == FrameStore::DEPTH_UINT16 ? depthScale : 1.f;
+		m_header.depthWidth = depthWidth;
+		m_header.depthHeight = depthHeight;
+		m_header.hasColor = colorWidth > 0 && colorHeight > 0;
+		m_header.colorWidth = m_header.hasColor ? colorWidth : 0;
+		m_header.colorHeight = m_header.hasColor ? colorHeight : 0;
+		Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(m_header.depthIntrinsics) = depthIntrinsics;
+		Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(m_header.colorIntrinsics) = colorIntrinsics;
+		Eigen::Map<Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(m_header.depthExtrinsics) = depthExtrinsics;
+		Eigen::Map<Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(m_header.colorExtrinsics) = colorExtrinsics;
+
+		m_frames.clear();
+		m_written = 0;
+		// The header is written again by close(), once the frame table offset is known.
+		writeSection(0, &m_header, sizeof(m_header));
+		return bool(m_stream);
+	}
+
+	/**
+	 * Appends a frame: metric depth (MINF for invalid pixels) and the RGBX color image (ignored if the store
+	 * has no color).
+	 */
+	bool addFrame(const float* depth, const unsigned char* color, double depthTimeStamp, double colorTimeStamp, const Matrix4f& trajectory) {
+		FrameStore::FrameRecord frame;
+		frame.depthTimeStamp = depthTimeStamp;
+		frame.colorTimeStamp = colorTimeStamp;
+		Eigen::Map<Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(frame.trajectory) = trajectory;
+
+		const size_t nPixels = size_t(m_header.depthWidth) * m_header.depthHeight;
+		frame.depthOffset = FrameStore::alignOffset(m_written);
+		if (m_header.depthFormat == FrameStore::DEPTH_FLOAT32) {
+			writeSection(frame.depthOffset, depth, nPixels * sizeof(float));
+		}
+		else {
+			m_rawDepth.resize(nPixels);
+			for (size_t i = 0; i < nPixels; ++i) {
+				const float value = std::round(depth[i] * m_header.depthScale);
+				m_rawDepth[i] = std::isfinite(depth[i]) ? uint16_t(std::min(std::max(value, 0.f), 65535.f)) : 0;
+			}
+			writeSection(frame.depthOffset, m_rawDepth.data(), nPixels * sizeof(uint16_t));
+		}
+
+		if (m_header.hasColor) {
+			frame.colorOffset = FrameStore::alignOffset(m_written);
+			writeSection(frame.colorOffset, color, size_t(m_header.colorWidth) * m_header.colorHeight * 4);
+		}
+
+		m_frames.push_back(frame);
+		return bool(m_stream);
+	}
+
+	/**
+	 * Writes the frame table and the final header.
+	 */
+	bool close() {
+		m_header.nFrames = uint32_t(m_frames.size());
+		m_header.frameTableOffset = FrameStore::alignOffset(m_written);
+		writeSection(m_header.frameTableOffset, m_frames.data(), m_frames.size() * sizeof(FrameStore::FrameRecord));
+		m_header.fileSize = m_written;
+
+		m_stream.seekp(0);
+		m_stream.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+		const bool bSuccess = bool(m_stream);
+		m_stream.close();
+		return bSuccess;
+	}
+
+private:
+	std::ofstream m_stream;
+	FrameStore::FrameStoreHeader m_header;
+	std::vector<FrameStore::FrameRecord> m_frames;
+	std::vector<uint16_t> m_rawDepth;
+	uint64_t m_written = 0;
+
+	void writeSection(uint64_t sectionOffset, const void* data, uint64_t bytes) {
+		static const char padding[FrameStore::FrameStoreHeader::kAlignment] = {};
+		m_stream.write(padding, std::streamsize(sectionOffset - m_written));
+		m_stream.write(static_cast<const char*>(data), std::streamsize(bytes));
+		m_written = sectionOffset + bytes;
+	}
+};
@@ -2,9 +2,36 @@
 
 #include <iostream>
 #include <cstring>
+#include <cstdint>
+#include <mutex>
 
 //#pragma comment(lib, "FreeImage.lib")
 
+void FreeImageInitialiseOnce()
+{
+	static std::once_flag initialised;
+	std::call_once(initialised, []() { FreeImage_Initialise(); });
+}
+
+bool FreeImageGetImageSize(const std::string& filename, unsigned int& width, unsigned int& height)
+{
+	FreeImageInitialiseOnce();
+
+	FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str(), 0);
+	if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename(filename.c_str());
+	if (fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif)) return false;
+
+	// Plugins without header-only loading ignore the flag and decode the pixels.
+	FIBITMAP* dib = FreeImage_Load(fif, filename.c_str(), FIF_LOAD_NOPIXELS);
+	if (!dib) return false;
+
+	width = FreeImage_GetWidth(dib);
+	height = FreeImage_GetHeight(dib);
+	FreeImage_Unload(dib);
+
+	return true;
+}
+
 FreeImage::FreeImage() : w(0), h(0), nChannels(0), data(nullptr)
 {
 }
@@ -79,7 +106,7 @@ FreeImage FreeImage::ConvertToIntensity() const
 
 bool FreeImage::LoadImageFromFile(const std::string& filename, unsigned int width, unsigned int height)
 {
-	FreeImage_Initialise();
+	FreeImageInitialiseOnce();
 	if (data != nullptr) delete[] data;
 
 	//image format
@@ -142,6 +169,8 @@ bool FreeImage::LoadImageFromFile(const std::string& filename, unsigned int widt
 
 bool FreeImage::SaveImageToFile(const std::string& filename, bool flipY)
 {
+	FreeImageInitialiseOnce();
+
 	FREE_IMAGE_FORMAT fif = FIF_PNG;
 	FIBITMAP *dib = FreeImage_Allocate(w, h, 24);
 	RGBQUAD color;
@@ -217,7 +246,7 @@ void FreeImageB::SetDimensions(unsigned int width, unsigned int height, unsigned
 
 bool FreeImageB::LoadImageFromFile(const std::string& filename, unsigned int width, unsigned int height)
 {
-	FreeImage_Initialise();
+	FreeImageInitialiseOnce();
 	if (data != nullptr) delete[] data;
 
 	//image format
@@ -288,6 +317,8 @@ bool FreeImageB::LoadImageFromFile(const std::string& filename, unsigned int wid
 
 bool FreeImageB::SaveImageToFile(const std::string& filename, bool flipY)
 {
+	FreeImageInitialiseOnce();
+
 	FREE_IMAGE_FORMAT fif = FIF_PNG;
 	FIBITMAP *dib = FreeImage_Allocate(w, h, 24);
 	RGBQUAD color;
@@ -313,6 +344,51 @@ bool FreeImageB::SaveImageToFile(const std::string& filename, bool flipY)
 	return r;
 }
 
+bool FreeImageB::LoadRGBXFromFile(const std::string& filename, BYTE* rgbx, unsigned int width, unsigned int height, unsigned int decimation)
+{
+	FreeImageInitialiseOnce();
+
+	FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str(), 0);
+	if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename(filename.c_str());
+	if (fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif)) return false;
+
+	FIBITMAP* dib = FreeImage_Load(fif, filename.c_str());
+	if (!dib) return false;
+
+	// The pixels are read as 8-bit BGRA (or RGBA, see FI_RGBA_RED), other images are converted.
+	if (FreeImage_GetImageType(dib) != FIT_BITMAP)
+	{
+		FIBITMAP* hOldImage = dib;
+		dib = FreeImage_ConvertToStandardType(hOldImage);
+		FreeImage_Unload(hOldImage);
+		if (!dib) return false;
+	}
+	if (FreeImage_GetBPP(dib) != 32)
+	{
+		FIBITMAP* hOldImage = dib;
+		dib = FreeImage_ConvertTo32Bits(hOldImage);
+		FreeImage_Unload(hOldImage);
+		if (!dib) return false;
+	}
+
+	const unsigned int sourceHeight = FreeImage_GetHeight(dib);
+	if (decimation == 0 || FreeImage_GetWidth(dib) / decimation != width || sourceHeight / decimation != height)
+	{
+		FreeImage_Unload(dib);
+		return false;
+	}
+
+	// One pass from the rows (stored bottom-up), a plain reordering without decimation.
+	const unsigned int channelOffsets[4] = { FI_RGBA_RED, FI_RGBA_GREEN, FI_RGBA_BLUE, FI_RGBA_ALPHA };
+	ImageDecimation::decimateColor(width, height, decimation,
+		[dib, sourceHeight](unsigned int y) { return (const BYTE*)FreeImage_GetScanLine(dib, (int)(sourceHeight - 1 - y)); },
+		4, channelOffsets, rgbx);
+
+	FreeImage_Unload(dib);
+
+	return true;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
@@ -334,7 +410,7 @@ FreeImageU16F::~FreeImageU16F()
 
 bool FreeImageU16F::LoadImageFromFile(const std::string& filename, unsigned int width, unsigned int height)
 {
-	FreeImage_Initialise();
+	FreeImageInitialiseOnce();
 	if (data != nullptr) delete[] data;
 
 	//image format
@@ -402,3 +478,58 @@ bool FreeImageU16F::LoadImageFromFile(const std::string& filename, unsigned int
 	return true;
 }
 
+
+bool FreeImageU16F::LoadDepthFromFile(const std::string& filename, float* depth, unsigned int width, unsigned int height, float depthScale,
+	unsigned int decimation, ImageDecimation::DepthMode decimationMode)
+{
+	FreeImageInitialiseOnce();
+
+	FREE_IMAGE_FORMAT fif = FreeImage_GetFileType(filename.c_str(), 0);
+	if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename(filename.c_str());
+	if (fif == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(fif)) return false;
+
+	FIBITMAP* dib = FreeImage_Load(fif, filename.c_str());
+	if (!dib) return false;
+
+	// Depth images are 16-bit greyscale already, other images are converted.
+	if (FreeImage_GetImageType(dib) != FIT_UINT16)
+	{
+		FIBITMAP* hOldImage = dib;
+		dib = FreeImage_ConvertToType(hOldImage, FIT_UINT16);
+		FreeImage_Unload(hOldImage);
+		if (!dib) return false;
+	}
+
+	const unsigned int sourceHeight = FreeImage_GetHeight(dib);
+	if (decimation == 0 || FreeImage_GetWidth(dib) / decimation != width || sourceHeight / decimation != height)
+	{
+		FreeImage_Unload(dib);
+		return false;
+	}
+
+	if (decimation == 1)
+	{
+		// One pass from the 16-bit rows (stored bottom-up) to metric depth.
+		for (int y = 0; y < (int)height; ++y)
+		{
+			const uint16_t* src = (const uint16_t*)FreeImage_GetScanLine(dib, (int)height - 1 - y);
+			float* dst = depth + (size_t)y * width;
+			for (int x = 0; x < (int)width; ++x)
+			{
+				dst[x] = src[x] == 0 ? MINF : float(src[x]) / depthScale;
+			}
+		}
+	}
+	else
+	{
+		// The blocks are reduced straight from the 16-bit rows (stored bottom-up).
+		ImageDecimation::decimateDepth<uint16_t>(width, height, decimation, decimationMode,
+			[dib, sourceHeight](unsigned int y) { return (const uint16_t*)FreeImage_GetScanLine(dib, (int)(sourceHeight - 1 - y)); },
+			[depthScale](uint16_t value) { return float(value) / depthScale; },
+			depth);
+	}
+
+	FreeImage_Unload(dib);
+
+	return true;
+}
@@ -8,10 +8,19 @@
 
 #include <FreeImage.h>
 
+#include "ImageDecimation.h"
+
 #ifndef MINF
 #define MINF -std::numeric_limits<float>::infinity()
 #endif
 
+// Initialises the FreeImage library on the first call (thread-safe), later calls do nothing. Every loader and
+// writer calls it, so images can be decoded on the prefetch threads of VirtualSensor.
+void FreeImageInitialiseOnce();
+
+// Reads the size of an image from its header, without decoding the pixels.
+bool FreeImageGetImageSize(const std::string& filename, unsigned int& width, unsigned int& height);
+
 struct FreeImage {
 
 	FreeImage();
@@ -55,6 +64,10 @@ struct FreeImageB {
 
 	bool SaveImageToFile(const std::string& filename, bool flipY = false);
 
+	// Decodes an 8-bit color image directly into rgbx (row major, top row first), decimated by the given factor
+	// (see ImageDecimation) to width x height. Returns false if the file can't be read or has another size.
+	static bool LoadRGBXFromFile(const std::string& filename, BYTE* rgbx, unsigned int width, unsigned int height, unsigned int decimation = 1);
+
 	unsigned int w;
 	unsigned int h;
 	unsigned int nChannels;
@@ -70,6 +83,12 @@ struct FreeImageU16F {
 
 	bool LoadImageFromFile(const std::string& filename, unsigned int width = 0, unsigned int height = 0);
 
+	// Decodes a 16-bit depth image directly into depth (row major, top row first), as value / depthScale in meters
+	// and MINF for 0, decimated by the given factor (see ImageDecimation) to width x height. Returns false if the
+	// file can't be read or has another size.
+	static bool LoadDepthFromFile(const std::string& filename, float* depth, unsigned int width, unsigned int height, float depthScale,
+		unsigned int decimation = 1, ImageDecimation::DepthMode decimationMode = ImageDecimation::DEPTH_MEDIAN);
+
 	unsigned int w;
 	unsigned int h;
 	unsigned int nChannels;
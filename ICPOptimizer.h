@@ -6,11 +6,14 @@
 #include <ceres/ceres.h>
 #include <ceres/rotation.h>
 #include <flann/flann.hpp>
+#include <chrono>
 
 #include "SimpleMesh.h"
+#include "MeshBuilder.h"
 #include "NearestNeighbor.h"
 #include "PointCloud.h"
 #include "ProcrustesAligner.h"
+#include "Parallel.h"
 
 #define PROJECTIVE			0
 #define NEAREST_NEIGHBOR	1
@@ -222,29 +225,56 @@ protected:
 };
 
 
+/**
+ * Working memory of the ICP loop. The buffers are only ever grown, so once they are sized for the source
+ * cloud the iterations run without heap allocations (the Ceres path still allocates its problem).
+ */
+struct ICPWorkspace {
+	std::vector<int> sampleIndices;
+	PointSoA transformedPoints;
+	std::vector<Match> matches;
+	std::vector<int> matchedSourceIndices;
+	std::vector<int> matchedTargetIndices;
+
+	void reserve(size_t nPoints) {
+		sampleIndices.reserve(nPoints);
+		transformedPoints.reserve(nPoints);
+		matches.reserve(nPoints);
+		matchedSourceIndices.reserve(nPoints);
+		matchedTargetIndices.reserve(nPoints);
+	}
+};
+
+
 /**
  * ICP optimizer, using Ceres for optimization.
+ * An optimizer owns its working memory, concurrent registrations need one optimizer per thread.
  */
 class ICPOptimizer {
 public:
 	ICPOptimizer() : 
 		m_bUsePointToPlaneConstraints{ false },
-		m_nIterations{ 20 }
-		//#ifdef PROJECTIVE
-		//#else
-		//m_nearestNeighborSearch{ std::make_unique<NearestNeighborSearchFlann>()}
-		//#endif 
-	{ 
-		if(PROJECTIVE)
-			m_nearestNeighborSearch = std::make_unique<ProjectiveCorrespondences>();
-		else
-			m_nearestNeighborSearch = std::make_unique<NearestNeighborSearchFlann>();
+		m_nIterations{ 20 },
+		m_bVerbose{ true },
+		m_targetLeafSize{ 0.f },
+		m_voxelReduction{ VoxelReduction::Centroid },
+		m_nearestNeighborSearch{ createNearestNeighborSearch() }
+	{
+		setSourceLeafSize(0.f);
 	}
 
 	void setMatchingMaxDistance(float maxDistance) {
 		m_nearestNeighborSearch->setMatchingMaxDistance(maxDistance);
 	}
 
+	/**
+	 * Enables/disables the progress output (on by default). Concurrent registrations should disable it.
+	 */
+	void setVerbose(bool bVerbose) {
+		m_bVerbose = bVerbose;
+		m_nearestNeighborSearch->setVerbose(bVerbose);
+	}
+
 	void usePointToPlaneConstraints(bool bUsePointToPlaneConstraints) {
 		m_bUsePointToPlaneConstraints = bUsePointToPlaneConstraints;
 	}
@@ -253,48 +283,150 @@ public:
 		m_nIterations = nIterations;
 	}
 
-	Matrix4f estimatePose(const PointCloud& source, const PointCloud& target, Matrix4f initialPose = Matrix4f::Identity(), int debugFrame = -1) {
-		// Build the index of the FLANN tree (for fast nearest neighbor lookup).
-		m_nearestNeighborSearch->buildIndex(target.getPoints());
+	/**
+	 * Source sampling of one level of the HEIRARCHICAL schedule (0 is the coarsest, 2 the finest level).
+	 * Without HEIRARCHICAL only level 2 is used.
+	 */
+	void setSampling(int level, const SamplingStrategy& strategy) {
+		m_sampling[level] = strategy;
+	}
+
+	/**
+	 * Uses the same source sampling on all levels.
+	 */
+	void setSampling(const SamplingStrategy& strategy) {
+		for (auto& sampling : m_sampling)
+			sampling = strategy;
+	}
+
+	/**
+	 * Samples the source on voxel grids of 4x, 2x and 1x the leaf size (levels 0 to 2). A leaf size of 0
+	 * restores the default sampling: every 16th, 8th and every point.
+	 */
+	void setSourceLeafSize(float leafSize) {
+		for (int level = 0; level < 3; ++level) {
+			if (leafSize > 0.f)
+				m_sampling[level] = SamplingStrategy::voxelGrid(leafSize * float(1 << (2 - level)), m_voxelReduction);
+			else
+				m_sampling[level] = SamplingStrategy::strided(level == 0 ? 16 : level == 1 ? 8 : 1);
+		}
+	}
+
+	/**
+	 * Voxel-grid leaf size of the target (0 disables the filter). Ignored for projective correspondences, which
+	 * need the organized target, and when estimating against a prebuilt index.
+	 */
+	void setTargetLeafSize(float leafSize) {
+		m_targetLeafSize = leafSize;
+	}
+
+	/**
+	 * Reduction of the target voxel grid. Voxel-grid source sampling picks the point closest to the centroid or
+	 * the first point of every voxel accordingly.
+	 */
+	void setVoxelReduction(VoxelReduction reduction) {
+		m_voxelReduction = reduction;
+		for (auto& sampling : m_sampling)
+			sampling.reduction = reduction;
+	}
+
+	/**
+	 * Creates a search structure of the configured type (projective or nearest neighbor).
+	 */
+	static std::unique_ptr<NearestNeighborSearch> createNearestNeighborSearch() {
+		if(PROJECTIVE)
+			return std::make_unique<ProjectiveCorrespondences>();
+		else
+			return std::make_unique<NearestNeighborSearchFlann>();
+	}
+
+	/**
+	 * Builds the correspondence search structure for the given target (FLANN tree or projective lookup).
+	 */
+	void buildIndex(NearestNeighborSearch& nearestNeighborSearch, const PointCloud& target) const {
+		nearestNeighborSearch.buildIndex(target.getPoints());
 		if(PROJECTIVE)
 		{
 			Matrix3f depthIntrinsics = target.getDepthIntrinsics();
-			std::cout << "depthIntrinsics " << depthIntrinsics <<std::endl;
-			std::cout << "target.getWidth() " << target.getWidth() <<std::endl;
-			std::cout << "target.getHeight() " << target.getHeight() <<std::endl;
-			m_nearestNeighborSearch->setDepthIntrinsicsAndRes(depthIntrinsics, target.getWidth(), target.getHeight());
+			if (m_bVerbose) {
+				std::cout << "depthIntrinsics " << depthIntrinsics <<std::endl;
+				std::cout << "target.getWidth() " << target.getWidth() <<std::endl;
+				std::cout << "target.getHeight() " << target.getHeight() <<std::endl;
+			}
+			nearestNeighborSearch.setDepthIntrinsicsAndRes(depthIntrinsics, target.getWidth(), target.getHeight());
+		}
+	}
+
+	Matrix4f estimatePose(const PointCloud& source, const PointCloud& target, Matrix4f initialPose = Matrix4f::Identity(), int debugFrame = -1) {
+		if (m_targetLeafSize > 0.f && !PROJECTIVE) {
+			m_filteredTarget = target.voxelGridFilter(m_targetLeafSize, m_voxelReduction);
+			if (m_bVerbose)
+				std::cout << "Target voxel grid: " << target.getPoints().size() << " -> " << m_filteredTarget.getPoints().size() << " points" << std::endl;
+
+			buildIndex(*m_nearestNeighborSearch, m_filteredTarget);
+			return estimatePose(source, m_filteredTarget, *m_nearestNeighborSearch, initialPose, debugFrame);
 		}
 
+		// Build the index of the FLANN tree (for fast nearest neighbor lookup).
+		buildIndex(*m_nearestNeighborSearch, target);
+
+		return estimatePose(source, target, *m_nearestNeighborSearch, initialPose, debugFrame);
+	}
+
+	/**
+	 * Estimates the pose against a prebuilt index of the target (see buildIndex()). The index is only read,
+	 * so it can be shared by optimizers running concurrently on the same target.
+	 */
+	Matrix4f estimatePose(const PointCloud& source, const PointCloud& target, const NearestNeighborSearch& nearestNeighborSearch, Matrix4f initialPose = Matrix4f::Identity(), int debugFrame = -1) {
 		// The initial estimate can be given as an argument.
 		Matrix4f estimatedPose = initialPose;
 
+		ICPWorkspace& workspace = m_workspace;
+		workspace.reserve(source.getPoints().size());
+
 		// We optimize on the transformation in SE3 notation: 3 parameters for the axis-angle vector of the rotation (its length presents
 		// the rotation angle) and 3 parameters for the translation vector. 
 		double incrementArray[6];
 		auto poseIncrement = PoseIncrement<double>(incrementArray);
 		poseIncrement.setZero();
 
+		// Views of the sampled source points of every hierarchy level, built once per call. Strided levels view the
+		// source directly, the index lists of the other deterministic samplings are cached with the source cloud.
+		// Random samples are redrawn into the workspace every iteration.
+		SampleCache::IndexList levelIndices[3];
+		PointView levelViews[3];
+		for (int level = HEIRARCHICAL ? 0 : 2; level < 3; ++level) {
+			const SamplingStrategy& sampling = m_sampling[level];
+			if (sampling.method == SamplingMethod::Stride) {
+				levelViews[level] = source.sampleView(sampling.stride);
+			}
+			else if (sampling.isCacheable()) {
+				levelIndices[level] = source.getSampleIndices(sampling);
+				levelViews[level] = PointView(source.getPoints(), *levelIndices[level]);
+			}
+			if (m_bVerbose && sampling.isCacheable())
+				std::cout << "Sampled " << levelViews[level].size() << " source points (level " << level << ")" << std::endl;
+		}
+
 		for (int i = 0; i < m_nIterations; ++i) {
 			// Compute the matches.
-			std::cout << "iteration ..." << i <<std::endl;
-			std::cout << "Matching points ..." << std::endl;
-			clock_t begin = clock();
-			std::vector<Vector3f> transformedPoints;
-			if(HEIRARCHICAL){
-				if(i >= m_nIterations/2){
-					transformedPoints = transformPoints(source.samplePoints(1), estimatedPose);
-				}
-				else if(i >= m_nIterations/4){
-					transformedPoints = transformPoints(source.samplePoints(8), estimatedPose);	
-				}
-				else {
-					transformedPoints = transformPoints(source.samplePoints(16), estimatedPose);	
-				}
+			if (m_bVerbose) {
+				std::cout << "iteration ..." << i <<std::endl;
+				std::cout << "Matching points ..." << std::endl;
 			}
-			else
-				transformedPoints = transformPoints(source.getPoints(), estimatedPose);
-			std::cout << "Estimated pose: " << std::endl << estimatedPose << std::endl;
-			auto matches = m_nearestNeighborSearch->queryMatches(transformedPoints);
+			auto begin = std::chrono::steady_clock::now();
+			const PointSoA& transformedPoints = workspace.transformedPoints;
+			const int level = HEIRARCHICAL ? getHierarchyLevel(i) : 2;
+			PointView sourceView = levelViews[level];
+			if (!m_sampling[level].isCacheable()) {
+				PointSampler::select(m_sampling[level], source.getPoints(), source.getNormals(), m_rng, workspace.sampleIndices);
+				sourceView = PointView(source.getPoints(), workspace.sampleIndices);
+			}
+			PointKernels::transform(sourceView, estimatedPose, workspace.transformedPoints);
+			if (m_bVerbose)
+				std::cout << "Estimated pose: " << std::endl << estimatedPose << std::endl;
+			const std::vector<Match>& matches = workspace.matches;
+			nearestNeighborSearch.queryMatches(transformedPoints, workspace.matches);
 
 			if(debugFrame > -1 && i == 0)
 			{	
@@ -302,13 +434,15 @@ public:
 				// SimpleMesh currentCameraMesh = SimpleMesh::camera(currentCameraPose, 0.0015f);
 				// SimpleMesh resultingMesh = SimpleMesh::joinMeshes(currentDepthMesh, currentCameraMesh, Matrix4f::Identity());
 				SimpleMesh resultingMesh;
-				std::vector<Vector3f> targetPoints = target.getPoints();
+				MeshBuilder builder{ resultingMesh };
+				builder.reserveInstances(SimpleMesh::cylinder(Vector3f::Zero(), Vector3f::UnitZ(), 1.f, 2, 15), transformedPoints.size() / 100 + 1);
+				const PointSoA& targetPoints = target.getPoints();
 				for (unsigned j = 0; j < transformedPoints.size(); ++j) { // sourcePoints.size()
 					const auto match = matches[j];
 					if (match.idx >= 0 && (j%100 == 0)) {
-						const auto& sourcePoint = transformedPoints[j];
-						const auto& targetPoint = targetPoints[match.idx];
-						resultingMesh = SimpleMesh::joinMeshes(SimpleMesh::cylinder(sourcePoint, targetPoint, 0.002f, 2, 15), resultingMesh, Matrix4f::Identity());
+						const Vector3f sourcePoint = transformedPoints[j];
+						const Vector3f targetPoint = targetPoints[match.idx];
+						builder.addCylinder(sourcePoint, targetPoint, 0.002f, 2, 15);
 					}
 				}
 
@@ -316,9 +450,10 @@ public:
 
 			}
 
-			clock_t end = clock();
-			double elapsedSecs = double(end - begin) / CLOCKS_PER_SEC;
-			std::cout << "Completed in " << elapsedSecs << " seconds." << std::endl;
+			auto end = std::chrono::steady_clock::now();
+			double elapsedSecs = std::chrono::duration<double>(end - begin).count();
+			if (m_bVerbose)
+				std::cout << "Completed in " << elapsedSecs << " seconds." << std::endl;
 			Matrix4f matrix;
 			if(LM)
 			{
@@ -333,7 +468,8 @@ public:
 				// Run the solver (for one iteration).
 				ceres::Solver::Summary summary;
 				ceres::Solve(options, &problem, &summary);
-				std::cout << summary.BriefReport() << std::endl;
+				if (m_bVerbose)
+					std::cout << summary.BriefReport() << std::endl;
 				//std::cout << summary.FullReport() << std::endl;
 
 				// Update the current pose estimate (we always update the pose from the left, using left-increment notation).
@@ -341,29 +477,34 @@ public:
 			}
 			else if(SVD)
 			{
-				std::cout << "Enter SVD "<< std::endl;
-				std::vector<Vector3f> sourcePoints;
-				std::vector<Vector3f> targetPointsMatch;
-				std::vector<Vector3f> targetPoints = target.getPoints();
-				int match_count=0;
+				if (m_bVerbose)
+					std::cout << "Enter SVD "<< std::endl;
+				// The matched pairs are passed to the solver as index views, nothing is gathered.
+				std::vector<int>& sourceIndices = workspace.matchedSourceIndices;
+				std::vector<int>& targetIndices = workspace.matchedTargetIndices;
+				sourceIndices.clear();
+				targetIndices.clear();
 				const unsigned nPoints = transformedPoints.size();
 				for (unsigned i = 0; i < nPoints; ++i) {
 					const auto match = matches[i];
 					if (match.idx >= 0) {
-						sourcePoints.push_back(transformedPoints[i]);
-						targetPointsMatch.push_back(targetPoints[match.idx]);
-						match_count++;
+						sourceIndices.push_back(i);
+						targetIndices.push_back(match.idx);
 					}
 				}
-				std::cout << "Number of matched points ..." << match_count << std::endl;
+				const int match_count = sourceIndices.size();
+				if (m_bVerbose) {
+					std::cout << "Number of matched points ..." << match_count << std::endl;
+					std::cout << "	Start Estimating Pose "<< std::endl;
+				}
 				ProcrustesAligner aligner;
-				std::cout << "	Start Estimating Pose "<< std::endl;
-				matrix = aligner.estimatePose(sourcePoints, targetPointsMatch);
+				matrix = aligner.estimatePose(PointView(transformedPoints, sourceIndices), PointView(target.getPoints(), targetIndices));
 			}
 			estimatedPose = matrix * estimatedPose;
 			poseIncrement.setZero();
 
-			std::cout << "Optimization iteration done." << std::endl;
+			if (m_bVerbose)
+				std::cout << "Optimization iteration done." << std::endl;
 		}
 
 		return estimatedPose;
@@ -372,40 +513,45 @@ public:
 private:
 	bool m_bUsePointToPlaneConstraints;
 	unsigned m_nIterations;
+	bool m_bVerbose;
+	float m_targetLeafSize;
+	VoxelReduction m_voxelReduction;
+	SamplingStrategy m_sampling[3];
+	std::mt19937 m_rng;
 	std::unique_ptr<NearestNeighborSearch> m_nearestNeighborSearch;
+	ICPWorkspace m_workspace;
+	PointCloud m_filteredTarget;
 
-	std::vector<Vector3f> transformPoints(const std::vector<Vector3f>& sourcePoints, const Matrix4f& pose) {
-		std::vector<Vector3f> transformedPoints;
-		transformedPoints.reserve(sourcePoints.size());
-
-		const auto rotation = pose.block(0, 0, 3, 3);
-		const auto translation = pose.block(0, 3, 3, 1);
-
-		for (const auto& point : sourcePoints) {
-			transformedPoints.push_back(rotation * point + translation);
-		}
-
-		return transformedPoints;
+	/**
+	 * Level of the hierarchical schedule at the given iteration: 0 (coarsest) for the first quarter of the
+	 * iterations, 1 for the second quarter and 2 (full resolution) for the second half.
+	 */
+	int getHierarchyLevel(int iteration) const {
+		if (iteration >= int(m_nIterations) / 2)
+			return 2;
+		else if (iteration >= int(m_nIterations) / 4)
+			return 1;
+		return 0;
 	}
 
-	void configureSolver(ceres::Solver::Options& options) {
+	void configureSolver(ceres::Solver::Options& options) const {
 		// Ceres options.
 		options.trust_region_strategy_type = ceres::LEVENBERG_MARQUARDT;
 		options.use_nonmonotonic_steps = false;
 		options.linear_solver_type = ceres::DENSE_QR;
-		options.minimizer_progress_to_stdout = 1;
+		options.minimizer_progress_to_stdout = m_bVerbose;
 		options.max_num_iterations = 1;
-		options.num_threads = 8;
+		options.num_threads = Parallel::getNumThreads();
 	}
 
-	void prepareConstraints(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals, const std::vector<Match> matches, const PoseIncrement<double>& poseIncrement, ceres::Problem& problem) const {
+	void prepareConstraints(const PointSoA& sourcePoints, const PointSoA& targetPoints, const PointSoA& targetNormals, const std::vector<Match>& matches, const PoseIncrement<double>& poseIncrement, ceres::Problem& problem) const {
 		const unsigned nPoints = sourcePoints.size();
 
 		for (unsigned i = 0; i < nPoints; ++i) {
 			const auto match = matches[i];
 			if (match.idx >= 0) {
-				const auto& sourcePoint = sourcePoints[i];
-				const auto& targetPoint = targetPoints[match.idx];
+				const Vector3f sourcePoint = sourcePoints[i];
+				const Vector3f targetPoint = targetPoints[match.idx];
 
 				if (!sourcePoint.allFinite() && !targetPoint.allFinite()) 
 					continue;
@@ -419,7 +565,7 @@ private:
 
 
 				if (m_bUsePointToPlaneConstraints) {
-					const auto& targetNormal = targetNormals[match.idx];
+					const Vector3f targetNormal = targetNormals[match.idx];
 
 					if (!targetNormal.allFinite())
 						continue;
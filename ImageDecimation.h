@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "Parallel.h"
+
+#ifndef MINF
+#define MINF -std::numeric_limits<float>::infinity()
+#endif
+
+/**
+ * Reduces depth and color images by an integer factor while they are converted from their source rows, so no
+ * full-resolution copy of the image is made. Pixel (x, y) of the result covers the source block
+ * [x * factor, (x + 1) * factor) x [y * factor, (y + 1) * factor), the source is cropped to a multiple of factor.
+ */
+struct ImageDecimation {
+	enum DepthMode {
+		// nearest valid depth of a block (keeps foreground edges)
+		DEPTH_MIN,
+		// lower median of the valid depths of a block (robust against flying pixels)
+		DEPTH_MEDIAN
+	};
+
+	// largest supported factor
+	static const unsigned int MAX_FACTOR = 16;
+
+	/**
+	 * Decimates depth into width x height pixels. sourceRow(y) returns row y of the source (top row first) as
+	 * const T*, toDepth(value) converts a source value into metric depth (not positive or not finite if invalid).
+	 * Blocks without a valid depth get MINF.
+	 */
+	template <typename T, typename SourceRow, typename ToDepth>
+	static void decimateDepth(unsigned int width, unsigned int height, unsigned int factor, DepthMode mode, SourceRow sourceRow, ToDepth toDepth, float* depth) {
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int y = 0; y < (int)height; ++y) {
+			float values[MAX_FACTOR * MAX_FACTOR];
+			float* dst = depth + (size_t)y * width;
+			for (unsigned int x = 0; x < width; ++x) {
+				unsigned int nValues = 0;
+				for (unsigned int blockY = 0; blockY < factor; ++blockY) {
+					const T* src = sourceRow(y * factor + blockY) + x * factor;
+					for (unsigned int blockX = 0; blockX < factor; ++blockX) {
+						const float value = toDepth(src[blockX]);
+						if (value > 0.0f && std::isfinite(value))
+							values[nValues++] = value;
+					}
+				}
+
+				if (nValues == 0) {
+					dst[x] = MINF;
+				}
+				else if (mode == DEPTH_MIN) {
+					dst[x] = *std::min_element(values, values + nValues);
+				}
+				else {
+					float* median = values + (nValues - 1) / 2;
+					std::nth_element(values, median, values + nValues);
+					dst[x] = *median;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Decimates color into width x height RGBX pixels, the rounded mean of every block. sourceRow(y) returns row y
+	 * of the source (top row first) as const unsigned char* with bytesPerPixel bytes per pixel, channelOffsets are
+	 * the offsets of red, green, blue and alpha in a pixel.
+	 */
+	template <typename SourceRow>
+	static void decimateColor(unsigned int width, unsigned int height, unsigned int factor, SourceRow sourceRow, unsigned int bytesPerPixel, const unsigned int channelOffsets[4], unsigned char* rgbx) {
+		const unsigned int nBlockPixels = factor * factor;
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int y = 0; y < (int)height; ++y) {
+			unsigned char* dst = rgbx + (size_t)4 * y * width;
+			for (unsigned int x = 0; x < width; ++x) {
+				unsigned int sum[4] = { 0, 0, 0, 0 };
+				for (unsigned int blockY = 0; blockY < factor; ++blockY) {
+					const unsigned char* src = sourceRow(y * factor + blockY) + (size_t)bytesPerPixel * x * factor;
+					for (unsigned int blockX = 0; blockX < factor; ++blockX, src += bytesPerPixel) {
+						for (unsigned int c = 0; c < 4; ++c)
+							sum[c] += src[channelOffsets[c]];
+					}
+				}
+				for (unsigned int c = 0; c < 4; ++c)
+					dst[4 * x + c] = (unsigned char)((sum[c] + nBlockPixels / 2) / nBlockPixels);
+			}
+		}
+	}
+};
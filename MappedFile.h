@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MAPPED_FILE_USE_MMAP 1
+#endif
+
+#include "Eigen.h"
+
+/**
+ * Read-only view of a whole file: memory-mapped where mmap is available, otherwise (or if mapping fails) read
+ * into an aligned buffer. The data starts at least 16-byte aligned. Objects that point into the file keep a
+ * shared pointer to it, so the mapping lives as long as they do.
+ * A copy-on-write mapping may be written through writableData(): written pages become private copies and the
+ * file itself is never modified.
+ */
+class MappedFile {
+public:
+	/**
+	 * Maps the file, returns nullptr if it can't be opened.
+	 */
+	static std::shared_ptr<MappedFile> open(const std::string& filename, bool bCopyOnWrite = false) {
+		std::shared_ptr<MappedFile> file{ new MappedFile() };
+		file->m_bCopyOnWrite = bCopyOnWrite;
+#ifdef MAPPED_FILE_USE_MMAP
+		if (file->map(filename))
+			return file;
+#endif
+		if (file->read(filename))
+			return file;
+		return nullptr;
+	}
+
+	~MappedFile() {
+#ifdef MAPPED_FILE_USE_MMAP
+		if (m_mapping)
+			munmap(m_mapping, m_size);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const {
+		return m_data;
+	}
+
+	/**
+	 * Writable pointer to the data of a copy-on-write mapping, nullptr for read-only mappings.
+	 */
+	char* writableData() {
+		return m_bCopyOnWrite ? const_cast<char*>(m_data) : nullptr;
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	bool isMapped() const {
+		return m_mapping != nullptr;
+	}
+
+private:
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	void* m_mapping = nullptr;
+	bool m_bCopyOnWrite = false;
+	std::vector<char, Eigen::aligned_allocator<char>> m_buffer;
+
+	MappedFile() {}
+
+#ifdef MAPPED_FILE_USE_MMAP
+	bool map(const std::string& filename) {
+		const int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat status;
+		if (fstat(fd, &status) != 0 || status.st_size <= 0) {
+			close(fd);
+			return false;
+		}
+
+		const int protection = m_bCopyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+		void* mapping = mmap(nullptr, size_t(status.st_size), protection, MAP_PRIVATE, fd, 0);
+		// The mapping stays valid after the descriptor is closed.
+		close(fd);
+		if (mapping == MAP_FAILED)
+			return false;
+
+		m_mapping = mapping;
+		m_data = static_cast<const char*>(mapping);
+		m_size = size_t(status.st_size);
+		return true;
+	}
+#endif
+
+	bool read(const std::string& filename) {
+		std::ifstream is(filename, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!is.is_open())
+			return false;
+
+		const std::streamsize size = is.tellg();
+		if (size < 0)
+			return false;
+		is.seekg(0);
+
+		m_buffer.resize(size_t(size));
+		if (!is.read(m_buffer.data(), size))
+			return false;
+
+		m_data = m_buffer.data();
+		m_size = m_buffer.size();
+		return true;
+	}
+};
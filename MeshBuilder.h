@@ -0,0 +1,122 @@
+#pragma once
+
+#include <map>
+#include <utility>
+
+#include "Eigen.h"
+#include "SimpleMesh.h"
+
+/**
+ * Appends meshes and primitives (spheres, cameras, cylinders) to a mesh in place. Unlike chaining
+ * SimpleMesh::joinMeshes(), which copies the whole growing mesh for every added primitive, every append only
+ * touches the new vertices and triangles (amortized, or exactly with reserve()).
+ * The primitives are instances of unit templates that are generated once per builder and placed with an affine
+ * transformation.
+ */
+class MeshBuilder {
+public:
+	explicit MeshBuilder(SimpleMesh& mesh) :
+		m_mesh(mesh),
+		m_sphereTemplate{ SimpleMesh::sphere(Vector3f::Zero(), 1.f) },
+		m_cameraTemplate{ SimpleMesh::camera(Matrix4f::Identity(), 1.f) }
+	{ }
+
+	SimpleMesh& getMesh() {
+		return m_mesh;
+	}
+
+	/**
+	 * Reserves space for the given number of additional vertices and triangles.
+	 */
+	void reserve(size_t nVertices, size_t nTriangles) {
+		m_mesh.getVertices().reserve(m_mesh.getVertices().size() + nVertices);
+		m_mesh.getTriangles().reserve(m_mesh.getTriangles().size() + nTriangles);
+	}
+
+	/**
+	 * Reserves space for nInstances primitives like the given one (e.g. sphere() for spheres).
+	 */
+	void reserveInstances(const SimpleMesh& primitive, size_t nInstances) {
+		reserve(primitive.getVertices().size() * nInstances, primitive.getTriangles().size() * nInstances);
+	}
+
+	/**
+	 * Appends a mesh with its vertices transformed by pose (like joinMeshes(mesh, target, pose)).
+	 */
+	void append(const SimpleMesh& mesh, const Matrix4f& pose = Matrix4f::Identity()) {
+		appendInstance(mesh, pose, nullptr);
+	}
+
+	/**
+	 * Appends a mesh with its vertices transformed by pose and all of them set to color.
+	 */
+	void append(const SimpleMesh& mesh, const Matrix4f& pose, const Vector4uc& color) {
+		appendInstance(mesh, pose, &color);
+	}
+
+	void addSphere(const Vector3f& center, float scale = 1.f, const Vector4uc& color = { 0, 0, 255, 255 }) {
+		Matrix4f transformation = Matrix4f::Identity();
+		transformation.block(0, 0, 3, 3) *= scale;
+		transformation.block(0, 3, 3, 1) = center;
+		appendInstance(m_sphereTemplate, transformation, &color);
+	}
+
+	void addCamera(const Matrix4f& cameraPose, float scale = 1.f, const Vector4uc& color = { 255, 0, 0, 255 }) {
+		Matrix4f transformation = cameraPose.inverse();
+		transformation.block(0, 0, 3, 3) *= scale;
+		appendInstance(m_cameraTemplate, transformation, &color);
+	}
+
+	/**
+	 * Adds a cylinder from p0 to p1 (see SimpleMesh::cylinder()).
+	 */
+	void addCylinder(const Vector3f& p0, const Vector3f& p1, float radius, unsigned stacks, unsigned slices, const Vector4uc& color = Vector4uc{ 0, 0, 255, 255 }) {
+		const Vector3f axis = p1 - p0;
+		const float height = axis.norm();
+
+		// The unit cylinder (radius 1, from z = 0 to z = 1) is scaled, then rotated onto the axis.
+		Matrix4f transformation = Matrix4f::Identity();
+		const Matrix3f rotation = height > 0.f ? Matrix3f(Eigen::Quaternionf::FromTwoVectors(Vector3f::UnitZ(), axis).toRotationMatrix()) : Matrix3f::Identity();
+		transformation.block(0, 0, 3, 3) = rotation * Vector3f(radius, radius, height).asDiagonal();
+		transformation.block(0, 3, 3, 1) = p0;
+		appendInstance(getCylinderTemplate(stacks, slices), transformation, &color);
+	}
+
+private:
+	SimpleMesh& m_mesh;
+	SimpleMesh m_sphereTemplate;
+	SimpleMesh m_cameraTemplate;
+	std::map<std::pair<unsigned, unsigned>, SimpleMesh> m_cylinderTemplates;
+
+	const SimpleMesh& getCylinderTemplate(unsigned stacks, unsigned slices) {
+		const auto key = std::make_pair(stacks, slices);
+		auto it = m_cylinderTemplates.find(key);
+		if (it == m_cylinderTemplates.end())
+			it = m_cylinderTemplates.emplace(key, SimpleMesh::cylinder(Vector3f::Zero(), Vector3f::UnitZ(), 1.f, stacks, slices)).first;
+		return it->second;
+	}
+
+	void appendInstance(const SimpleMesh& instance, const Matrix4f& transformation, const Vector4uc* color) {
+		auto& vertices = m_mesh.getVertices();
+		auto& triangles = m_mesh.getTriangles();
+		const auto& instanceVertices = instance.getVertices();
+		const auto& instanceTriangles = instance.getTriangles();
+
+		const size_t vertexOffset = vertices.size();
+		const size_t triangleOffset = triangles.size();
+		vertices.resize(vertexOffset + instanceVertices.size());
+		triangles.resize(triangleOffset + instanceTriangles.size());
+
+		for (size_t i = 0; i < instanceVertices.size(); ++i) {
+			Vertex& v = vertices[vertexOffset + i];
+			v.position = transformation * instanceVertices[i].position;
+			v.color = color ? *color : instanceVertices[i].color;
+		}
+
+		const unsigned offset = unsigned(vertexOffset);
+		for (size_t i = 0; i < instanceTriangles.size(); ++i) {
+			const Triangle& t = instanceTriangles[i];
+			triangles[triangleOffset + i] = Triangle{ t.idx0 + offset, t.idx1 + offset, t.idx2 + offset };
+		}
+	}
+};
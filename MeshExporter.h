@@ -0,0 +1,171 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "Eigen.h"
+#include "VirtualSensor.h"
+#include "SimpleMesh.h"
+#include "MeshBuilder.h"
+#include "ThreadPool.h"
+
+/**
+ * Meshes sensor frames and writes them to disk on background threads, so that tracking doesn't wait for the
+ * export. submit() copies the current depth and color frame and returns; at most maxPendingFrames frames are
+ * queued or in progress, further submissions block until one of them is written (backpressure bounds the
+ * memory). The destructor waits for all pending exports.
+ */
+class AsyncMeshExporter {
+public:
+	explicit AsyncMeshExporter(unsigned nThreads = 1, unsigned maxPendingFrames = 4) :
+		m_edgeThreshold{ 0.1f },
+		m_cameraScale{ 0.0015f },
+		m_maxPendingFrames{ std::max(maxPendingFrames, 1u) },
+		m_nPendingFrames{ 0 },
+		m_nFailedFrames{ 0 },
+		m_pool{ std::max(nThreads, 1u) }
+	{ }
+
+	~AsyncMeshExporter() {
+		flush();
+	}
+
+	AsyncMeshExporter(const AsyncMeshExporter&) = delete;
+	AsyncMeshExporter& operator=(const AsyncMeshExporter&) = delete;
+
+	/**
+	 * Maximum edge length of the frame mesh triangles (see SimpleMesh).
+	 */
+	void setEdgeThreshold(float edgeThreshold) {
+		m_edgeThreshold = edgeThreshold;
+	}
+
+	/**
+	 * Size of the camera added at the frame pose, 0 exports the frame mesh only.
+	 */
+	void setCameraScale(float cameraScale) {
+		m_cameraScale = cameraScale;
+	}
+
+	/**
+	 * Queues the export of the current sensor frame at cameraPose to filename. Blocks while the queue is full.
+	 * Returns false if the depth of the frame can't be decoded or an earlier export failed. A frame whose color
+	 * can't be decoded is exported white.
+	 */
+	bool submit(VirtualSensor& sensor, const Matrix4f& cameraPose, const std::string& filename) {
+		const float* depth = sensor.getDepth();
+		if (!depth) {
+			std::cout << "Mesh export: no depth for " << filename << std::endl;
+			return false;
+		}
+		const unsigned char* color = sensor.getColorRGBX();
+
+		auto frame = std::allocate_shared<Frame>(Eigen::aligned_allocator<Frame>());
+		const size_t nDepthPixels = size_t(sensor.getDepthImageWidth()) * sensor.getDepthImageHeight();
+		const size_t nColorPixels = size_t(sensor.getColorImageWidth()) * sensor.getColorImageHeight();
+		frame->depthMap.assign(depth, depth + nDepthPixels);
+		if (color)
+			frame->colorMap.assign(color, color + 4 * nColorPixels);
+		frame->depthIntrinsics = sensor.getDepthIntrinsics();
+		frame->depthExtrinsics = sensor.getDepthExtrinsics();
+		frame->colorIntrinsics = sensor.getColorIntrinsics();
+		frame->colorExtrinsics = sensor.getColorExtrinsics();
+		frame->depthWidth = sensor.getDepthImageWidth();
+		frame->depthHeight = sensor.getDepthImageHeight();
+		frame->colorWidth = sensor.getColorImageWidth();
+		frame->colorHeight = sensor.getColorImageHeight();
+		frame->cameraPose = cameraPose;
+		frame->filename = filename;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_nPendingFrames < m_maxPendingFrames; });
+			++m_nPendingFrames;
+		}
+
+		const float edgeThreshold = m_edgeThreshold;
+		const float cameraScale = m_cameraScale;
+		m_pool.submit([this, frame, edgeThreshold, cameraScale]() {
+			// An exception fails the frame as well, the pending count must drop in any case.
+			bool bSuccess = false;
+			try {
+				bSuccess = exportFrame(*frame, edgeThreshold, cameraScale);
+			}
+			catch (const std::exception& e) {
+				std::cout << "Exception while writing mesh " << frame->filename << ": " << e.what() << std::endl;
+			}
+			catch (...) {
+				std::cout << "Exception while writing mesh " << frame->filename << std::endl;
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				--m_nPendingFrames;
+				if (!bSuccess) {
+					++m_nFailedFrames;
+					std::cout << "Failed to write mesh " << frame->filename << std::endl;
+				}
+			}
+			m_condition.notify_all();
+		});
+
+		return getNbOfFailedFrames() == 0;
+	}
+
+	/**
+	 * Waits until all queued frames are written. Returns false if any export failed.
+	 */
+	bool flush() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_condition.wait(lock, [this]() { return m_nPendingFrames == 0; });
+		return m_nFailedFrames == 0;
+	}
+
+	unsigned getNbOfFailedFrames() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_nFailedFrames;
+	}
+
+private:
+	struct Frame {
+		EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+		std::vector<float> depthMap;
+		std::vector<unsigned char> colorMap;
+		Matrix3f depthIntrinsics;
+		Matrix4f depthExtrinsics;
+		Matrix3f colorIntrinsics;
+		Matrix4f colorExtrinsics;
+		unsigned depthWidth;
+		unsigned depthHeight;
+		unsigned colorWidth;
+		unsigned colorHeight;
+		Matrix4f cameraPose;
+		std::string filename;
+	};
+
+	float m_edgeThreshold;
+	float m_cameraScale;
+	unsigned m_maxPendingFrames;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	unsigned m_nPendingFrames;
+	unsigned m_nFailedFrames;
+
+	// Declared last, so the workers are joined before the counters are destroyed.
+	ThreadPool m_pool;
+
+	static bool exportFrame(const Frame& frame, float edgeThreshold, float cameraScale) {
+		SimpleMesh mesh{ frame.depthMap.data(), frame.depthIntrinsics, frame.depthExtrinsics, frame.depthWidth, frame.depthHeight, frame.cameraPose, edgeThreshold,
+			frame.colorMap.empty() ? nullptr : frame.colorMap.data(), frame.colorIntrinsics, frame.colorExtrinsics, frame.colorWidth, frame.colorHeight };
+		if (cameraScale > 0.f)
+			MeshBuilder{ mesh }.addCamera(frame.cameraPose, cameraScale);
+		return mesh.writeMesh(frame.filename);
+	}
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "Eigen.h"
+#include "Parallel.h"
+#include "SimpleMesh.h"
+#include "VirtualSensor.h"
+
+/**
+ * Renders depth and color frames of a mesh on the CPU, as synthetic sensor frames with exact ground truth (see
+ * VirtualSensor::initSynthetic()). The triangles are rasterized into a z-buffer in parallel bands of rows, depth
+ * and color are interpolated perspective-correctly. Triangles reaching in front of the minimum depth are dropped
+ * instead of clipped.
+ */
+class MeshRenderer : public FrameRenderer {
+public:
+	MeshRenderer(const SimpleMesh& mesh) : m_depthNoise(0.0f), m_dropoutProbability(0.0f), m_seed(0), m_minDepth(0.1f), m_maxDepth(std::numeric_limits<float>::infinity()) {
+		const auto& vertices = mesh.getVertices();
+		m_positions.resize(vertices.size());
+		m_colors.resize(vertices.size());
+		Vector3f bbMin = Vector3f::Constant(std::numeric_limits<float>::max());
+		Vector3f bbMax = Vector3f::Constant(-std::numeric_limits<float>::max());
+		for (size_t i = 0; i < vertices.size(); ++i) {
+			m_positions[i] = vertices[i].position.head<3>();
+			m_colors[i] = vertices[i].color;
+			if (m_positions[i].allFinite()) {
+				bbMin = bbMin.cwiseMin(m_positions[i]);
+				bbMax = bbMax.cwiseMax(m_positions[i]);
+			}
+		}
+		const bool bEmpty = bbMin.x() > bbMax.x();
+		m_center = bEmpty ? Vector3f(Vector3f::Zero()) : Vector3f(0.5f * (bbMin + bbMax));
+		m_radius = bEmpty ? 0.0f : 0.5f * (bbMax - bbMin).norm();
+
+		// Triangles with invalid vertices (e.g. of meshes from sensor frames) are never visible, triangles with
+		// vertex indices out of range (meshes built with addFace()) are skipped.
+		const size_t nVertices = m_positions.size();
+		m_triangles.reserve(mesh.getTriangles().size());
+		for (const Triangle& triangle : mesh.getTriangles()) {
+			if (triangle.idx0 >= nVertices || triangle.idx1 >= nVertices || triangle.idx2 >= nVertices)
+				continue;
+			if (m_positions[triangle.idx0].allFinite() && m_positions[triangle.idx1].allFinite() && m_positions[triangle.idx2].allFinite())
+				m_triangles.push_back(triangle);
+		}
+	}
+
+	/**
+	 * Noise model of the rendered depth: Gaussian noise with a standard deviation of depthNoise * depth^2 (axial
+	 * noise of structured-light sensors, e.g. 0.0012 for a Kinect) and pixels that are invalid with
+	 * dropoutProbability. The noise of a frame only depends on seed and the frame index, so prefetched frames are
+	 * reproducible. Off by default.
+	 */
+	void setNoise(float depthNoise, float dropoutProbability, unsigned int seed = 0) {
+		m_depthNoise = depthNoise;
+		m_dropoutProbability = dropoutProbability;
+		m_seed = seed;
+	}
+
+	/**
+	 * Depth range of the sensor, pixels farther than maxDepth are invalid. The default is [0.1, infinity).
+	 */
+	void setDepthRange(float minDepth, float maxDepth) {
+		m_minDepth = minDepth;
+		m_maxDepth = maxDepth;
+	}
+
+	// center and radius of the bounding box of the mesh
+	const Vector3f& getCenter() const {
+		return m_center;
+	}
+
+	float getRadius() const {
+		return m_radius;
+	}
+
+	bool render(unsigned int frameIdx, const Matrix4f& trajectory, const Matrix3f& intrinsics,
+		unsigned int width, unsigned int height, float* depth, BYTE* color) const override {
+		// Color needs the z-buffer, too.
+		std::vector<float> depthBuffer;
+		const bool bDepthModel = depth != nullptr;
+		if (!depth) {
+			depthBuffer.resize(size_t(width) * height);
+			depth = depthBuffer.data();
+		}
+
+		// Vertices in pixel coordinates with the inverse depth for the perspective-correct interpolation, an
+		// inverse depth of 0 in front of the minimum depth.
+		const Matrix3f rotation = trajectory.block<3, 3>(0, 0);
+		const Vector3f translation = trajectory.block<3, 1>(0, 3);
+		const int nVertices = int(m_positions.size());
+		std::vector<Vector3f> projected(nVertices);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nVertices; ++i) {
+			const Vector3f position = rotation * m_positions[i] + translation;
+			const Vector3f pixel = intrinsics * position;
+			projected[i] = position.z() < m_minDepth ? Vector3f(Vector3f::Zero()) : Vector3f(pixel.x() / position.z(), pixel.y() / position.z(), 1.0f / position.z());
+		}
+
+		// Every band of rows gets the visible triangles that overlap it.
+		const int nBands = int((height + BAND_HEIGHT - 1) / BAND_HEIGHT);
+		std::vector<std::vector<unsigned int>> bands(nBands);
+		for (unsigned int i = 0; i < m_triangles.size(); ++i) {
+			const Vector3f& p0 = projected[m_triangles[i].idx0];
+			const Vector3f& p1 = projected[m_triangles[i].idx1];
+			const Vector3f& p2 = projected[m_triangles[i].idx2];
+			if (p0.z() == 0.0f || p1.z() == 0.0f || p2.z() == 0.0f)
+				continue;
+			const float minX = std::min({ p0.x(), p1.x(), p2.x() });
+			const float maxX = std::max({ p0.x(), p1.x(), p2.x() });
+			const float minY = std::min({ p0.y(), p1.y(), p2.y() });
+			const float maxY = std::max({ p0.y(), p1.y(), p2.y() });
+			if (maxX < 0.0f || minX > float(width - 1) || maxY < 0.0f || minY > float(height - 1))
+				continue;
+			const int yBegin = std::max(0, int(std::ceil(minY)));
+			const int yLast = std::min(int(height) - 1, int(std::floor(maxY)));
+			for (int band = yBegin / BAND_HEIGHT; band <= yLast / BAND_HEIGHT; ++band)
+				bands[band].push_back(i);
+		}
+
+		#pragma omp parallel for schedule(dynamic) num_threads(Parallel::getNumThreads())
+		for (int band = 0; band < nBands; ++band) {
+			const int yBegin = band * BAND_HEIGHT;
+			const int yEnd = std::min(int(height), yBegin + BAND_HEIGHT);
+			std::fill(depth + size_t(yBegin) * width, depth + size_t(yEnd) * width, std::numeric_limits<float>::infinity());
+			if (color) {
+				for (size_t idx = size_t(yBegin) * width; idx < size_t(yEnd) * width; ++idx) {
+					color[4 * idx] = color[4 * idx + 1] = color[4 * idx + 2] = 0;
+					color[4 * idx + 3] = 255;
+				}
+			}
+
+			for (unsigned int triangleIdx : bands[band])
+				rasterizeTriangle(m_triangles[triangleIdx], projected, width, yBegin, yEnd, depth, color);
+
+			if (bDepthModel)
+				applyDepthModel(frameIdx, width, yBegin, yEnd, depth);
+		}
+		return true;
+	}
+
+	/**
+	 * Trajectory (world to camera transformations, see VirtualSensor::getTrajectory()) of nFrames camera poses
+	 * on a circle of the given radius around center, height above it (along y), looking at center. The circle
+	 * is divided evenly over angle radians.
+	 */
+	static std::vector<Matrix4f> orbitTrajectory(const Vector3f& center, float radius, float height, unsigned int nFrames, float angle = 2.0f * float(M_PI)) {
+		std::vector<Matrix4f> trajectory(nFrames);
+		for (unsigned int i = 0; i < nFrames; ++i) {
+			const float alpha = angle * i / nFrames;
+			const Vector3f eye = center + Vector3f(radius * std::sin(alpha), height, radius * std::cos(alpha));
+
+			// camera axes: x right, y down, z forward
+			const Vector3f forward = (center - eye).normalized();
+			const Vector3f right = forward.cross(Vector3f::UnitY()).normalized();
+			const Vector3f down = forward.cross(right);
+
+			Matrix4f cameraPose = Matrix4f::Identity();
+			cameraPose.block<3, 1>(0, 0) = right;
+			cameraPose.block<3, 1>(0, 1) = down;
+			cameraPose.block<3, 1>(0, 2) = forward;
+			cameraPose.block<3, 1>(0, 3) = eye;
+			trajectory[i] = cameraPose.inverse();
+		}
+		return trajectory;
+	}
+
+private:
+	// rows per band of the parallel rasterization
+	static const int BAND_HEIGHT = 16;
+
+	/**
+	 * Draws the rows [yBegin, yEnd) of a triangle (pixel centers at integer coordinates).
+	 */
+	void rasterizeTriangle(const Triangle& triangle, const std::vector<Vector3f>& projected, unsigned int width, int yBegin, int yEnd, float* depth, BYTE* color) const {
+		const Vector3f& p0 = projected[triangle.idx0];
+		const Vector3f& p1 = projected[triangle.idx1];
+		const Vector3f& p2 = projected[triangle.idx2];
+		const float area = (p1.x() - p0.x()) * (p2.y() - p0.y()) - (p1.y() - p0.y()) * (p2.x() - p0.x());
+		if (std::abs(area) < 1e-12f)
+			return;
+		const float invArea = 1.0f / area;
+
+		const int xBegin = std::max(0, int(std::ceil(std::min({ p0.x(), p1.x(), p2.x() }))));
+		const int xLast = std::min(int(width) - 1, int(std::floor(std::max({ p0.x(), p1.x(), p2.x() }))));
+		const int yFirst = std::max(yBegin, int(std::ceil(std::min({ p0.y(), p1.y(), p2.y() }))));
+		const int yLast = std::min(yEnd - 1, int(std::floor(std::max({ p0.y(), p1.y(), p2.y() }))));
+
+		// Barycentric coordinates of the edge functions, stepped along the rows.
+		const float stepW0 = -(p2.y() - p1.y()) * invArea;
+		const float stepW1 = -(p0.y() - p2.y()) * invArea;
+		for (int y = yFirst; y <= yLast; ++y) {
+			float w0 = ((p2.x() - p1.x()) * (y - p1.y()) - (p2.y() - p1.y()) * (xBegin - p1.x())) * invArea;
+			float w1 = ((p0.x() - p2.x()) * (y - p2.y()) - (p0.y() - p2.y()) * (xBegin - p2.x())) * invArea;
+			for (int x = xBegin; x <= xLast; ++x, w0 += stepW0, w1 += stepW1) {
+				const float w2 = 1.0f - w0 - w1;
+				if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+					continue;
+
+				const size_t idx = size_t(y) * width + x;
+				const float z = 1.0f / (w0 * p0.z() + w1 * p1.z() + w2 * p2.z());
+				if (z >= depth[idx])
+					continue;
+				depth[idx] = z;
+
+				if (color) {
+					const float c0 = w0 * p0.z() * z;
+					const float c1 = w1 * p1.z() * z;
+					const float c2 = w2 * p2.z() * z;
+					const Vector4uc& color0 = m_colors[triangle.idx0];
+					const Vector4uc& color1 = m_colors[triangle.idx1];
+					const Vector4uc& color2 = m_colors[triangle.idx2];
+					for (int c = 0; c < 4; ++c)
+						color[4 * idx + c] = BYTE(std::min(255.0f, c0 * color0[c] + c1 * color1[c] + c2 * color2[c] + 0.5f));
+				}
+			}
+		}
+	}
+
+	/**
+	 * Invalidates empty and out-of-range pixels of the rows [yBegin, yEnd) and applies the noise model, with one
+	 * generator per row.
+	 */
+	void applyDepthModel(unsigned int frameIdx, unsigned int width, int yBegin, int yEnd, float* depth) const {
+		const bool bNoise = m_depthNoise > 0.0f || m_dropoutProbability > 0.0f;
+		for (int y = yBegin; y < yEnd; ++y) {
+			std::mt19937 generator;
+			if (bNoise) {
+				std::seed_seq seeds{ m_seed, frameIdx, unsigned(y) };
+				generator.seed(seeds);
+			}
+			std::normal_distribution<float> gaussian(0.0f, 1.0f);
+			std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+			float* row = depth + size_t(y) * width;
+			for (unsigned int x = 0; x < width; ++x) {
+				if (std::isinf(row[x]) || row[x] > m_maxDepth || (m_dropoutProbability > 0.0f && uniform(generator) < m_dropoutProbability)) {
+					row[x] = MINF;
+					continue;
+				}
+				if (m_depthNoise > 0.0f)
+					row[x] += m_depthNoise * row[x] * row[x] * gaussian(generator);
+			}
+		}
+	}
+
+	// mesh
+	std::vector<Vector3f> m_positions;
+	std::vector<Vector4uc> m_colors;
+	std::vector<Triangle> m_triangles;
+	Vector3f m_center;
+	float m_radius;
+
+	// sensor model
+	float m_depthNoise;
+	float m_dropoutProbability;
+	unsigned int m_seed;
+	float m_minDepth;
+	float m_maxDepth;
+};
@@ -2,6 +2,8 @@
 #include <flann/flann.hpp>
 
 #include "Eigen.h"
+#include "Parallel.h"
+#include "PointSoA.h"
 #include <math.h>
 
 #define DEBUG 0
@@ -20,15 +22,45 @@ public:
 		m_maxDistance = maxDistance;
 	}
 
-	virtual void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints) = 0;
-	virtual std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints) = 0;
+	void setVerbose(bool bVerbose) {
+		m_bVerbose = bVerbose;
+	}
+
+	/**
+	 * Building the index (and setting the intrinsics) is not thread-safe. Once built, queryMatches() doesn't
+	 * modify the search structure, so one index can be queried concurrently from several threads.
+	 */
+	virtual void buildIndex(const PointSoA& targetPoints) = 0;
+
+	/**
+	 * Writes one match per transformed point into matches (resized, so its capacity is reused between calls).
+	 */
+	virtual void queryMatches(const PointSoA& transformedPoints, std::vector<Match>& matches) const = 0;
+
+	std::vector<Match> queryMatches(const PointSoA& transformedPoints) const {
+		std::vector<Match> matches;
+		queryMatches(transformedPoints, matches);
+		return matches;
+	}
+
+	/**
+	 * Writes the indices of the k nearest target points of every query point into indices (row-major, one row of
+	 * k indices per query point, -1 where there are fewer neighbors). The distances are not limited by the
+	 * matching distance. Not every search structure supports it.
+	 */
+	virtual void queryKnn(const PointSoA& queryPoints, int k, std::vector<int>& indices) const {
+		std::cout << "k-nearest neighbor queries are not supported by this search structure." << std::endl;
+		indices.assign(queryPoints.size() * k, -1);
+	}
+
 	virtual void setDepthIntrinsicsAndRes(Matrix3f depthIntrinsics, unsigned width, unsigned height) = 0;
 	virtual void setSourceIndices(std::vector<Vector2i> indices) = 0;
 
 protected:
 	float m_maxDistance;
+	bool m_bVerbose;
 
-	NearestNeighborSearch() : m_maxDistance{ 0.005f } {}
+	NearestNeighborSearch() : m_maxDistance{ 0.005f }, m_bVerbose{ true } {}
 };
 
 
@@ -37,34 +69,33 @@ protected:
  */
 class ProjectiveCorrespondences : public NearestNeighborSearch {
 public:
-
-	static int count_matches_wo_dist0;
 	ProjectiveCorrespondences() : NearestNeighborSearch() {}
 
-	void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints) {
+	using NearestNeighborSearch::queryMatches;
+
+	void buildIndex(const PointSoA& targetPoints) {
 		m_points = targetPoints;
 	}
 
-	std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints) {
+	void queryMatches(const PointSoA& transformedPoints, std::vector<Match>& matches) const {
 		const unsigned nMatches = transformedPoints.size();
-		std::vector<Match> matches(nMatches);
+		matches.resize(nMatches);
 		const unsigned nTargetPoints = m_points.size();
-		std::cout << "total possible nMatches: " << nMatches << std::endl;
-		std::cout << "nTargetPoints: " << nTargetPoints << std::endl;
-		count_matches_wo_dist0 = 0;
+		if (m_bVerbose) {
+			std::cout << "total possible nMatches: " << nMatches << std::endl;
+			std::cout << "nTargetPoints: " << nTargetPoints << std::endl;
+		}
 
 		int match_cnt = 0;
 
-		#pragma omp parallel for
+		#pragma omp parallel for reduction(+:match_cnt) num_threads(Parallel::getNumThreads())
 		for (int i = 0; i < nMatches; i++) {
-			matches[i] = getClosestPoint(transformedPoints[i], i);
+			matches[i] = getClosestPoint(transformedPoints[i]);
 			if(matches[i].idx >= 0)
 				match_cnt++;
 		}
-		std::cout << "total actual nMatches: " << match_cnt << std::endl;
-		std::cout << "total non 0 dist nMatches: " << count_matches_wo_dist0 << std::endl;
-
-		return matches;
+		if (m_bVerbose)
+			std::cout << "total actual nMatches: " << match_cnt << std::endl;
 	}
 
 	void setDepthIntrinsicsAndRes(Matrix3f depthIntrinsics, unsigned width, unsigned height) {
@@ -79,14 +110,14 @@ public:
 
 
 private:
-	std::vector<Eigen::Vector3f> m_points;
+	PointSoA m_points;
 	std::vector<Vector2i> m_indices;
 
 	unsigned m_width = 0;
 	unsigned m_height = 0;	
 	Matrix3f m_depthIntrinsics = Matrix3f::Zero();
 
-	Match getClosestPoint(const Vector3f& p, const int transPointIndex) {
+	Match getClosestPoint(const Vector3f& p) const {
 		int idx = -1;
 		int u=-1,v=-1;
 		float dist, fovX, fovY, cX, cY;
@@ -101,7 +132,8 @@ private:
 
 		if(m_height == 0)
 		{
-			std::cout<<"m_height = "<<m_height<<"\nm_width = "<<m_width<<"\ndepthIntrinsics =\n"<<m_depthIntrinsics<<std::endl;
+			if (m_bVerbose)
+				std::cout<<"m_height = "<<m_height<<"\nm_width = "<<m_width<<"\ndepthIntrinsics =\n"<<m_depthIntrinsics<<std::endl;
 			return Match{ -1, 0.f };
 		}
 
@@ -121,7 +153,7 @@ private:
 				if(temp_idx<0 || temp_idx>=m_points.size()){
 					continue;
 				}
-				if(m_points[temp_idx].allFinite()){
+				if(m_points.isFinite(temp_idx)){
 					float temp_dist = (p - m_points[temp_idx]).norm();
 					if(temp_dist < minDist){
 						idx = temp_idx;
@@ -131,7 +163,7 @@ private:
 			}
 		}
 
-		if(m_points[idx].allFinite() && minDist <= m_maxDistance){
+		if(idx >= 0 && minDist <= m_maxDistance){
 			return Match{ idx, 1.f };
 		}else{
 			return Match{ -1, 0.f };
@@ -186,8 +218,6 @@ private:
 	}
 };
 
-int ProjectiveCorrespondences::count_matches_wo_dist0 =0;
-
 
 /**
  * Brute-force nearest neighbor search.
@@ -196,23 +226,48 @@ class NearestNeighborSearchBruteForce : public NearestNeighborSearch {
 public:
 	NearestNeighborSearchBruteForce() : NearestNeighborSearch() {}
 
-	void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints) {
+	using NearestNeighborSearch::queryMatches;
+
+	void buildIndex(const PointSoA& targetPoints) {
 		m_points = targetPoints;
 	}
 
-	std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints) {
+	void queryMatches(const PointSoA& transformedPoints, std::vector<Match>& matches) const {
 		const unsigned nMatches = transformedPoints.size();
-		std::vector<Match> matches(nMatches);
+		matches.resize(nMatches);
 		const unsigned nTargetPoints = m_points.size();
-		std::cout << "nMatches: " << nMatches << std::endl;
-		std::cout << "nTargetPoints: " << nTargetPoints << std::endl;
+		if (m_bVerbose) {
+			std::cout << "nMatches: " << nMatches << std::endl;
+			std::cout << "nTargetPoints: " << nTargetPoints << std::endl;
+		}
 
-		#pragma omp parallel for
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
 		for (int i = 0; i < nMatches; i++) {
 			matches[i] = getClosestPoint(transformedPoints[i]);
 		}
+	}
 
-		return matches;
+	void queryKnn(const PointSoA& queryPoints, int k, std::vector<int>& indices) const {
+		const int nQueries = queryPoints.size();
+		const int nTargetPoints = m_points.size();
+		const int nNeighbors = std::min(k, nTargetPoints);
+		indices.assign(size_t(nQueries) * k, -1);
+
+		#pragma omp parallel num_threads(Parallel::getNumThreads())
+		{
+			std::vector<std::pair<float, int>> distances(nTargetPoints);
+
+			#pragma omp for
+			for (int i = 0; i < nQueries; i++) {
+				const Vector3f query = queryPoints[i];
+				for (int j = 0; j < nTargetPoints; j++)
+					distances[j] = { (m_points[j] - query).squaredNorm(), j };
+				std::partial_sort(distances.begin(), distances.begin() + nNeighbors, distances.end());
+
+				for (int j = 0; j < nNeighbors && std::isfinite(distances[j].first); j++)
+					indices[size_t(i) * k + j] = distances[j].second;
+			}
+		}
 	}
 
 	void setDepthIntrinsicsAndRes(Matrix3f depthIntrinsics, unsigned width, unsigned height) {
@@ -226,26 +281,19 @@ public:
 	}
 
 private:
-	std::vector<Eigen::Vector3f> m_points;
+	PointSoA m_points;
 	std::vector<Vector2i> m_indices;
 
 	unsigned m_width = 0;
 	unsigned m_height = 0;	
 	Matrix3f m_depthIntrinsics = Matrix3f::Zero();
 
-	Match getClosestPoint(const Vector3f& p) {
-		int idx = -1;
-
-		float minDist = std::numeric_limits<float>::max();
-		for (unsigned int i = 0; i < m_points.size(); ++i) {
-			float dist = (p - m_points[i]).norm();
-			if (minDist > dist) {
-				idx = i;
-				minDist = dist;
-			}
-		}
+	Match getClosestPoint(const Vector3f& p) const {
+		float minSquaredDist;
+		const int idx = PointKernels::closestPoint(m_points, p, minSquaredDist);
+		const float minDist = std::sqrt(minSquaredDist);
 
-		if (minDist <= m_maxDistance)
+		if (idx >= 0 && minDist <= m_maxDistance)
 			return Match{ idx, 1.f };
 		else
 			return Match{ -1, 0.f };
@@ -261,80 +309,104 @@ public:
 	NearestNeighborSearchFlann() :
 		NearestNeighborSearch(),
 		m_nTrees{ 1 },
-		m_index{ nullptr },
-		m_flatPoints{ nullptr }
+		m_index{ nullptr }
 	{ }
 
 	~NearestNeighborSearchFlann() {
-		if (m_index) {
-			delete m_flatPoints;
-			delete m_index;
-			m_flatPoints = nullptr;
-			m_index = nullptr;
-		}
+		SAFE_DELETE(m_index);
 	}
 
-	void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints) {
-		std::cout << "Initializing FLANN index with " << targetPoints.size() << " points." << std::endl;
+	using NearestNeighborSearch::queryMatches;
 
-		// FLANN requires that all the points be flat. Therefore we copy the points to a separate flat array.
-		m_flatPoints = new float[targetPoints.size() * 3];
-		for (size_t pointIndex = 0; pointIndex < targetPoints.size(); pointIndex++) {
-			for (size_t dim = 0; dim < 3; dim++) {
-				m_flatPoints[pointIndex * 3 + dim] = targetPoints[pointIndex][dim];
-			}
-		}
+	void buildIndex(const PointSoA& targetPoints) {
+		if (m_bVerbose)
+			std::cout << "Initializing FLANN index with " << targetPoints.size() << " points." << std::endl;
+
+		// The index references the flat points, so it has to be released before the buffer is refilled.
+		SAFE_DELETE(m_index);
+
+		// FLANN requires that all the points be flat. Therefore we copy the points to a separate flat array
+		// (its capacity is kept when the index is rebuilt for the next target).
+		interleave(targetPoints, m_flatPoints);
 
-		flann::Matrix<float> dataset(m_flatPoints, targetPoints.size(), 3);
+		flann::Matrix<float> dataset(m_flatPoints.data(), targetPoints.size(), 3);
 
 		// Building the index takes some time.
 		m_index = new flann::Index<flann::L2<float>>(dataset, flann::KDTreeIndexParams(m_nTrees));
 		m_index->buildIndex();
 
-		std::cout << "FLANN index created." << std::endl;
+		if (m_bVerbose)
+			std::cout << "FLANN index created." << std::endl;
 	}
 
-	std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints) {
+	void queryMatches(const PointSoA& transformedPoints, std::vector<Match>& matches) const {
 		if (!m_index) {
 			std::cout << "FLANN index needs to be build before querying any matches." << std::endl;
-			return {};
+			matches.clear();
+			return;
 		}
 
-		// FLANN requires that all the points be flat. Therefore we copy the points to a separate flat array.
-		float* queryPoints = new float[transformedPoints.size() * 3];
-		for (size_t pointIndex = 0; pointIndex < transformedPoints.size(); pointIndex++) {
-			for (size_t dim = 0; dim < 3; dim++) {
-				queryPoints[pointIndex * 3 + dim] = transformedPoints[pointIndex][dim];
-			}
-		}
-
-		flann::Matrix<float> query(queryPoints, transformedPoints.size(), 3);
-		flann::Matrix<int> indices(new int[query.rows * 1], query.rows, 1);
-		flann::Matrix<float> distances(new float[query.rows * 1], query.rows, 1);
+		const unsigned nMatches = transformedPoints.size();
+		matches.resize(nMatches);
+		if (nMatches == 0)
+			return;
+
+		// FLANN needs interleaved queries. The buffer is per thread, so concurrent queries on a shared index
+		// don't interfere and repeated queries don't allocate.
+		static thread_local std::vector<float> queryPoints;
+		interleave(transformedPoints, queryPoints);
+
+		// The results go into per-thread size_t buffers as well: the int overload of knnSearch allocates a size_t
+		// buffer inside FLANN on every query.
+		static thread_local std::vector<size_t> indexBuffer;
+		static thread_local std::vector<float> distanceBuffer;
+		indexBuffer.resize(nMatches);
+		distanceBuffer.resize(nMatches);
+		flann::Matrix<float> query(queryPoints.data(), nMatches, 3);
+		flann::Matrix<size_t> indices(indexBuffer.data(), nMatches, 1);
+		flann::Matrix<float> distances(distanceBuffer.data(), nMatches, 1);
 		
 		// Do a knn search, searching for 1 nearest point and using 16 checks.
 		flann::SearchParams searchParams{ 16 };
-		searchParams.cores = 0;
+		searchParams.cores = Parallel::getNumThreads();
 		m_index->knnSearch(query, indices, distances, 1, searchParams);
 
 		// Filter the matches.
-		const unsigned nMatches = transformedPoints.size();
-		std::vector<Match> matches;
-		matches.reserve(nMatches);
-
 		for (int i = 0; i < nMatches; ++i) {
-			if (*distances[i] <= m_maxDistance)
-				matches.push_back(Match{ *indices[i], 1.f });
+			if (distanceBuffer[i] <= m_maxDistance)
+				matches[i] = Match{ int(indexBuffer[i]), 1.f };
 			else
-				matches.push_back(Match{ -1, 0.f });
+				matches[i] = Match{ -1, 0.f };
 		}
+	}
 
-		// Release the memory.
-		delete[] query.ptr();
-		delete[] indices.ptr();
-		delete[] distances.ptr();
+	void queryKnn(const PointSoA& queryPoints, int k, std::vector<int>& indices) const {
+		const size_t nQueries = queryPoints.size();
+		indices.assign(nQueries * k, -1);
+		if (!m_index || nQueries == 0)
+			return;
+
+		// size_t indices like in queryMatches(), the int overload of knnSearch allocates on every call.
+		static thread_local std::vector<float> flatQueries;
+		static thread_local std::vector<size_t> indexBuffer;
+		static thread_local std::vector<float> distances;
+		interleave(queryPoints, flatQueries);
+		indexBuffer.resize(nQueries * k);
+		distances.resize(nQueries * k);
+
+		flann::Matrix<float> query(flatQueries.data(), nQueries, 3);
+		flann::Matrix<size_t> indexMatrix(indexBuffer.data(), nQueries, k);
+		flann::Matrix<float> distanceMatrix(distances.data(), nQueries, k);
+
+		// One batched search for all queries (FLANN parallelizes it internally).
+		flann::SearchParams searchParams{ 16 };
+		searchParams.cores = Parallel::getNumThreads();
+		m_index->knnSearch(query, indexMatrix, distanceMatrix, k, searchParams);
 
-		return matches;
+		// Slots without a neighbor (k larger than the cloud) stay -1.
+		const size_t nTargetPoints = m_flatPoints.size() / 3;
+		for (size_t i = 0; i < indexBuffer.size(); ++i)
+			indices[i] = indexBuffer[i] < nTargetPoints ? int(indexBuffer[i]) : -1;
 	}
 
 	void setDepthIntrinsicsAndRes(Matrix3f depthIntrinsics, unsigned width, unsigned height) {
@@ -356,7 +428,20 @@ private:
 
 	int m_nTrees;
 	flann::Index<flann::L2<float>>* m_index;
-	float* m_flatPoints;
+	std::vector<float> m_flatPoints;
+
+	static void interleave(const PointSoA& points, std::vector<float>& flatPoints) {
+		const size_t nPoints = points.size();
+		flatPoints.resize(nPoints * 3);
+		const float* x = points.x();
+		const float* y = points.y();
+		const float* z = points.z();
+		for (size_t i = 0; i < nPoints; i++) {
+			flatPoints[3 * i + 0] = x[i];
+			flatPoints[3 * i + 1] = y[i];
+			flatPoints[3 * i + 2] = z[i];
+		}
+	}
 };
 
 
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Eigen.h"
+#include "Parallel.h"
+#include "PointSoA.h"
+#include "NearestNeighbor.h"
+
+/**
+ * Normal estimation for unorganized point sets: the normal of a point is the direction of least variance
+ * (PCA) of its k nearest neighbors, oriented towards a viewpoint.
+ * The neighbors are queried in large batches from the search structure, the 3x3 covariances are accumulated
+ * on structure-of-arrays neighborhoods and solved in closed form, in parallel over the points of a batch.
+ */
+class NormalEstimator {
+public:
+	explicit NormalEstimator(int nNeighbors = 16) :
+		m_nNeighbors{ nNeighbors },
+		m_batchSize{ 65536 },
+		m_viewpoint{ Vector3f::Zero() }
+	{ }
+
+	void setNbOfNeighbors(int nNeighbors) {
+		m_nNeighbors = nNeighbors;
+	}
+
+	/**
+	 * Normals are flipped to point towards the viewpoint (the camera center, by default the origin).
+	 */
+	void setViewpoint(const Vector3f& viewpoint) {
+		m_viewpoint = viewpoint;
+	}
+
+	/**
+	 * Number of points whose neighbors are queried at once (bounds the memory of the neighbor lists).
+	 */
+	void setBatchSize(int batchSize) {
+		m_batchSize = std::max(batchSize, 1);
+	}
+
+	/**
+	 * Estimates the normals of points, using a FLANN index of the valid points for the neighbor queries
+	 * (invalid points would end up in the splits of the kd-tree).
+	 */
+	void compute(const PointSoA& points, PointSoA& normals) const {
+		const int nPoints = int(points.size());
+		std::vector<int> validIndices;
+		validIndices.reserve(nPoints);
+		for (int i = 0; i < nPoints; ++i) {
+			if (points.isFinite(i))
+				validIndices.push_back(i);
+		}
+
+		NearestNeighborSearchFlann search;
+		search.setVerbose(false);
+		if (int(validIndices.size()) == nPoints) {
+			search.buildIndex(points);
+			compute(points, search, normals);
+			return;
+		}
+
+		// The normals are estimated on the valid points and scattered back to their original indices.
+		const int nValid = int(validIndices.size());
+		PointSoA validPoints;
+		validPoints.resize(nValid);
+		for (int i = 0; i < nValid; ++i)
+			validPoints.set(i, points[validIndices[i]]);
+
+		PointSoA validNormals;
+		if (nValid > 0) {
+			search.buildIndex(validPoints);
+			compute(validPoints, search, validNormals);
+		}
+
+		normals.resize(nPoints);
+		for (int i = 0; i < nPoints; ++i)
+			normals.set(i, Vector3f(MINF, MINF, MINF));
+		for (int i = 0; i < nValid; ++i)
+			normals.set(validIndices[i], validNormals[i]);
+	}
+
+	/**
+	 * Estimates the normals of points, using a search structure that was built on the same points.
+	 * Points that are invalid or have less than 3 neighbors get an invalid (MINF) normal.
+	 */
+	void compute(const PointSoA& points, const NearestNeighborSearch& search, PointSoA& normals) const {
+		const int nPoints = int(points.size());
+		const int k = m_nNeighbors;
+		normals.resize(nPoints);
+
+		PointSoA batchPoints;
+		std::vector<int> neighbors;
+		for (int batchStart = 0; batchStart < nPoints; batchStart += m_batchSize) {
+			const int batchSize = std::min(m_batchSize, nPoints - batchStart);
+			batchPoints.resize(batchSize);
+			std::copy(points.x() + batchStart, points.x() + batchStart + batchSize, batchPoints.x());
+			std::copy(points.y() + batchStart, points.y() + batchStart + batchSize, batchPoints.y());
+			std::copy(points.z() + batchStart, points.z() + batchStart + batchSize, batchPoints.z());
+
+			search.queryKnn(batchPoints, k, neighbors);
+
+			#pragma omp parallel num_threads(Parallel::getNumThreads())
+			{
+				// Neighborhood of the current point, as structure of arrays.
+				Eigen::ArrayXf x(k), y(k), z(k);
+
+				#pragma omp for schedule(static)
+				for (int b = 0; b < batchSize; ++b) {
+					const int i = batchStart + b;
+					if (!points.isFinite(i)) {
+						normals.set(i, Vector3f(MINF, MINF, MINF));
+						continue;
+					}
+
+					const int* pointNeighbors = &neighbors[size_t(b) * k];
+					int n = 0;
+					for (int j = 0; j < k; ++j) {
+						const int idx = pointNeighbors[j];
+						if (idx < 0 || !points.isFinite(idx))
+							continue;
+						x[n] = points.x()[idx];
+						y[n] = points.y()[idx];
+						z[n] = points.z()[idx];
+						++n;
+					}
+
+					if (n < 3) {
+						normals.set(i, Vector3f(MINF, MINF, MINF));
+						continue;
+					}
+
+					const Vector3f normal = computeNormal(x.head(n), y.head(n), z.head(n));
+					const Vector3f toViewpoint = m_viewpoint - points[i];
+					normals.set(i, normal.dot(toViewpoint) < 0.f ? Vector3f(-normal) : normal);
+				}
+			}
+		}
+	}
+
+private:
+	int m_nNeighbors;
+	int m_batchSize;
+	Vector3f m_viewpoint;
+
+	/**
+	 * Eigenvector of the smallest eigenvalue of the neighborhood covariance (closed-form 3x3 solve).
+	 */
+	template <typename Array>
+	static Vector3f computeNormal(const Array& x, const Array& y, const Array& z) {
+		const float invN = 1.f / float(x.size());
+		const float meanX = x.sum() * invN;
+		const float meanY = y.sum() * invN;
+		const float meanZ = z.sum() * invN;
+
+		const auto dx = x - meanX;
+		const auto dy = y - meanY;
+		const auto dz = z - meanZ;
+
+		Matrix3f covariance;
+		covariance(0, 0) = (dx * dx).sum();
+		covariance(0, 1) = (dx * dy).sum();
+		covariance(0, 2) = (dx * dz).sum();
+		covariance(1, 1) = (dy * dy).sum();
+		covariance(1, 2) = (dy * dz).sum();
+		covariance(2, 2) = (dz * dz).sum();
+		covariance(1, 0) = covariance(0, 1);
+		covariance(2, 0) = covariance(0, 2);
+		covariance(2, 1) = covariance(1, 2);
+		covariance *= invN;
+
+		Eigen::SelfAdjointEigenSolver<Matrix3f> solver;
+		solver.computeDirect(covariance);
+		return solver.eigenvectors().col(0);
+	}
+};
+
+
+/**
+ * Normal estimation for organized depth frames with integral images (the "average 3D gradient" method).
+ * Every pixel gets horizontal and vertical 3D tangents (central differences of the back-projected points). Their
+ * sums over a square window are read from summed-area tables in constant time per pixel, so the window size
+ * doesn't change the cost. The normal is the cross product of the averaged tangents; it is in camera space and
+ * oriented like the central-difference normals of PointCloud (positive z).
+ * The tables are built with parallel, vectorizable row and column passes; the buffers are kept between frames.
+ */
+class IntegralImageNormalEstimator {
+public:
+	explicit IntegralImageNormalEstimator(int windowRadius = 4, float maxDepthChange = 0.1f) :
+		m_windowRadius{ windowRadius },
+		m_maxDepthChange{ maxDepthChange },
+		m_width{ 0 },
+		m_height{ 0 },
+		m_depthMap{ nullptr }
+	{ }
+
+	/**
+	 * The window is (2 * windowRadius + 1) pixels wide and high.
+	 */
+	void setWindowRadius(int windowRadius) {
+		m_windowRadius = std::max(windowRadius, 1);
+	}
+
+	/**
+	 * Tangents across a larger depth change (between the two neighbors) are treated as discontinuities and ignored.
+	 */
+	void setMaxDepthChange(float maxDepthChange) {
+		m_maxDepthChange = maxDepthChange;
+	}
+
+	/**
+	 * Builds the summed-area tables of a depth map. The depth map has to stay valid while normals are queried.
+	 */
+	void compute(const float* depthMap, const Matrix3f& depthIntrinsics, unsigned width, unsigned height) {
+		m_depthMap = depthMap;
+		m_width = int(width);
+		m_height = int(height);
+
+		const int tableWidth = m_width + 1;
+		const size_t tableSize = size_t(tableWidth) * (m_height + 1);
+		for (auto& table : m_tangentTables)
+			table.assign(tableSize, 0.0);
+		for (auto& table : m_countTables)
+			table.assign(tableSize, 0);
+
+		const float fovX = depthIntrinsics(0, 0);
+		const float fovY = depthIntrinsics(1, 1);
+		const float cX = depthIntrinsics(0, 2);
+		const float cY = depthIntrinsics(1, 2);
+
+		auto backProject = [&](int u, int v, float depth) {
+			return Vector3f((u - cX) / fovX * depth, (v - cY) / fovY * depth, depth);
+		};
+
+		// Row pass: tangents of every pixel, accumulated along the row (into row v + 1 of the tables).
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int v = 0; v < m_height; ++v) {
+			const float* row = depthMap + size_t(v) * m_width;
+			const size_t tableRow = size_t(v + 1) * tableWidth;
+			Vector3d sumU = Vector3d::Zero();
+			Vector3d sumV = Vector3d::Zero();
+			int countU = 0;
+			int countV = 0;
+
+			for (int u = 0; u < m_width; ++u) {
+				if (u > 0 && u < m_width - 1) {
+					const float left = row[u - 1];
+					const float right = row[u + 1];
+					if (std::isfinite(left) && std::isfinite(right) && std::abs(right - left) <= m_maxDepthChange) {
+						sumU += (backProject(u + 1, v, right) - backProject(u - 1, v, left)).cast<double>();
+						++countU;
+					}
+				}
+				if (v > 0 && v < m_height - 1) {
+					const float up = row[u - m_width];
+					const float down = row[u + m_width];
+					if (std::isfinite(up) && std::isfinite(down) && std::abs(down - up) <= m_maxDepthChange) {
+						sumV += (backProject(u, v + 1, down) - backProject(u, v - 1, up)).cast<double>();
+						++countV;
+					}
+				}
+
+				const size_t idx = tableRow + u + 1;
+				for (int c = 0; c < 3; ++c) {
+					m_tangentTables[c][idx] = sumU[c];
+					m_tangentTables[3 + c][idx] = sumV[c];
+				}
+				m_countTables[0][idx] = countU;
+				m_countTables[1][idx] = countV;
+			}
+		}
+
+		// Column pass: add the previous row, in column blocks (the inner loop over a block vectorizes).
+		const int blockSize = 64;
+		const int nBlocks = (tableWidth + blockSize - 1) / blockSize;
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int block = 0; block < nBlocks; ++block) {
+			const int begin = block * blockSize;
+			const int end = std::min(begin + blockSize, tableWidth);
+			for (int v = 1; v <= m_height; ++v) {
+				const size_t row = size_t(v) * tableWidth;
+				const size_t previousRow = row - tableWidth;
+				for (auto& table : m_tangentTables) {
+					for (int u = begin; u < end; ++u)
+						table[row + u] += table[previousRow + u];
+				}
+				for (auto& table : m_countTables) {
+					for (int u = begin; u < end; ++u)
+						table[row + u] += table[previousRow + u];
+				}
+			}
+		}
+	}
+
+	/**
+	 * Normal of pixel (u, v), MINF if the pixel has no depth or its window has no valid tangents.
+	 */
+	Vector3f getNormal(int u, int v) const {
+		if (!std::isfinite(m_depthMap[size_t(v) * m_width + u]))
+			return Vector3f(MINF, MINF, MINF);
+
+		const int tableWidth = m_width + 1;
+		const size_t i00 = size_t(std::max(v - m_windowRadius, 0)) * tableWidth + std::max(u - m_windowRadius, 0);
+		const size_t i01 = size_t(std::max(v - m_windowRadius, 0)) * tableWidth + std::min(u + m_windowRadius + 1, m_width);
+		const size_t i10 = size_t(std::min(v + m_windowRadius + 1, m_height)) * tableWidth + std::max(u - m_windowRadius, 0);
+		const size_t i11 = size_t(std::min(v + m_windowRadius + 1, m_height)) * tableWidth + std::min(u + m_windowRadius + 1, m_width);
+
+		auto boxSum = [&](const std::vector<double>& table) {
+			return table[i11] - table[i01] - table[i10] + table[i00];
+		};
+
+		const int countU = m_countTables[0][i11] - m_countTables[0][i01] - m_countTables[0][i10] + m_countTables[0][i00];
+		const int countV = m_countTables[1][i11] - m_countTables[1][i01] - m_countTables[1][i10] + m_countTables[1][i00];
+		if (countU == 0 || countV == 0)
+			return Vector3f(MINF, MINF, MINF);
+
+		// The averages of the tangents only differ from the sums by positive factors, the sums are enough.
+		const Vector3d tangentU(boxSum(m_tangentTables[0]), boxSum(m_tangentTables[1]), boxSum(m_tangentTables[2]));
+		const Vector3d tangentV(boxSum(m_tangentTables[3]), boxSum(m_tangentTables[4]), boxSum(m_tangentTables[5]));
+		const Vector3d normal = tangentU.cross(tangentV);
+		const double length = normal.norm();
+		if (!(length > 0.0))
+			return Vector3f(MINF, MINF, MINF);
+
+		return (normal / length).cast<float>();
+	}
+
+private:
+	int m_windowRadius;
+	float m_maxDepthChange;
+	int m_width;
+	int m_height;
+	const float* m_depthMap;
+
+	// Summed-area tables ((width + 1) x (height + 1)) of the horizontal and vertical tangent components and of
+	// the number of valid tangents.
+	std::vector<double> m_tangentTables[6];
+	std::vector<int> m_countTables[2];
+};
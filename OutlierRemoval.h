@@ -0,0 +1,215 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "Eigen.h"
+#include "Parallel.h"
+#include "PointSoA.h"
+#include "NearestNeighbor.h"
+
+/**
+ * Statistical outlier removal: every point gets the mean distance to its k nearest neighbors, and points whose
+ * mean distance is more than stddevMultiplier standard deviations above the mean of all points are outliers
+ * (stray points, flying pixels at depth discontinuities).
+ * Unorganized point sets use batched kNN queries; depth frames use the fast organized variant, where the
+ * neighbors are searched in a pixel window only.
+ */
+class StatisticalOutlierFilter {
+public:
+	explicit StatisticalOutlierFilter(int nNeighbors = 16, float stddevMultiplier = 1.f) :
+		m_nNeighbors{ nNeighbors },
+		m_stddevMultiplier{ stddevMultiplier },
+		m_batchSize{ 65536 },
+		m_windowRadius{ 2 }
+	{ }
+
+	void setNbOfNeighbors(int nNeighbors) {
+		m_nNeighbors = std::max(nNeighbors, 1);
+	}
+
+	void setStddevMultiplier(float stddevMultiplier) {
+		m_stddevMultiplier = stddevMultiplier;
+	}
+
+	/**
+	 * Number of points whose neighbors are queried at once (bounds the memory of the neighbor lists).
+	 */
+	void setBatchSize(int batchSize) {
+		m_batchSize = std::max(batchSize, 1);
+	}
+
+	/**
+	 * Pixel window of the organized variant, (2 * windowRadius + 1) pixels wide and high. The k nearest neighbors
+	 * are picked among the valid pixels of the window.
+	 */
+	void setWindowRadius(int windowRadius) {
+		m_windowRadius = std::max(windowRadius, 1);
+	}
+
+	/**
+	 * Indices (ascending) of the finite inliers of points, using a FLANN index of the points for the queries.
+	 */
+	void selectInliers(const PointSoA& points, std::vector<int>& inliers) const {
+		NearestNeighborSearchFlann search;
+		search.setVerbose(false);
+		search.buildIndex(points);
+		selectInliers(points, search, inliers);
+	}
+
+	/**
+	 * Indices (ascending) of the finite inliers of points, using a search structure that was built on the same points.
+	 */
+	void selectInliers(const PointSoA& points, const NearestNeighborSearch& search, std::vector<int>& inliers) const {
+		const int nPoints = int(points.size());
+		// The query point itself is one of its nearest neighbors.
+		const int k = m_nNeighbors + 1;
+		std::vector<float> meanDistances(nPoints, MINF);
+
+		PointSoA batchPoints;
+		std::vector<int> neighbors;
+		for (int batchStart = 0; batchStart < nPoints; batchStart += m_batchSize) {
+			const int batchSize = std::min(m_batchSize, nPoints - batchStart);
+			batchPoints.resize(batchSize);
+			std::copy(points.x() + batchStart, points.x() + batchStart + batchSize, batchPoints.x());
+			std::copy(points.y() + batchStart, points.y() + batchStart + batchSize, batchPoints.y());
+			std::copy(points.z() + batchStart, points.z() + batchStart + batchSize, batchPoints.z());
+
+			search.queryKnn(batchPoints, k, neighbors);
+
+			#pragma omp parallel for num_threads(Parallel::getNumThreads())
+			for (int b = 0; b < batchSize; ++b) {
+				const int i = batchStart + b;
+				if (!points.isFinite(i))
+					continue;
+
+				const Vector3f point = points[i];
+				const int* pointNeighbors = &neighbors[size_t(b) * k];
+				float distanceSum = 0.f;
+				int n = 0;
+				for (int j = 0; j < k; ++j) {
+					const int idx = pointNeighbors[j];
+					if (idx < 0 || idx == i || !points.isFinite(idx))
+						continue;
+					distanceSum += (points[idx] - point).norm();
+					++n;
+				}
+				if (n > 0)
+					meanDistances[i] = distanceSum / float(n);
+			}
+		}
+
+		const float threshold = computeThreshold(meanDistances);
+
+		inliers.clear();
+		for (int i = 0; i < nPoints; ++i) {
+			if (std::isfinite(meanDistances[i]) && meanDistances[i] <= threshold)
+				inliers.push_back(i);
+		}
+	}
+
+	/**
+	 * Organized variant for depth frames: outlier pixels are set to MINF in filteredDepthMap (which may be the
+	 * input depth map itself). The mean neighbor distances are divided by the pixel depth, so the threshold is
+	 * relative to the pixel footprint and doesn't favor near over far pixels.
+	 */
+	void apply(const float* depthMap, const Matrix3f& depthIntrinsics, unsigned width, unsigned height, float* filteredDepthMap) {
+		const int w = int(width);
+		const int h = int(height);
+		const int r = m_windowRadius;
+		const int windowSize = (2 * r + 1) * (2 * r + 1) - 1;
+		const int k = std::min(m_nNeighbors, windowSize);
+
+		const float fovX = depthIntrinsics(0, 0);
+		const float fovY = depthIntrinsics(1, 1);
+		const float cX = depthIntrinsics(0, 2);
+		const float cY = depthIntrinsics(1, 2);
+
+		m_scores.assign(size_t(w) * h, MINF);
+
+		#pragma omp parallel num_threads(Parallel::getNumThreads())
+		{
+			std::vector<float> distances(windowSize);
+
+			#pragma omp for schedule(static)
+			for (int v = 0; v < h; ++v) {
+				for (int u = 0; u < w; ++u) {
+					const float depth = depthMap[size_t(v) * w + u];
+					if (!std::isfinite(depth))
+						continue;
+					const Vector3f point((u - cX) / fovX * depth, (v - cY) / fovY * depth, depth);
+
+					int n = 0;
+					for (int dv = -r; dv <= r; ++dv) {
+						const int nv = v + dv;
+						if (nv < 0 || nv >= h)
+							continue;
+						for (int du = -r; du <= r; ++du) {
+							const int nu = u + du;
+							if (nu < 0 || nu >= w || (du == 0 && dv == 0))
+								continue;
+							const float neighborDepth = depthMap[size_t(nv) * w + nu];
+							if (!std::isfinite(neighborDepth))
+								continue;
+							const Vector3f neighbor((nu - cX) / fovX * neighborDepth, (nv - cY) / fovY * neighborDepth, neighborDepth);
+							distances[n++] = (neighbor - point).norm();
+						}
+					}
+
+					// Pixels without valid neighbors are isolated and keep the MINF score (outliers).
+					if (n == 0)
+						continue;
+
+					const int nNearest = std::min(k, n);
+					std::nth_element(distances.begin(), distances.begin() + (nNearest - 1), distances.begin() + n);
+					float distanceSum = 0.f;
+					for (int j = 0; j < nNearest; ++j)
+						distanceSum += distances[j];
+					m_scores[size_t(v) * w + u] = distanceSum / (float(nNearest) * depth);
+				}
+			}
+		}
+
+		const float threshold = computeThreshold(m_scores);
+
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < w * h; ++i)
+			filteredDepthMap[i] = std::isfinite(m_scores[i]) && m_scores[i] <= threshold ? depthMap[i] : MINF;
+	}
+
+private:
+	int m_nNeighbors;
+	float m_stddevMultiplier;
+	int m_batchSize;
+	int m_windowRadius;
+
+	// Per-pixel scores of the organized variant, kept between frames.
+	std::vector<float> m_scores;
+
+	/**
+	 * Mean plus stddevMultiplier standard deviations of the finite mean distances.
+	 */
+	float computeThreshold(const std::vector<float>& meanDistances) const {
+		const int n = int(meanDistances.size());
+		double sum = 0.0;
+		double squaredSum = 0.0;
+		int count = 0;
+		#pragma omp parallel for reduction(+:sum,squaredSum,count) num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < n; ++i) {
+			const float d = meanDistances[i];
+			if (std::isfinite(d)) {
+				sum += d;
+				squaredSum += double(d) * d;
+				++count;
+			}
+		}
+
+		if (count == 0)
+			return 0.f;
+
+		const double mean = sum / count;
+		const double variance = std::max(squaredSum / count - mean * mean, 0.0);
+		return float(mean + m_stddevMultiplier * std::sqrt(variance));
+	}
+};
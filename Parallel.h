@@ -0,0 +1,112 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * Threading configuration shared by all parallel loops (OpenMP). If the project is compiled without OpenMP
+ * support, every loop runs on the calling thread and the thread count is reported as 1.
+ */
+class Parallel {
+public:
+	/**
+	 * Sets the number of threads used by parallel loops, FLANN queries and Ceres.
+	 * A value of 0 selects the number of hardware threads.
+	 */
+	static void setNumThreads(int nThreads) {
+		numThreads() = nThreads > 0 ? nThreads : getHardwareThreads();
+#ifdef _OPENMP
+		omp_set_num_threads(numThreads());
+#endif
+	}
+
+	/**
+	 * Overrides the thread count for parallel loops started from the calling thread only (0 removes the
+	 * override). Worker threads of a ThreadPool use 1, so that nested loops don't oversubscribe the cores.
+	 */
+	static void setLocalNumThreads(int nThreads) {
+		localNumThreads() = nThreads;
+	}
+
+	static int getNumThreads() {
+#ifdef _OPENMP
+		return localNumThreads() > 0 ? localNumThreads() : numThreads();
+#else
+		return 1;
+#endif
+	}
+
+	/**
+	 * Index of the calling thread inside the current parallel region (0 outside of it).
+	 * Can be used to address per-thread accumulators.
+	 */
+	static int getThreadId() {
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	/**
+	 * Sorts [begin, end) with the parallel loop threads: the range is split into one chunk per thread, the chunks
+	 * are sorted concurrently and then merged pairwise (the merges of a round also run concurrently).
+	 */
+	template <typename RandomIt, typename Compare>
+	static void sort(RandomIt begin, RandomIt end, Compare compare) {
+		const int n = int(end - begin);
+		const int nChunks = std::max(1, std::min(getNumThreads(), n / 4096));
+		if (nChunks == 1) {
+			std::sort(begin, end, compare);
+			return;
+		}
+
+		std::vector<int> bounds(nChunks + 1);
+		for (int i = 0; i <= nChunks; ++i)
+			bounds[i] = int((long long)n * i / nChunks);
+
+		#pragma omp parallel for num_threads(nChunks)
+		for (int i = 0; i < nChunks; ++i)
+			std::sort(begin + bounds[i], begin + bounds[i + 1], compare);
+
+		for (int width = 1; width < nChunks; width *= 2) {
+			const int nMerges = (nChunks + 2 * width - 1) / (2 * width);
+			#pragma omp parallel for num_threads(std::min(nMerges, nChunks))
+			for (int m = 0; m < nMerges; ++m) {
+				const int first = 2 * width * m;
+				const int middle = std::min(first + width, nChunks);
+				const int last = std::min(first + 2 * width, nChunks);
+				if (middle < last)
+					std::inplace_merge(begin + bounds[first], begin + bounds[middle], begin + bounds[last], compare);
+			}
+		}
+	}
+
+	template <typename RandomIt>
+	static void sort(RandomIt begin, RandomIt end) {
+		sort(begin, end, std::less<typename std::iterator_traits<RandomIt>::value_type>());
+	}
+
+	static int getHardwareThreads() {
+		const unsigned nThreads = std::thread::hardware_concurrency();
+		return nThreads > 0 ? int(nThreads) : 1;
+	}
+
+private:
+	static int& numThreads() {
+		static int nThreads = getHardwareThreads();
+		return nThreads;
+	}
+
+	static int& localNumThreads() {
+		static thread_local int nThreads = 0;
+		return nThreads;
+	}
+};
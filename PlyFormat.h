@@ -0,0 +1,262 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+/**
+ * Helpers for binary little-endian PLY files: header parsing and typed access to the binary records.
+ * Elements whose properties all have a fixed size are stored as equally sized records and can be decoded in
+ * parallel; elements with list properties (faces) are walked record by record.
+ */
+class PlyFormat {
+public:
+	enum class Type { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+	struct Property {
+		std::string name;
+		Type type = Type::Float32;
+		bool isList = false;
+		Type countType = Type::UInt8;
+	};
+
+	struct Element {
+		std::string name;
+		size_t count = 0;
+		std::vector<Property> properties;
+
+		/**
+		 * Index of the property with the given name, -1 if there is none.
+		 */
+		int findProperty(const std::string& propertyName) const {
+			for (size_t i = 0; i < properties.size(); ++i) {
+				if (properties[i].name == propertyName)
+					return int(i);
+			}
+			return -1;
+		}
+
+		/**
+		 * Size of a record in bytes, 0 if the element has list properties.
+		 */
+		size_t recordSize() const {
+			size_t size = 0;
+			for (const auto& property : properties) {
+				if (property.isList)
+					return 0;
+				size += typeSize(property.type);
+			}
+			return size;
+		}
+
+		/**
+		 * Byte offset of a property within a record (only for elements without list properties).
+		 */
+		size_t propertyOffset(int index) const {
+			size_t offset = 0;
+			for (int i = 0; i < index; ++i)
+				offset += typeSize(properties[i].type);
+			return offset;
+		}
+	};
+
+	struct Header {
+		std::vector<Element> elements;
+		// Offset of the binary data (after the end_header line).
+		size_t dataOffset = 0;
+
+		const Element* findElement(const std::string& name) const {
+			for (const auto& element : elements) {
+				if (element.name == name)
+					return &element;
+			}
+			return nullptr;
+		}
+	};
+
+	static int typeSize(Type type) {
+		switch (type) {
+		case Type::Int8: case Type::UInt8: return 1;
+		case Type::Int16: case Type::UInt16: return 2;
+		case Type::Int32: case Type::UInt32: case Type::Float32: return 4;
+		case Type::Float64: return 8;
+		}
+		return 0;
+	}
+
+	/**
+	 * Reads a value of the given type (the host has to be little-endian, see isLittleEndianHost()).
+	 */
+	static double readValue(const char* p, Type type) {
+		switch (type) {
+		case Type::Int8: return double(int8_t(*p));
+		case Type::UInt8: return double(uint8_t(*p));
+		case Type::Int16: return double(load<int16_t>(p));
+		case Type::UInt16: return double(load<uint16_t>(p));
+		case Type::Int32: return double(load<int32_t>(p));
+		case Type::UInt32: return double(load<uint32_t>(p));
+		case Type::Float32: return double(load<float>(p));
+		case Type::Float64: return load<double>(p);
+		}
+		return 0.0;
+	}
+
+	/**
+	 * Reads a color channel: floating-point values are in [0, 1] and scaled by 255, all values are rounded and
+	 * clamped to [0, 255].
+	 */
+	static unsigned char readColor(const char* p, Type type) {
+		double value = readValue(p, type);
+		if (type == Type::Float32 || type == Type::Float64)
+			value *= 255.0;
+		// NaN ends up as 0.
+		return (unsigned char)std::min(std::max(0.0, std::round(value)), 255.0);
+	}
+
+	template <typename T>
+	static T load(const char* p) {
+		T value;
+		std::memcpy(&value, p, sizeof(T));
+		return value;
+	}
+
+	template <typename T>
+	static void store(char* p, const T& value) {
+		std::memcpy(p, &value, sizeof(T));
+	}
+
+	static bool isLittleEndianHost() {
+		const uint16_t one = 1;
+		return load<uint8_t>(reinterpret_cast<const char*>(&one)) == 1;
+	}
+
+	/**
+	 * Parses the header of a binary little-endian PLY file, returns false for other files.
+	 */
+	static bool parseHeader(const char* data, size_t size, Header& header) {
+		header = Header();
+		const char* position = data;
+		const char* end = data + size;
+		bool first = true;
+		bool binaryLittleEndian = false;
+
+		while (position < end) {
+			const char* lineEnd = static_cast<const char*>(std::memchr(position, '\n', size_t(end - position)));
+			if (!lineEnd)
+				return false;
+			std::istringstream line(std::string(position, lineEnd));
+			position = lineEnd + 1;
+
+			std::string keyword;
+			line >> keyword;
+			if (first) {
+				if (keyword != "ply")
+					return false;
+				first = false;
+			}
+			else if (keyword == "format") {
+				std::string format;
+				line >> format;
+				binaryLittleEndian = format == "binary_little_endian";
+			}
+			else if (keyword == "element") {
+				Element element;
+				line >> element.name >> element.count;
+				if (!line)
+					return false;
+				header.elements.push_back(element);
+			}
+			else if (keyword == "property") {
+				if (header.elements.empty())
+					return false;
+				Property property;
+				std::string type;
+				line >> type;
+				if (type == "list") {
+					std::string countType;
+					line >> countType >> type;
+					property.isList = true;
+					if (!parseType(countType, property.countType))
+						return false;
+				}
+				if (!parseType(type, property.type))
+					return false;
+				line >> property.name;
+				header.elements.back().properties.push_back(property);
+			}
+			else if (keyword == "end_header") {
+				header.dataOffset = size_t(position - data);
+				return binaryLittleEndian;
+			}
+			// Comments and obj_info lines are ignored.
+		}
+		return false;
+	}
+
+	/**
+	 * Advances p over one record of an element with list properties. Returns false if the record exceeds end.
+	 */
+	static bool skipRecord(const Element& element, const char*& p, const char* end) {
+		for (const auto& property : element.properties) {
+			if (property.isList) {
+				if (p + typeSize(property.countType) > end)
+					return false;
+				const double count = readValue(p, property.countType);
+				if (count < 0.0)
+					return false;
+				p += typeSize(property.countType) + size_t(count) * typeSize(property.type);
+			}
+			else {
+				p += typeSize(property.type);
+			}
+			if (p > end)
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Start of the binary data of the named element, nullptr if the element doesn't exist or the data is
+	 * truncated.
+	 */
+	static const char* findElementData(const Header& header, const char* data, size_t size, const std::string& name) {
+		const char* p = data + header.dataOffset;
+		const char* end = data + size;
+		for (const auto& element : header.elements) {
+			if (element.name == name)
+				return p;
+
+			const size_t recordSize = element.recordSize();
+			if (recordSize > 0) {
+				if (element.count > size_t(end - p) / recordSize)
+					return nullptr;
+				p += element.count * recordSize;
+			}
+			else {
+				for (size_t i = 0; i < element.count; ++i) {
+					if (!skipRecord(element, p, end))
+						return nullptr;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+private:
+	static bool parseType(const std::string& name, Type& type) {
+		if (name == "char" || name == "int8") type = Type::Int8;
+		else if (name == "uchar" || name == "uint8") type = Type::UInt8;
+		else if (name == "short" || name == "int16") type = Type::Int16;
+		else if (name == "ushort" || name == "uint16") type = Type::UInt16;
+		else if (name == "int" || name == "int32") type = Type::Int32;
+		else if (name == "uint" || name == "uint32") type = Type::UInt32;
+		else if (name == "float" || name == "float32") type = Type::Float32;
+		else if (name == "double" || name == "float64") type = Type::Float64;
+		else return false;
+		return true;
+	}
+};
@@ -1,7 +1,23 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
 #include "SimpleMesh.h"
 #include "Eigen.h"
-
+#include "Parallel.h"
+#include "PointSoA.h"
+#include "VoxelGrid.h"
+#include "Sampling.h"
+#include "NormalEstimation.h"
+#include "OutlierRemoval.h"
+#include "MappedFile.h"
+#include "PlyFormat.h"
+
+/**
+ * Point cloud with per-point normals. Points and normals are stored as structure of arrays (PointSoA),
+ * invalid entries are marked with MINF components.
+ */
 class PointCloud {
 public:
 	PointCloud() {}
@@ -9,37 +25,46 @@ public:
 	PointCloud(const SimpleMesh& mesh) {
 		const auto& vertices = mesh.getVertices();
 		const auto& triangles = mesh.getTriangles();
-		const unsigned nVertices = vertices.size();
-		const unsigned nTriangles = triangles.size();
+		const int nVertices = int(vertices.size());
+		const size_t nTriangles = triangles.size();
 
 		// Copy vertices.
-		m_points.reserve(nVertices);
+		std::vector<Vector3f> points;
+		points.reserve(nVertices);
 		for (const auto& vertex : vertices) {
-			m_points.push_back(Vector3f{ vertex.position.x(), vertex.position.y(), vertex.position.z() });
+			points.push_back(Vector3f{ vertex.position.x(), vertex.position.y(), vertex.position.z() });
 		}
 
 		// Compute normals (as an average of triangle normals).
-		m_normals = std::vector<Vector3f>(nVertices, Vector3f::Zero());
+		std::vector<Vector3f> normals(nVertices, Vector3f::Zero());
 		for (size_t i = 0; i < nTriangles; i++) {
 			const auto& triangle = triangles[i];
-			Vector3f faceNormal = (m_points[triangle.idx1] - m_points[triangle.idx0]).cross(m_points[triangle.idx2] - m_points[triangle.idx0]);
+			Vector3f faceNormal = (points[triangle.idx1] - points[triangle.idx0]).cross(points[triangle.idx2] - points[triangle.idx0]);
 
-			m_normals[triangle.idx0] += faceNormal;
-			m_normals[triangle.idx1] += faceNormal;
-			m_normals[triangle.idx2] += faceNormal;
+			normals[triangle.idx0] += faceNormal;
+			normals[triangle.idx1] += faceNormal;
+			normals[triangle.idx2] += faceNormal;
 		}
-		for (size_t i = 0; i < nVertices; i++) {
-			m_normals[i].normalize();
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nVertices; i++) {
+			normals[i].normalize();
 		}
+
+		m_points.assign(points);
+		m_normals.assign(normals);
 	}
 
-	PointCloud(float* depthMap, const Matrix3f& depthIntrinsics, const Matrix4f& depthExtrinsics, const unsigned width, const unsigned height, unsigned downsampleFactor = 1, float maxDistance = 0.1f, bool saveAll=false) {
-		// Get depth intrinsics.
-		float fovX = depthIntrinsics(0, 0);
-		float fovY = depthIntrinsics(1, 1);
-		float cX = depthIntrinsics(0, 2);
-		float cY = depthIntrinsics(1, 2);
+	/**
+	 * Back-projects a depth map in a single fused pass. Only every downsampleFactor-th pixel (in linearized pixel
+	 * order) is processed: its point and its normal are computed and written directly into the compacted output.
+	 * Pixels with an invalid point or normal are dropped, unless saveAll is set (then they are kept with MINF
+	 * components).
+	 * The normals are central differences of the depth, or, with a normalWindowRadius > 0, integral-image normals
+	 * averaged over a window of (2 * normalWindowRadius + 1)^2 pixels (see IntegralImageNormalEstimator).
+	 */
+	PointCloud(const float* depthMap, const Matrix3f& depthIntrinsics, const Matrix4f& depthExtrinsics, const unsigned width, const unsigned height, unsigned downsampleFactor = 1, float maxDistance = 0.1f, bool saveAll=false, int normalWindowRadius = 0) {
 		const float maxDistanceHalved = maxDistance / 2.f;
+		const int step = int(downsampleFactor);
 
 		if(saveAll)
 		{
@@ -50,83 +75,132 @@ public:
 
 		// Compute inverse depth extrinsics.
 		Matrix4f depthExtrinsicsInv = depthExtrinsics.inverse();
-		Matrix3f rotationInv = depthExtrinsicsInv.block(0, 0, 3, 3);
-		Vector3f translationInv = depthExtrinsicsInv.block(0, 3, 3, 1);
-
-		// Back-project the pixel depths into the camera space.
-		std::vector<Vector3f> pointsTmp(width * height);
-
-		// For every pixel row.
-		#pragma omp parallel for
-		for (int v = 0; v < height; ++v) {
-			// For every pixel in a row.
-			for (int u = 0; u < width; ++u) {
-				unsigned int idx = v*width + u; // linearized index
-				float depth = depthMap[idx];
-				if (depth == MINF) {
-					pointsTmp[idx] = Vector3f(MINF, MINF, MINF);
-				}
-				else {
-					// Back-projection to camera space.
-					pointsTmp[idx] = rotationInv * Vector3f((u - cX) / fovX * depth, (v - cY) / fovY * depth, depth) + translationInv;
-				}
-			}
+		const Matrix3f rotationInv = depthExtrinsicsInv.block(0, 0, 3, 3);
+		const Vector3f translationInv = depthExtrinsicsInv.block(0, 3, 3, 1);
+
+		const RayTable& rays = getRayTable(depthIntrinsics, width, height);
+
+		// The summed-area tables of the integral-image normals (the buffers are reused for the next frames).
+		const IntegralImageNormalEstimator* integralNormals = nullptr;
+		if (normalWindowRadius > 0) {
+			static thread_local IntegralImageNormalEstimator estimator;
+			estimator.setWindowRadius(normalWindowRadius);
+			estimator.setMaxDepthChange(maxDistance);
+			estimator.compute(depthMap, depthIntrinsics, width, height);
+			integralNormals = &estimator;
 		}
 
-		// We need to compute derivatives and then the normalized normal vector (for valid pixels).
-		std::vector<Vector3f> normalsTmp(width * height);
+		// Every row gets an output range large enough for all of its kept pixels. The rows are processed in
+		// parallel and compacted afterwards.
+		std::vector<int> rowOffsets(height + 1, 0);
+		std::vector<int> rowCounts(height, 0);
+		for (int v = 0; v < (int)height; ++v) {
+			const int u0 = getFirstKeptColumn(v, width, step);
+			rowOffsets[v + 1] = rowOffsets[v] + (u0 < (int)width ? (int(width) - 1 - u0) / step + 1 : 0);
+		}
 
-		#pragma omp parallel for
-		for (int v = 1; v < height - 1; ++v) {
-			for (int u = 1; u < width - 1; ++u) {
-				unsigned int idx = v*width + u; // linearized index
+		const int nKept = rowOffsets[height];
+		m_points.resize(nKept);
+		m_normals.resize(nKept);
+		m_point_index.resize(nKept);
 
-				const float du = 0.5f * (depthMap[idx + 1] - depthMap[idx - 1]);
-				const float dv = 0.5f * (depthMap[idx + width] - depthMap[idx - width]);
-				if (!std::isfinite(du) || !std::isfinite(dv) || abs(du) > maxDistanceHalved || abs(dv) > maxDistanceHalved) {
-					normalsTmp[idx] = Vector3f(MINF, MINF, MINF);
+		#pragma omp parallel num_threads(Parallel::getNumThreads())
+		{
+			typedef Eigen::Map<const Eigen::ArrayXf, 0, Eigen::InnerStride<>> StridedMap;
+			const Eigen::InnerStride<> stride(step);
+
+			// Row buffers of this thread.
+			Eigen::ArrayXf depth, x, y, du, dv, length, normalX, normalY, normalZ;
+			Eigen::Array<bool, Eigen::Dynamic, 1> pointValid, normalValid;
+
+			#pragma omp for schedule(static)
+			for (int v = 0; v < (int)height; ++v) {
+				const int n = rowOffsets[v + 1] - rowOffsets[v];
+				if (n == 0)
 					continue;
-				}
 
-				// TODO: Compute the normals using central differences. 
-				const float xu = 1;
-				const float xv = 0;
-				const float yu = 0;
-				const float yv = 1; 
+				const int u0 = getFirstKeptColumn(v, width, step);
+				const float* row = depthMap + size_t(v) * width + u0;
+
+				// Back-projection of the kept pixels to camera space.
+				depth = StridedMap(row, n, stride);
+				x = StridedMap(rays.x.data() + u0, n, stride) * depth;
+				y = rays.y[v] * depth;
+				pointValid = depth.isFinite();
+
+				if (integralNormals) {
+					normalX.resize(n);
+					normalY.resize(n);
+					normalZ.resize(n);
+					for (int j = 0; j < n; ++j) {
+						const Vector3f normal = integralNormals->getNormal(u0 + j * step, v);
+						normalX[j] = normal.x();
+						normalY[j] = normal.y();
+						normalZ[j] = normal.z();
+					}
+					normalValid = normalX.isFinite();
+				}
+				// Central differences, border pixels have no normal.
+				else if (v > 0 && v < (int)height - 1) {
+					du = 0.5f * (StridedMap(row + 1, n, stride) - StridedMap(row - 1, n, stride));
+					dv = 0.5f * (StridedMap(row + width, n, stride) - StridedMap(row - width, n, stride));
+					normalValid = du.abs() <= maxDistanceHalved && dv.abs() <= maxDistanceHalved;
+					if (u0 == 0)
+						normalValid[0] = false;
+					if (u0 + (n - 1) * step == (int)width - 1)
+						normalValid[n - 1] = false;
+					length = (du.square() + dv.square() + 1.f).sqrt();
+					normalX = -du / length;
+					normalY = -dv / length;
+					normalZ = length.inverse();
+				}
+				else {
+					normalValid.setConstant(n, false);
+				}
 
-				//normalsTmp[idx] = Vector3f(1, 1, 1); // Needs to be replaced.
-				normalsTmp[idx] = Vector3f(yu*dv - yv*du, xv*du - xu*dv, xu*yv - yu*xv);
-				normalsTmp[idx].normalize();
-			}
-		}
+				// Write the kept pixels to the range of this row.
+				int nWritten = 0;
+				for (int j = 0; j < n; ++j) {
+					if (!saveAll && !(pointValid[j] && normalValid[j]))
+						continue;
 
-		// We set invalid normals for border regions.
-		for (int u = 0; u < width; ++u) {
-			normalsTmp[u] = Vector3f(MINF, MINF, MINF);
-			normalsTmp[u + (height - 1) * width] = Vector3f(MINF, MINF, MINF);
-		}
-		for (int v = 0; v < height; ++v) {
-			normalsTmp[v * width] = Vector3f(MINF, MINF, MINF);
-			normalsTmp[(width - 1) + v * width] = Vector3f(MINF, MINF, MINF);
-		}
+					const int idx = rowOffsets[v] + nWritten++;
+					if (pointValid[j])
+						m_points.set(idx, rotationInv * Vector3f(x[j], y[j], depth[j]) + translationInv);
+					else
+						m_points.set(idx, Vector3f(MINF, MINF, MINF));
 
-		// We filter out measurements where either point or normal is invalid.
-		const unsigned nPoints = pointsTmp.size();
-		m_points.reserve(std::floor(float(nPoints) / downsampleFactor));
-		m_normals.reserve(std::floor(float(nPoints) / downsampleFactor));
+					if (normalValid[j])
+						m_normals.set(idx, Vector3f(normalX[j], normalY[j], normalZ[j]));
+					else
+						m_normals.set(idx, Vector3f(MINF, MINF, MINF));
 
-		for (int i = 0; i < nPoints; i = i + downsampleFactor) {
-			const auto& point = pointsTmp[i];
-			const auto& normal = normalsTmp[i];
+					m_point_index[idx] = Vector2i(v, u0 + j * step);
+				}
+				rowCounts[v] = nWritten;
+			}
+		}
 
-			if (saveAll || (point.allFinite() && normal.allFinite())) {
-				m_points.push_back(point);
-				m_normals.push_back(normal);
-				int u = i%width;
-				int v = (i - u)/width;
-				m_point_index.push_back(Vector2i(v,u));
+		// Compact the row ranges (they only move towards the front).
+		int nPoints = 0;
+		for (int v = 0; v < (int)height; ++v) {
+			const int begin = rowOffsets[v];
+			const int end = begin + rowCounts[v];
+			if (begin != nPoints) {
+				std::copy(m_points.x() + begin, m_points.x() + end, m_points.x() + nPoints);
+				std::copy(m_points.y() + begin, m_points.y() + end, m_points.y() + nPoints);
+				std::copy(m_points.z() + begin, m_points.z() + end, m_points.z() + nPoints);
+				std::copy(m_normals.x() + begin, m_normals.x() + end, m_normals.x() + nPoints);
+				std::copy(m_normals.y() + begin, m_normals.y() + end, m_normals.y() + nPoints);
+				std::copy(m_normals.z() + begin, m_normals.z() + end, m_normals.z() + nPoints);
+				std::copy(m_point_index.begin() + begin, m_point_index.begin() + end, m_point_index.begin() + nPoints);
 			}
+			nPoints += rowCounts[v];
 		}
+
+		m_points.resize(nPoints);
+		m_normals.resize(nPoints);
+		m_point_index.resize(nPoints);
 	}
 
 	bool readFromFile(const std::string& filename) {
@@ -142,86 +216,380 @@ public:
 		unsigned int n;
 		is.read((char*)&n, sizeof(unsigned int));
 
+		m_points.resize(n);
+		m_normals.resize(n);
+		invalidateSampleCache();
+
 		if (nBytes == sizeof(float)) {
-			float* ps = new float[3 * n];
+			std::vector<float> ps(3 * size_t(n));
 
-			is.read((char*)ps, 3 * sizeof(float) * n);
+			is.read((char*)ps.data(), 3 * sizeof(float) * n);
+			for (unsigned int i = 0; i < n; i++)
+				m_points.set(i, Vector3f(ps[3 * i + 0], ps[3 * i + 1], ps[3 * i + 2]));
 
-			for (unsigned int i = 0; i < n; i++) {
-				Eigen::Vector3f p(ps[3 * i + 0], ps[3 * i + 1], ps[3 * i + 2]);
-				m_points.push_back(p);
-			}
+			is.read((char*)ps.data(), 3 * sizeof(float) * n);
+			for (unsigned int i = 0; i < n; i++)
+				m_normals.set(i, Vector3f(ps[3 * i + 0], ps[3 * i + 1], ps[3 * i + 2]));
+		}
+		else {
+			std::vector<double> ps(3 * size_t(n));
+
+			is.read((char*)ps.data(), 3 * sizeof(double) * n);
+			for (unsigned int i = 0; i < n; i++)
+				m_points.set(i, Vector3f((float)ps[3 * i + 0], (float)ps[3 * i + 1], (float)ps[3 * i + 2]));
+
+			is.read((char*)ps.data(), 3 * sizeof(double) * n);
+			for (unsigned int i = 0; i < n; i++)
+				m_normals.set(i, Vector3f((float)ps[3 * i + 0], (float)ps[3 * i + 1], (float)ps[3 * i + 2]));
+		}
+
+		return bool(is);
+	}
+
+	/**
+	 * Writes the points and normals as a binary little-endian PLY file (x, y, z, nx, ny, nz floats per vertex, one
+	 * bulk write). Invalid points and normals are written as they are (MINF).
+	 */
+	bool writePly(const std::string& filename) const {
+		if (!PlyFormat::isLittleEndianHost()) {
+			std::cout << "PLY files can only be written on little-endian hosts." << std::endl;
+			return false;
+		}
+
+		std::ofstream os(filename, std::ios::out | std::ios::binary);
+		if (!os.is_open()) {
+			std::cout << "ERROR: unable to write output file " << filename << "!" << std::endl;
+			return false;
+		}
 
-			is.read((char*)ps, 3 * sizeof(float) * n);
-			for (unsigned int i = 0; i < n; i++) {
-				Eigen::Vector3f p(ps[3 * i + 0], ps[3 * i + 1], ps[3 * i + 2]);
-				m_normals.push_back(p);
+		const int nPoints = int(m_points.size());
+		const bool hasNormals = int(m_normals.size()) == nPoints;
+
+		std::stringstream header;
+		header << "ply\nformat binary_little_endian 1.0\n"
+			<< "element vertex " << nPoints << "\n"
+			<< "property float x\nproperty float y\nproperty float z\n";
+		if (hasNormals)
+			header << "property float nx\nproperty float ny\nproperty float nz\n";
+		header << "end_header\n";
+		const std::string headerText = header.str();
+		os.write(headerText.data(), headerText.size());
+
+		const int nComponents = hasNormals ? 6 : 3;
+		std::vector<float> vertexData(size_t(nPoints) * nComponents);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nPoints; ++i) {
+			float* record = &vertexData[size_t(i) * nComponents];
+			record[0] = m_points.x()[i];
+			record[1] = m_points.y()[i];
+			record[2] = m_points.z()[i];
+			if (hasNormals) {
+				record[3] = m_normals.x()[i];
+				record[4] = m_normals.y()[i];
+				record[5] = m_normals.z()[i];
 			}
+		}
+		os.write(reinterpret_cast<const char*>(vertexData.data()), vertexData.size() * sizeof(float));
+
+		return bool(os);
+	}
 
-			delete ps;
+	/**
+	 * Reads the vertices of a binary little-endian PLY file (faces are ignored). Normals are read from nx, ny, nz;
+	 * if the file has none, they are MINF (see estimateNormals()).
+	 */
+	bool loadPly(const std::string& filename) {
+		std::shared_ptr<const MappedFile> file = MappedFile::open(filename);
+		PlyFormat::Header header;
+		if (!file || !PlyFormat::isLittleEndianHost() || !PlyFormat::parseHeader(file->data(), file->size(), header)) {
+			std::cout << "ERROR: unable to read binary PLY file " << filename << "!" << std::endl;
+			return false;
 		}
-		else {
-			double* ps = new double[3 * n];
 
-			is.read((char*)ps, 3 * sizeof(double) * n);
+		const PlyFormat::Element* vertexElement = header.findElement("vertex");
+		const char* vertexData = PlyFormat::findElementData(header, file->data(), file->size(), "vertex");
+		const size_t vertexSize = vertexElement ? vertexElement->recordSize() : 0;
+		if (!vertexData || vertexSize == 0 || vertexElement->count > size_t(file->data() + file->size() - vertexData) / vertexSize) {
+			std::cout << "ERROR: " << filename << " has no valid vertex data!" << std::endl;
+			return false;
+		}
+		// The points are indexed with int.
+		if (vertexElement->count > size_t(std::numeric_limits<int>::max())) {
+			std::cout << "ERROR: " << filename << " has too many points!" << std::endl;
+			return false;
+		}
 
-			for (unsigned int i = 0; i < n; i++) {
-				Eigen::Vector3f p((float)ps[3 * i + 0], (float)ps[3 * i + 1], (float)ps[3 * i + 2]);
-				m_points.push_back(p);
+		const char* names[] = { "x", "y", "z", "nx", "ny", "nz" };
+		int properties[6];
+		size_t offsets[6];
+		for (int k = 0; k < 6; ++k) {
+			properties[k] = vertexElement->findProperty(names[k]);
+			offsets[k] = properties[k] >= 0 ? vertexElement->propertyOffset(properties[k]) : 0;
+		}
+		if (properties[0] < 0 || properties[1] < 0 || properties[2] < 0) {
+			std::cout << "ERROR: " << filename << " has no vertex positions!" << std::endl;
+			return false;
+		}
+		const bool hasNormals = properties[3] >= 0 && properties[4] >= 0 && properties[5] >= 0;
+
+		const int nPoints = int(vertexElement->count);
+		m_points.resize(nPoints);
+		m_normals.resize(nPoints);
+		m_point_index.clear();
+		invalidateSampleCache();
+
+		float* components[6] = { m_points.x(), m_points.y(), m_points.z(), m_normals.x(), m_normals.y(), m_normals.z() };
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nPoints; ++i) {
+			const char* record = vertexData + size_t(i) * vertexSize;
+			for (int k = 0; k < 6; ++k) {
+				if (k < 3 || hasNormals)
+					components[k][i] = float(PlyFormat::readValue(record + offsets[k], vertexElement->properties[properties[k]].type));
+				else
+					components[k][i] = MINF;
 			}
+		}
 
-			is.read((char*)ps, 3 * sizeof(double) * n);
+		return true;
+	}
 
-			for (unsigned int i = 0; i < n; i++) {
-				Eigen::Vector3f p((float)ps[3 * i + 0], (float)ps[3 * i + 1], (float)ps[3 * i + 2]);
-				m_normals.push_back(p);
+	/**
+	 * Writes the cloud (points, normals, pixel indices, intrinsics and resolution) in the binary cloud format that
+	 * loadMappedFile() maps without parsing (see CloudFileHeader).
+	 */
+	bool writeMappedFile(const std::string& filename) const {
+		std::ofstream os(filename, std::ios::out | std::ios::binary);
+		if (!os.is_open()) {
+			std::cout << "ERROR: unable to write output file " << filename << "!" << std::endl;
+			return false;
+		}
+
+		const uint64_t nPoints = m_points.size();
+		const bool hasNormals = m_normals.size() == nPoints && nPoints > 0;
+		const bool hasPixelIndices = m_point_index.size() == nPoints && nPoints > 0;
+
+		CloudFileHeader header;
+		header.nPoints = nPoints;
+		header.width = m_width;
+		header.height = m_height;
+		for (int i = 0; i < 9; ++i)
+			header.intrinsics[i] = m_depthIntrinsics(i / 3, i % 3);
+
+		// Sections follow the header, each one starting at a multiple of the section alignment.
+		const uint64_t componentBytes = nPoints * sizeof(float);
+		uint64_t offset = alignOffset(sizeof(CloudFileHeader));
+		auto addSection = [&](uint64_t& sectionOffset, uint64_t bytes) {
+			sectionOffset = offset;
+			offset = alignOffset(offset + bytes);
+		};
+		for (int c = 0; c < 3; ++c)
+			addSection(header.pointOffsets[c], componentBytes);
+		if (hasNormals) {
+			for (int c = 0; c < 3; ++c)
+				addSection(header.normalOffsets[c], componentBytes);
+		}
+		if (hasPixelIndices)
+			addSection(header.pixelIndexOffset, nPoints * 2 * sizeof(int32_t));
+		header.fileSize = offset;
+
+		uint64_t written = 0;
+		auto writeSection = [&](uint64_t sectionOffset, const void* data, uint64_t bytes) {
+			static const char padding[CloudFileHeader::kAlignment] = {};
+			os.write(padding, std::streamsize(sectionOffset - written));
+			os.write(static_cast<const char*>(data), std::streamsize(bytes));
+			written = sectionOffset + bytes;
+		};
+
+		writeSection(0, &header, sizeof(CloudFileHeader));
+		writeSection(header.pointOffsets[0], m_points.x(), componentBytes);
+		writeSection(header.pointOffsets[1], m_points.y(), componentBytes);
+		writeSection(header.pointOffsets[2], m_points.z(), componentBytes);
+		if (hasNormals) {
+			writeSection(header.normalOffsets[0], m_normals.x(), componentBytes);
+			writeSection(header.normalOffsets[1], m_normals.y(), componentBytes);
+			writeSection(header.normalOffsets[2], m_normals.z(), componentBytes);
+		}
+		if (hasPixelIndices) {
+			std::vector<int32_t> pixelIndices(2 * nPoints);
+			for (size_t i = 0; i < nPoints; ++i) {
+				pixelIndices[2 * i + 0] = m_point_index[i].x();
+				pixelIndices[2 * i + 1] = m_point_index[i].y();
 			}
+			writeSection(header.pixelIndexOffset, pixelIndices.data(), pixelIndices.size() * sizeof(int32_t));
+		}
+		writeSection(header.fileSize, nullptr, 0);
+
+		return bool(os);
+	}
 
-			delete ps;
+	/**
+	 * Loads a file written by writeMappedFile(). The file is memory-mapped and the points and normals point
+	 * directly into the mapping (no parsing, no copy); they are only copied if the cloud is modified later.
+	 * Only the pixel indices are copied.
+	 */
+	bool loadMappedFile(const std::string& filename) {
+		std::shared_ptr<const MappedFile> file = MappedFile::open(filename);
+		if (!file) {
+			std::cout << "ERROR: unable to read input file " << filename << "!" << std::endl;
+			return false;
 		}
 
+		CloudFileHeader header;
+		if (file->size() < sizeof(CloudFileHeader)) {
+			std::cout << "ERROR: " << filename << " is not a cloud file!" << std::endl;
+			return false;
+		}
+		std::memcpy(&header, file->data(), sizeof(CloudFileHeader));
+		if (!header.isValid(file->size())) {
+			std::cout << "ERROR: " << filename << " is not a cloud file of version " << CloudFileHeader::kVersion << "!" << std::endl;
+			return false;
+		}
 
-		//std::ofstream file("pointcloud.off");
-		//file << "OFF" << std::endl;
-		//file << m_points.size() << " 0 0" << std::endl;
-		//for(unsigned int i=0; i<m_points.size(); ++i)
-		//	file << m_points[i].x() << " " << m_points[i].y() << " " << m_points[i].z() << std::endl;
-		//file.close();
+		const size_t nPoints = size_t(header.nPoints);
+		auto component = [&](uint64_t offset) {
+			return reinterpret_cast<const float*>(file->data() + offset);
+		};
+
+		m_points = PointSoA::wrap(component(header.pointOffsets[0]), component(header.pointOffsets[1]), component(header.pointOffsets[2]), nPoints, file);
+		if (header.normalOffsets[0] != 0)
+			m_normals = PointSoA::wrap(component(header.normalOffsets[0]), component(header.normalOffsets[1]), component(header.normalOffsets[2]), nPoints, file);
+		else
+			m_normals = PointSoA();
+
+		m_point_index.clear();
+		if (header.pixelIndexOffset != 0) {
+			const int32_t* pixelIndices = reinterpret_cast<const int32_t*>(file->data() + header.pixelIndexOffset);
+			m_point_index.resize(nPoints);
+			for (size_t i = 0; i < nPoints; ++i)
+				m_point_index[i] = Vector2i(pixelIndices[2 * i + 0], pixelIndices[2 * i + 1]);
+		}
 
+		for (int i = 0; i < 9; ++i)
+			m_depthIntrinsics(i / 3, i % 3) = header.intrinsics[i];
+		m_width = header.width;
+		m_height = header.height;
+		invalidateSampleCache();
 		return true;
 	}
 
-	std::vector<Vector3f>& getPoints() {
+	/**
+	 * Mutable access drops the cached sample index lists.
+	 */
+	PointSoA& getPoints() {
+		invalidateSampleCache();
 		return m_points;
 	}
 
-	const std::vector<Vector3f>& getPoints() const {
+	const PointSoA& getPoints() const {
 		return m_points;
 	}
 
-	std::vector<Vector3f> samplePoints(int downsampleFactor) {
-		int nPoints = m_points.size();
-		std::vector<Vector3f> downsampledPoints;
-		for (int i = 0; i < nPoints; i = i + downsampleFactor) {
-			downsampledPoints.push_back(m_points[i]);
-		}
+	/**
+	 * View of every downsampleFactor-th point (nothing is copied).
+	 */
+	PointView sampleView(int downsampleFactor) const {
+		return PointView(m_points, downsampleFactor);
+	}
+
+	PointSoA samplePoints(int downsampleFactor) const {
+		PointSoA downsampledPoints;
+		samplePoints(downsampleFactor, downsampledPoints);
 		return downsampledPoints;
 	}
 
-	const std::vector<Vector3f> samplePoints(int downsampleFactor) const {
-		int nPoints = m_points.size();
-		std::vector<Vector3f> downsampledPoints;
-		for (int i = 0; i < nPoints; i = i + downsampleFactor) {
-			downsampledPoints.push_back(m_points[i]);
+	/**
+	 * Writes every downsampleFactor-th point into downsampledPoints (reusing its capacity).
+	 */
+	void samplePoints(int downsampleFactor, PointSoA& downsampledPoints) const {
+		sampleView(downsampleFactor).copyTo(downsampledPoints);
+	}
+
+	/**
+	 * Replaces the normals by kNN/PCA estimates (see NormalEstimator), for point sets without connectivity or
+	 * stored normals. The normals are oriented towards the viewpoint.
+	 */
+	void estimateNormals(int nNeighbors = 16, const Vector3f& viewpoint = Vector3f::Zero()) {
+		NormalEstimator estimator{ nNeighbors };
+		estimator.setViewpoint(viewpoint);
+		estimator.compute(m_points, getNormals());
+	}
+
+	/**
+	 * Voxel-grid downsampled copy of the cloud (see VoxelGridFilter). Invalid points are dropped, every kept
+	 * point gets the pixel index of the first point of its voxel.
+	 * A leaf size that is not positive and finite leaves the cloud unfiltered.
+	 */
+	PointCloud voxelGridFilter(float leafSize, VoxelReduction reduction = VoxelReduction::Centroid) const {
+		if (!VoxelGridFilter::isValidLeafSize(leafSize)) {
+			std::cout << "Voxel grid: invalid leaf size " << leafSize << ", the cloud is not filtered" << std::endl;
+			return *this;
 		}
-		return downsampledPoints;
+
+		PointCloud filtered;
+		filtered.m_depthIntrinsics = m_depthIntrinsics;
+		filtered.m_width = m_width;
+		filtered.m_height = m_height;
+
+		std::vector<int> firstIndices;
+		VoxelGridFilter filter{ leafSize, reduction };
+		const bool bNormals = m_normals.size() == m_points.size();
+		filter.filter(m_points, bNormals ? &m_normals : nullptr, filtered.m_points, bNormals ? &filtered.m_normals : nullptr, &firstIndices);
+
+		if (!m_point_index.empty()) {
+			filtered.m_point_index.resize(firstIndices.size());
+			for (size_t i = 0; i < firstIndices.size(); ++i)
+				filtered.m_point_index[i] = m_point_index[firstIndices[i]];
+		}
+
+		return filtered;
 	}
 
-	std::vector<Vector3f>& getNormals() {
+	/**
+	 * Copy of the cloud without statistical outliers (see StatisticalOutlierFilter) and invalid points. Normals and
+	 * pixel indices are kept with their points.
+	 */
+	PointCloud statisticalOutlierFilter(int nNeighbors = 16, float stddevMultiplier = 1.f) const {
+		PointCloud filtered;
+		filtered.m_depthIntrinsics = m_depthIntrinsics;
+		filtered.m_width = m_width;
+		filtered.m_height = m_height;
+
+		std::vector<int> inliers;
+		StatisticalOutlierFilter filter{ nNeighbors, stddevMultiplier };
+		filter.selectInliers(m_points, inliers);
+
+		PointView(m_points, inliers).copyTo(filtered.m_points);
+		if (!m_normals.empty())
+			PointView(m_normals, inliers).copyTo(filtered.m_normals);
+		if (!m_point_index.empty()) {
+			filtered.m_point_index.resize(inliers.size());
+			for (size_t i = 0; i < inliers.size(); ++i)
+				filtered.m_point_index[i] = m_point_index[inliers[i]];
+		}
+
+		return filtered;
+	}
+
+	/**
+	 * Indices of the points selected by a deterministic sampling strategy. The list is computed on first use and
+	 * cached with the cloud (copies of the cloud share the cache until they are modified).
+	 */
+	SampleCache::IndexList getSampleIndices(const SamplingStrategy& strategy) const {
+		if (m_sampleCache)
+			return m_sampleCache->get(strategy, m_points, m_normals);
+
+		std::mt19937 rng(0);
+		auto indices = std::make_shared<std::vector<int>>();
+		PointSampler::select(strategy, m_points, m_normals, rng, *indices);
+		return indices;
+	}
+
+	PointSoA& getNormals() {
+		invalidateSampleCache();
 		return m_normals;
 	}
 
-	const std::vector<Vector3f>& getNormals() const {
+	const PointSoA& getNormals() const {
 		return m_normals;
 	}
 
@@ -258,26 +626,128 @@ public:
 	}
 
 	unsigned int getClosestPoint(Vector3f& p) {
-		unsigned int idx = 0;
-
-		float min_dist = std::numeric_limits<float>::max();
-		for (unsigned int i = 0; i < m_points.size(); ++i) {
-			float dist = (p - m_points[i]).norm();
-			if (min_dist > dist) {
-				idx = i;
-				min_dist = dist;
+		float minSquaredDistance;
+		const int idx = PointKernels::closestPoint(m_points, p, minSquaredDistance);
+
+		return idx >= 0 ? (unsigned int)idx : 0;
+	}
+
+private:
+	/**
+	 * Ray directions (at depth 1) of all pixels of a pinhole camera. They are separable, the x component only
+	 * depends on the column and the y component only on the row.
+	 */
+	struct RayTable {
+		Matrix3f intrinsics = Matrix3f::Zero();
+		unsigned width = 0;
+		unsigned height = 0;
+		std::vector<float> x;
+		std::vector<float> y;
+	};
+
+	/**
+	 * Returns the ray table of the given intrinsics. It is cached per thread and only recomputed when the
+	 * intrinsics or the resolution change, which doesn't happen within a sequence.
+	 */
+	static const RayTable& getRayTable(const Matrix3f& intrinsics, unsigned width, unsigned height) {
+		static thread_local RayTable rays;
+		if (rays.width != width || rays.height != height || rays.intrinsics != intrinsics) {
+			const float fovX = intrinsics(0, 0);
+			const float fovY = intrinsics(1, 1);
+			const float cX = intrinsics(0, 2);
+			const float cY = intrinsics(1, 2);
+
+			rays.x.resize(width);
+			for (unsigned u = 0; u < width; ++u)
+				rays.x[u] = (u - cX) / fovX;
+			rays.y.resize(height);
+			for (unsigned v = 0; v < height; ++v)
+				rays.y[v] = (v - cY) / fovY;
+
+			rays.intrinsics = intrinsics;
+			rays.width = width;
+			rays.height = height;
+		}
+		return rays;
+	}
+
+	/**
+	 * First column of row v that is kept when every step-th pixel (in linearized order) is kept.
+	 */
+	static int getFirstKeptColumn(int v, unsigned width, int step) {
+		const int remainder = int((size_t(v) * width) % step);
+		return remainder == 0 ? 0 : step - remainder;
+	}
+
+	/**
+	 * Header of the binary cloud format (native byte order, checked with the byte order mark). The points and
+	 * normals are stored as separate component arrays, the pixel indices as (x, y) int32 pairs. Sections start at
+	 * multiples of kAlignment bytes, an offset of 0 marks a missing section.
+	 */
+	struct CloudFileHeader {
+		enum : uint32_t { kVersion = 1, kByteOrderMark = 0x01020304, kAlignment = 64 };
+
+		char magic[8] = { 'I', 'C', 'P', 'C', 'L', 'O', 'U', 'D' };
+		uint32_t version = kVersion;
+		uint32_t byteOrderMark = kByteOrderMark;
+		uint64_t fileSize = 0;
+		uint64_t nPoints = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		float intrinsics[9] = {};
+		uint32_t reserved = 0;
+		uint64_t pointOffsets[3] = {};
+		uint64_t normalOffsets[3] = {};
+		uint64_t pixelIndexOffset = 0;
+
+		bool isValid(size_t size) const {
+			const CloudFileHeader reference;
+			if (std::memcmp(magic, reference.magic, sizeof(magic)) != 0 || version != kVersion || byteOrderMark != kByteOrderMark || fileSize > size)
+				return false;
+
+			// nPoints is checked before the section sizes are computed, so they can't wrap around.
+			if (nPoints > fileSize / sizeof(float))
+				return false;
+			const uint64_t componentBytes = nPoints * sizeof(float);
+			for (int c = 0; c < 3; ++c) {
+				if (pointOffsets[c] == 0 || pointOffsets[c] % kAlignment != 0 || !isInFile(pointOffsets[c], componentBytes))
+					return false;
+				if (normalOffsets[c] % kAlignment != 0 || !isInFile(normalOffsets[c], componentBytes) || (normalOffsets[c] == 0) != (normalOffsets[0] == 0))
+					return false;
 			}
+			if (pixelIndexOffset != 0 && nPoints > fileSize / (2 * sizeof(int32_t)))
+				return false;
+			return pixelIndexOffset % kAlignment == 0 && (pixelIndexOffset == 0 || isInFile(pixelIndexOffset, nPoints * 2 * sizeof(int32_t)));
+		}
+
+		// whether the section [offset, offset + bytes) lies in the file (without overflow)
+		bool isInFile(uint64_t offset, uint64_t bytes) const {
+			return offset <= fileSize && bytes <= fileSize - offset;
 		}
+	};
 
-		return idx;
+	static uint64_t alignOffset(uint64_t offset) {
+		const uint64_t alignment = CloudFileHeader::kAlignment;
+		return (offset + alignment - 1) / alignment * alignment;
 	}
 
-private:
-	std::vector<Vector3f> m_points;
-	std::vector<Vector3f> m_normals;
+	/**
+	 * Drops the cached sample index lists before the points or normals change. A cache that is shared with copies
+	 * of the cloud is detached, otherwise it is cleared in place (no allocation per call).
+	 */
+	void invalidateSampleCache() {
+		if (m_sampleCache && m_sampleCache.use_count() == 1)
+			m_sampleCache->clear();
+		else
+			m_sampleCache = std::make_shared<SampleCache>();
+	}
+
+	PointSoA m_points;
+	PointSoA m_normals;
 	std::vector<Vector2i> m_point_index;
 	Matrix3f m_depthIntrinsics = Matrix3f::Zero();
 	unsigned m_width=0;
 	unsigned m_height=0;
+	std::shared_ptr<SampleCache> m_sampleCache = std::make_shared<SampleCache>();
 
 };
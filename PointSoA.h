@@ -0,0 +1,428 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+#include "Eigen.h"
+#include "Parallel.h"
+
+/**
+ * Structure-of-arrays storage of 3D vectors (points or normals): three separate, aligned arrays for the
+ * x, y and z components. Loops over the arrays vectorize to the full SIMD width, which the interleaved
+ * 12-byte Vector3f elements don't allow.
+ * The components can also live in external memory (e.g. a memory-mapped file, see wrap()); the owner of that
+ * memory is kept alive with the points. Such points are copied into own arrays on the first modification.
+ */
+class PointSoA {
+public:
+	typedef std::vector<float, Eigen::aligned_allocator<float>> ComponentArray;
+	typedef Eigen::Map<Eigen::ArrayXf> ArrayMap;
+	typedef Eigen::Map<const Eigen::ArrayXf> ConstArrayMap;
+
+	PointSoA() {}
+
+	explicit PointSoA(size_t nPoints) {
+		resize(nPoints);
+	}
+
+	explicit PointSoA(const std::vector<Vector3f>& points) {
+		assign(points);
+	}
+
+	/**
+	 * Points whose components are the external arrays x, y and z (nothing is copied). owner keeps the memory alive.
+	 */
+	static PointSoA wrap(const float* x, const float* y, const float* z, size_t nPoints, std::shared_ptr<const void> owner) {
+		PointSoA points;
+		points.m_external[0] = x;
+		points.m_external[1] = y;
+		points.m_external[2] = z;
+		points.m_externalSize = nPoints;
+		points.m_externalOwner = std::move(owner);
+		return points;
+	}
+
+	/**
+	 * True if the components are external memory.
+	 */
+	bool isWrapped() const {
+		return m_externalOwner != nullptr;
+	}
+
+	size_t size() const {
+		return isWrapped() ? m_externalSize : m_x.size();
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	void resize(size_t nPoints) {
+		detach();
+		m_x.resize(nPoints);
+		m_y.resize(nPoints);
+		m_z.resize(nPoints);
+	}
+
+	void reserve(size_t nPoints) {
+		detach();
+		m_x.reserve(nPoints);
+		m_y.reserve(nPoints);
+		m_z.reserve(nPoints);
+	}
+
+	void clear() {
+		m_externalOwner.reset();
+		m_x.clear();
+		m_y.clear();
+		m_z.clear();
+	}
+
+	void pushBack(const Vector3f& point) {
+		detach();
+		m_x.push_back(point.x());
+		m_y.push_back(point.y());
+		m_z.push_back(point.z());
+	}
+
+	Vector3f operator[](size_t i) const {
+		return Vector3f{ x()[i], y()[i], z()[i] };
+	}
+
+	void set(size_t i, const Vector3f& point) {
+		detach();
+		m_x[i] = point.x();
+		m_y[i] = point.y();
+		m_z[i] = point.z();
+	}
+
+	bool isFinite(size_t i) const {
+		return std::isfinite(x()[i]) && std::isfinite(y()[i]) && std::isfinite(z()[i]);
+	}
+
+	void assign(const std::vector<Vector3f>& points) {
+		const size_t nPoints = points.size();
+		resize(nPoints);
+		for (size_t i = 0; i < nPoints; ++i) {
+			set(i, points[i]);
+		}
+	}
+
+	/**
+	 * Converts to the interleaved layout (reusing the capacity of the output).
+	 */
+	void toVector(std::vector<Vector3f>& points) const {
+		const size_t nPoints = size();
+		points.resize(nPoints);
+		for (size_t i = 0; i < nPoints; ++i) {
+			points[i] = (*this)[i];
+		}
+	}
+
+	std::vector<Vector3f> toVector() const {
+		std::vector<Vector3f> points;
+		toVector(points);
+		return points;
+	}
+
+	// Mutable access copies wrapped components into own arrays first.
+	float* x() { detach(); return m_x.data(); }
+	float* y() { detach(); return m_y.data(); }
+	float* z() { detach(); return m_z.data(); }
+	const float* x() const { return isWrapped() ? m_external[0] : m_x.data(); }
+	const float* y() const { return isWrapped() ? m_external[1] : m_y.data(); }
+	const float* z() const { return isWrapped() ? m_external[2] : m_z.data(); }
+
+	// Eigen array views of the components, used by the vectorized kernels.
+	ArrayMap xArray() { return ArrayMap(x(), size()); }
+	ArrayMap yArray() { return ArrayMap(y(), size()); }
+	ArrayMap zArray() { return ArrayMap(z(), size()); }
+	ConstArrayMap xArray() const { return ConstArrayMap(x(), size()); }
+	ConstArrayMap yArray() const { return ConstArrayMap(y(), size()); }
+	ConstArrayMap zArray() const { return ConstArrayMap(z(), size()); }
+
+private:
+	ComponentArray m_x;
+	ComponentArray m_y;
+	ComponentArray m_z;
+
+	// External components (valid while m_externalOwner is set).
+	const float* m_external[3] = { nullptr, nullptr, nullptr };
+	size_t m_externalSize = 0;
+	std::shared_ptr<const void> m_externalOwner;
+
+	/**
+	 * Copies wrapped components into own arrays and releases the external memory.
+	 */
+	void detach() {
+		if (!isWrapped())
+			return;
+		m_x.assign(m_external[0], m_external[0] + m_externalSize);
+		m_y.assign(m_external[1], m_external[1] + m_externalSize);
+		m_z.assign(m_external[2], m_external[2] + m_externalSize);
+		m_externalOwner.reset();
+	}
+};
+
+
+/**
+ * Non-owning view of a subset of a PointSoA: every stride-th point, or the points of an index list.
+ * Nothing is copied, the viewed points (and the index list) have to outlive the view.
+ */
+class PointView {
+public:
+	typedef Eigen::Map<const Eigen::ArrayXf, 0, Eigen::InnerStride<>> StridedArrayMap;
+
+	PointView() : m_points{ nullptr }, m_indices{ nullptr }, m_stride{ 1 }, m_size{ 0 } {}
+
+	/**
+	 * View of all points.
+	 */
+	PointView(const PointSoA& points) : m_points{ &points }, m_indices{ nullptr }, m_stride{ 1 }, m_size{ points.size() } {}
+
+	/**
+	 * View of every stride-th point.
+	 */
+	PointView(const PointSoA& points, int stride) :
+		m_points{ &points },
+		m_indices{ nullptr },
+		m_stride{ std::max(stride, 1) },
+		m_size{ (points.size() + m_stride - 1) / m_stride }
+	{ }
+
+	/**
+	 * View of the points with the given indices.
+	 */
+	PointView(const PointSoA& points, const std::vector<int>& indices) :
+		m_points{ &points },
+		m_indices{ &indices },
+		m_stride{ 1 },
+		m_size{ indices.size() }
+	{ }
+
+	size_t size() const {
+		return m_size;
+	}
+
+	bool empty() const {
+		return m_size == 0;
+	}
+
+	/**
+	 * Index of the i-th point of the view in the viewed points.
+	 */
+	int index(size_t i) const {
+		return m_indices ? (*m_indices)[i] : int(i) * m_stride;
+	}
+
+	Vector3f operator[](size_t i) const {
+		return (*m_points)[index(i)];
+	}
+
+	bool isIndexed() const {
+		return m_indices != nullptr;
+	}
+
+	/**
+	 * True if the view covers all points in order, so the contiguous kernels can be used.
+	 */
+	bool isContiguous() const {
+		return !m_indices && m_stride == 1;
+	}
+
+	int getStride() const {
+		return m_stride;
+	}
+
+	const PointSoA& getPoints() const {
+		return *m_points;
+	}
+
+	// Strided Eigen views of the components (not for indexed views).
+	StridedArrayMap xArray() const { return StridedArrayMap(m_points->x(), m_size, Eigen::InnerStride<>(m_stride)); }
+	StridedArrayMap yArray() const { return StridedArrayMap(m_points->y(), m_size, Eigen::InnerStride<>(m_stride)); }
+	StridedArrayMap zArray() const { return StridedArrayMap(m_points->z(), m_size, Eigen::InnerStride<>(m_stride)); }
+
+	/**
+	 * Copies the viewed points into a contiguous array (reusing its capacity).
+	 */
+	void copyTo(PointSoA& points) const {
+		points.resize(m_size);
+		if (m_indices) {
+			for (size_t i = 0; i < m_size; ++i)
+				points.set(i, (*this)[i]);
+		}
+		else {
+			points.xArray() = xArray();
+			points.yArray() = yArray();
+			points.zArray() = zArray();
+		}
+	}
+
+private:
+	const PointSoA* m_points;
+	const std::vector<int>* m_indices;
+	int m_stride;
+	size_t m_size;
+};
+
+
+/**
+ * Vectorized kernels on structure-of-arrays points.
+ */
+class PointKernels {
+public:
+	/**
+	 * Applies the rigid transformation pose to all points (output is resized, its capacity is reused).
+	 * The output must not be the input.
+	 */
+	static void transform(const PointSoA& points, const Matrix4f& pose, PointSoA& transformedPoints) {
+		transformedPoints.resize(points.size());
+
+		const auto x = points.xArray();
+		const auto y = points.yArray();
+		const auto z = points.zArray();
+
+		transformedPoints.xArray() = pose(0, 0) * x + pose(0, 1) * y + pose(0, 2) * z + pose(0, 3);
+		transformedPoints.yArray() = pose(1, 0) * x + pose(1, 1) * y + pose(1, 2) * z + pose(1, 3);
+		transformedPoints.zArray() = pose(2, 0) * x + pose(2, 1) * y + pose(2, 2) * z + pose(2, 3);
+	}
+
+	/**
+	 * Applies the rigid transformation pose to the viewed points, gathering and transforming in one pass
+	 * (output is resized, its capacity is reused).
+	 */
+	static void transform(const PointView& view, const Matrix4f& pose, PointSoA& transformedPoints) {
+		if (view.isContiguous()) {
+			transform(view.getPoints(), pose, transformedPoints);
+			return;
+		}
+
+		const int nPoints = int(view.size());
+		transformedPoints.resize(nPoints);
+
+		if (!view.isIndexed()) {
+			const auto x = view.xArray();
+			const auto y = view.yArray();
+			const auto z = view.zArray();
+
+			transformedPoints.xArray() = pose(0, 0) * x + pose(0, 1) * y + pose(0, 2) * z + pose(0, 3);
+			transformedPoints.yArray() = pose(1, 0) * x + pose(1, 1) * y + pose(1, 2) * z + pose(1, 3);
+			transformedPoints.zArray() = pose(2, 0) * x + pose(2, 1) * y + pose(2, 2) * z + pose(2, 3);
+			return;
+		}
+
+		const float* x = view.getPoints().x();
+		const float* y = view.getPoints().y();
+		const float* z = view.getPoints().z();
+		float* outX = transformedPoints.x();
+		float* outY = transformedPoints.y();
+		float* outZ = transformedPoints.z();
+
+		#pragma omp parallel for num_threads(Parallel::getNumThreads()) if(nPoints > 4096)
+		for (int i = 0; i < nPoints; ++i) {
+			const int idx = view.index(i);
+			outX[i] = pose(0, 0) * x[idx] + pose(0, 1) * y[idx] + pose(0, 2) * z[idx] + pose(0, 3);
+			outY[i] = pose(1, 0) * x[idx] + pose(1, 1) * y[idx] + pose(1, 2) * z[idx] + pose(1, 3);
+			outZ[i] = pose(2, 0) * x[idx] + pose(2, 1) * y[idx] + pose(2, 2) * z[idx] + pose(2, 3);
+		}
+	}
+
+	/**
+	 * Mean of all points (double accumulation per component).
+	 */
+	static Vector3f mean(const PointSoA& points) {
+		if (points.empty())
+			return Vector3f::Zero();
+
+		const double nPoints = double(points.size());
+		return Vector3f{
+			float(points.xArray().cast<double>().sum() / nPoints),
+			float(points.yArray().cast<double>().sum() / nPoints),
+			float(points.zArray().cast<double>().sum() / nPoints)
+		};
+	}
+
+	static Vector3f mean(const PointView& view) {
+		if (view.isContiguous())
+			return mean(view.getPoints());
+		if (view.empty())
+			return Vector3f::Zero();
+
+		const double nPoints = double(view.size());
+		if (!view.isIndexed()) {
+			return Vector3f{
+				float(view.xArray().cast<double>().sum() / nPoints),
+				float(view.yArray().cast<double>().sum() / nPoints),
+				float(view.zArray().cast<double>().sum() / nPoints)
+			};
+		}
+
+		Vector3d sum = Vector3d::Zero();
+		for (size_t i = 0; i < view.size(); ++i)
+			sum += view[i].cast<double>();
+		return (sum / nPoints).cast<float>();
+	}
+
+	/**
+	 * Cross-covariance sum_i (a_i - meanA) * (b_i - meanB)^T of two equally sized point sets.
+	 */
+	static Matrix3f crossCovariance(const PointSoA& a, const Vector3f& meanA, const PointSoA& b, const Vector3f& meanB) {
+		Matrix3f covariance;
+		const PointSoA::ConstArrayMap aComponents[3] = { a.xArray(), a.yArray(), a.zArray() };
+		const PointSoA::ConstArrayMap bComponents[3] = { b.xArray(), b.yArray(), b.zArray() };
+		for (int r = 0; r < 3; ++r) {
+			for (int c = 0; c < 3; ++c) {
+				covariance(r, c) = ((aComponents[r] - meanA[r]) * (bComponents[c] - meanB[c])).sum();
+			}
+		}
+		return covariance;
+	}
+
+	static Matrix3f crossCovariance(const PointView& a, const Vector3f& meanA, const PointView& b, const Vector3f& meanB) {
+		if (a.isContiguous() && b.isContiguous())
+			return crossCovariance(a.getPoints(), meanA, b.getPoints(), meanB);
+
+		Matrix3f covariance = Matrix3f::Zero();
+		for (size_t i = 0; i < a.size(); ++i)
+			covariance += (a[i] - meanA) * (b[i] - meanB).transpose();
+		return covariance;
+	}
+
+	/**
+	 * Index of the point closest to query (squared distance is returned in minSquaredDistance), -1 if there are
+	 * no finite points. Distances are computed block-wise into a stack buffer, so the inner loop vectorizes
+	 * and the index only has to be searched in blocks that improve the minimum.
+	 */
+	static int closestPoint(const PointSoA& points, const Vector3f& query, float& minSquaredDistance) {
+		const int blockSize = 256;
+		EIGEN_ALIGN16 float distances[blockSize];
+
+		const int nPoints = (int)points.size();
+		int idx = -1;
+		minSquaredDistance = std::numeric_limits<float>::max();
+
+		for (int start = 0; start < nPoints; start += blockSize) {
+			const int n = std::min(blockSize, nPoints - start);
+			Eigen::Map<Eigen::ArrayXf> blockDistances(distances, n);
+			blockDistances = (points.xArray().segment(start, n) - query.x()).square()
+				+ (points.yArray().segment(start, n) - query.y()).square()
+				+ (points.zArray().segment(start, n) - query.z()).square();
+
+			// Invalid points are stored as -inf, their distance is +inf and never smaller than the minimum.
+			if (blockDistances.minCoeff() < minSquaredDistance) {
+				for (int i = 0; i < n; ++i) {
+					if (distances[i] < minSquaredDistance) {
+						minSquaredDistance = distances[i];
+						idx = start + i;
+					}
+				}
+			}
+		}
+
+		return idx;
+	}
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include "SimpleMesh.h"
+#include "PointSoA.h"
 
 class ProcrustesAligner {
 public:
@@ -23,6 +24,27 @@ public:
 		return estimatedPose;
 	}
 
+	/**
+	 * Same as above for structure-of-arrays input or views of it (e.g. the matched subsets of the source and
+	 * target points), using the mean and cross-covariance kernels.
+	 */
+	Matrix4f estimatePose(const PointView& sourcePoints, const PointView& targetPoints) {
+		ASSERT(sourcePoints.size() == targetPoints.size() && "The number of source and target points should be the same, since every source point is matched with corresponding target point.");
+
+		const Vector3f sourceMean = PointKernels::mean(sourcePoints);
+		const Vector3f targetMean = PointKernels::mean(targetPoints);
+
+		JacobiSVD<Matrix3f> svd(PointKernels::crossCovariance(targetPoints, targetMean, sourcePoints, sourceMean), ComputeFullU | ComputeFullV);
+		Matrix3f rotation = svd.matrixU()*svd.matrixV().transpose();
+		Vector3f translation = computeTranslation(sourceMean, targetMean, rotation);
+
+		Matrix4f estimatedPose = Matrix4f::Identity();
+		estimatedPose.block(0, 0, 3, 3) = rotation;
+		estimatedPose.block(0, 3, 3, 1) = translation;
+
+		return estimatedPose;
+	}
+
 private:
 	Vector3f computeMean(const std::vector<Vector3f>& points) {
 		// TODO: Compute the mean of input points.
@@ -44,25 +66,14 @@ private:
 		// TODO: Estimate the rotation from source to target points, following the Procrustes algorithm. 
 		// To compute the singular value decomposition you can use JacobiSVD() from Eigen.
 		Matrix3f rotation = Matrix3f::Identity();
-		MatrixXf X(targetPoints.size(), 3);
-		MatrixXf _X(sourcePoints.size(), 3);
-		for(int i=0; i<targetPoints.size(); i++){
-			Vector3f normalizedPoint = targetPoints[i] - targetMean;
-			X(i,0) = normalizedPoint.x();
-			X(i,1) = normalizedPoint.y();
-			X(i,2) = normalizedPoint.z();
-		}
 
-		for(int i=0; i<sourcePoints.size(); i++){
-			Vector3f normalizedPoint = sourcePoints[i] - sourceMean;
-			_X(i,0) = normalizedPoint.x();
-			_X(i,1) = normalizedPoint.y();
-			_X(i,2) = normalizedPoint.z();
+		// Procrustus: the cross-covariance X^T * _X of the centered target (X) and source (_X) points is
+		// accumulated directly, without building the n x 3 matrices.
+		Matrix3f m = Matrix3f::Zero();
+		for(int i=0; i<targetPoints.size(); i++){
+			m += (targetPoints[i] - targetMean) * (sourcePoints[i] - sourceMean).transpose();
 		}
-		
-		// Procrustus
-		Matrix3f m = X.transpose()*_X;
-		JacobiSVD<MatrixXf> svd(m, ComputeFullU | ComputeFullV);
+		JacobiSVD<Matrix3f> svd(m, ComputeFullU | ComputeFullV);
 		rotation = svd.matrixU()*svd.matrixV().transpose();
 
 		// optimised svd
@@ -72,7 +83,6 @@ private:
 		// vanila svd
 		// JacobiSVD<MatrixXf> svd(_X, ComputeFullU | ComputeFullV);
 		// rotation = svd.solve(X).transpose();
-		std::cout<<rotation<<std::endl;
 		return rotation;
 	}
 
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+#include "Eigen.h"
+#include "Parallel.h"
+#include "PointSoA.h"
+#include "VoxelGrid.h"
+
+/**
+ * Source point selection methods (see "Efficient Variants of the ICP Algorithm", Rusinkiewicz and Levoy).
+ */
+enum class SamplingMethod {
+	Stride,				// every stride-th point in storage order
+	VoxelGrid,			// one representative point per occupied voxel of leafSize
+	RandomStratified,	// one random point from each of nSamples equally sized index ranges, redrawn every iteration
+	NormalSpace,		// nSamples points spread evenly over buckets of normal directions
+	Covariance			// nSamples points that constrain all 6 degrees of freedom evenly (stability sampling)
+};
+
+
+/**
+ * A sampling method and its parameter. Only the parameter of the selected method is used.
+ */
+struct SamplingStrategy {
+	SamplingMethod method = SamplingMethod::Stride;
+	int stride = 1;
+	int nSamples = 0;
+	float leafSize = 0.f;
+	VoxelReduction reduction = VoxelReduction::Centroid;
+
+	static SamplingStrategy strided(int stride) {
+		SamplingStrategy strategy;
+		strategy.stride = std::max(stride, 1);
+		return strategy;
+	}
+
+	static SamplingStrategy voxelGrid(float leafSize, VoxelReduction reduction = VoxelReduction::Centroid) {
+		SamplingStrategy strategy;
+		strategy.method = SamplingMethod::VoxelGrid;
+		strategy.leafSize = leafSize;
+		strategy.reduction = reduction;
+		return strategy;
+	}
+
+	static SamplingStrategy randomStratified(int nSamples) {
+		SamplingStrategy strategy;
+		strategy.method = SamplingMethod::RandomStratified;
+		strategy.nSamples = nSamples;
+		return strategy;
+	}
+
+	static SamplingStrategy normalSpace(int nSamples) {
+		SamplingStrategy strategy;
+		strategy.method = SamplingMethod::NormalSpace;
+		strategy.nSamples = nSamples;
+		return strategy;
+	}
+
+	static SamplingStrategy covariance(int nSamples) {
+		SamplingStrategy strategy;
+		strategy.method = SamplingMethod::Covariance;
+		strategy.nSamples = nSamples;
+		return strategy;
+	}
+
+	/**
+	 * True if the selection is deterministic and can be cached with the cloud.
+	 */
+	bool isCacheable() const {
+		return method != SamplingMethod::RandomStratified;
+	}
+
+	bool operator<(const SamplingStrategy& other) const {
+		return std::make_tuple(int(method), stride, nSamples, leafSize, int(reduction))
+			< std::make_tuple(int(other.method), other.stride, other.nSamples, other.leafSize, int(other.reduction));
+	}
+};
+
+
+/**
+ * Sampling algorithms. All of them write a list of point indices in ascending order.
+ */
+class PointSampler {
+public:
+	/**
+	 * Selects the points of the given strategy. Random stratified sampling draws from rng.
+	 * Normal-space and covariance sampling fall back to random stratified sampling of as many points if the
+	 * cloud has no normals.
+	 */
+	static void select(const SamplingStrategy& strategy, const PointSoA& points, const PointSoA& normals, std::mt19937& rng, std::vector<int>& indices) {
+		const bool bNormals = normals.size() == points.size();
+		switch (strategy.method) {
+		case SamplingMethod::Stride:
+			strided(points, strategy.stride, indices);
+			break;
+		case SamplingMethod::VoxelGrid:
+			VoxelGridFilter{ strategy.leafSize, strategy.reduction }.selectIndices(points, indices);
+			std::sort(indices.begin(), indices.end());
+			break;
+		case SamplingMethod::RandomStratified:
+			randomStratified(points, strategy.nSamples, rng, indices);
+			break;
+		case SamplingMethod::NormalSpace:
+			if (bNormals)
+				normalSpace(points, normals, strategy.nSamples, rng, indices);
+			else
+				randomStratified(points, strategy.nSamples, rng, indices);
+			break;
+		case SamplingMethod::Covariance:
+			if (bNormals)
+				covariance(points, normals, strategy.nSamples, indices);
+			else
+				randomStratified(points, strategy.nSamples, rng, indices);
+			break;
+		}
+	}
+
+	static void strided(const PointSoA& points, int stride, std::vector<int>& indices) {
+		const int nSamples = (int(points.size()) + stride - 1) / stride;
+		indices.resize(nSamples);
+		for (int i = 0; i < nSamples; ++i)
+			indices[i] = i * stride;
+	}
+
+	/**
+	 * Splits the index range into nSamples strata of equal size and draws one point from each.
+	 * For clouds built from depth frames the strata are bands of the image.
+	 */
+	static void randomStratified(const PointSoA& points, int nSamples, std::mt19937& rng, std::vector<int>& indices) {
+		const long long nPoints = (long long)points.size();
+		const int nStrata = int(std::min<long long>(nSamples, nPoints));
+		indices.resize(nStrata);
+		for (int s = 0; s < nStrata; ++s) {
+			const int begin = int(nPoints * s / nStrata);
+			const int end = int(nPoints * (s + 1) / nStrata);
+			indices[s] = begin + int(rng() % unsigned(end - begin));
+		}
+	}
+
+	/**
+	 * Normal-space sampling: the normals are sorted into buckets of equal area on the unit sphere (uniform in
+	 * z and in the azimuth) and points are drawn from the buckets in turn, so that points with rare normal
+	 * directions (the small features that constrain the pose) are kept. Points without a valid normal are skipped.
+	 */
+	static void normalSpace(const PointSoA& points, const PointSoA& normals, int nSamples, std::mt19937& rng, std::vector<int>& indices) {
+		const int nBucketsZ = 8;
+		const int nBucketsAzimuth = 16;
+		const int nBuckets = nBucketsZ * nBucketsAzimuth;
+		const int nPoints = int(points.size());
+
+		std::vector<int> bucketOfPoint(nPoints);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nPoints; ++i) {
+			if (!points.isFinite(i) || !normals.isFinite(i)) {
+				bucketOfPoint[i] = -1;
+				continue;
+			}
+			const Vector3f normal = normals[i];
+			const float azimuth = std::atan2(normal.y(), normal.x());
+			const int bucketZ = std::min(int((normal.z() + 1.f) * 0.5f * nBucketsZ), nBucketsZ - 1);
+			const int bucketAzimuth = std::min(int((azimuth + float(M_PI)) / float(2 * M_PI) * nBucketsAzimuth), nBucketsAzimuth - 1);
+			bucketOfPoint[i] = std::max(bucketZ, 0) * nBucketsAzimuth + std::max(bucketAzimuth, 0);
+		}
+
+		std::vector<std::vector<int>> buckets(nBuckets);
+		for (int i = 0; i < nPoints; ++i) {
+			if (bucketOfPoint[i] >= 0)
+				buckets[bucketOfPoint[i]].push_back(i);
+		}
+		for (auto& bucket : buckets)
+			std::shuffle(bucket.begin(), bucket.end(), rng);
+
+		// Round robin over the buckets until enough points are drawn or all buckets are empty.
+		indices.clear();
+		indices.reserve(nSamples);
+		for (int round = 0; int(indices.size()) < nSamples; ++round) {
+			bool bDrawn = false;
+			for (int b = 0; b < nBuckets && int(indices.size()) < nSamples; ++b) {
+				if (round < int(buckets[b].size())) {
+					indices.push_back(buckets[b][round]);
+					bDrawn = true;
+				}
+			}
+			if (!bDrawn)
+				break;
+		}
+		std::sort(indices.begin(), indices.end());
+	}
+
+	/**
+	 * Covariance (stability) sampling, see "Geometrically Stable Sampling for the ICP Algorithm" (Gelfand et al.).
+	 * Every point with a valid normal contributes the 6D constraint [p x n, n] of the point-to-plane error. The
+	 * points are picked greedily: always for the eigenvector of the constraint covariance that is constrained
+	 * least so far, the unused point with the largest response along it.
+	 */
+	static void covariance(const PointSoA& points, const PointSoA& normals, int nSamples, std::vector<int>& indices) {
+		typedef Eigen::Matrix<double, 6, 1> Vector6d;
+		typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+		std::vector<int> candidates;
+		candidates.reserve(points.size());
+		for (int i = 0; i < int(points.size()); ++i) {
+			if (points.isFinite(i) && normals.isFinite(i))
+				candidates.push_back(i);
+		}
+		const int nCandidates = int(candidates.size());
+		indices.clear();
+		if (nCandidates == 0)
+			return;
+		if (nSamples >= nCandidates) {
+			indices = candidates;
+			return;
+		}
+
+		// Center and scale the points, so that rotations and translations are weighted comparably.
+		double centerX = 0.0, centerY = 0.0, centerZ = 0.0;
+		#pragma omp parallel for reduction(+:centerX,centerY,centerZ) num_threads(Parallel::getNumThreads())
+		for (int c = 0; c < nCandidates; ++c) {
+			centerX += points.x()[candidates[c]];
+			centerY += points.y()[candidates[c]];
+			centerZ += points.z()[candidates[c]];
+		}
+		const Vector3f center = Vector3d(centerX, centerY, centerZ).cast<float>() / float(nCandidates);
+
+		double scale = 0.0;
+		#pragma omp parallel for reduction(+:scale) num_threads(Parallel::getNumThreads())
+		for (int c = 0; c < nCandidates; ++c)
+			scale += (points[candidates[c]] - center).norm();
+		scale = scale > 0.0 ? nCandidates / scale : 1.0;
+
+		auto constraint = [&](int i) {
+			const Vector3d point = (points[i] - center).cast<double>() * scale;
+			const Vector3d normal = normals[i].cast<double>();
+			Vector6d v;
+			v << point.cross(normal), normal;
+			return v;
+		};
+
+		// Covariance of the constraints, accumulated per thread.
+		const int nThreads = Parallel::getNumThreads();
+		std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d>> partialCovariances(nThreads, Matrix6d::Zero());
+		#pragma omp parallel for num_threads(nThreads)
+		for (int c = 0; c < nCandidates; ++c) {
+			const Vector6d v = constraint(candidates[c]);
+			partialCovariances[Parallel::getThreadId()].noalias() += v * v.transpose();
+		}
+		Matrix6d covariance = Matrix6d::Zero();
+		for (const auto& partialCovariance : partialCovariances)
+			covariance += partialCovariance;
+
+		Eigen::SelfAdjointEigenSolver<Matrix6d> solver(covariance);
+		const Matrix6d eigenvectors = solver.eigenvectors();
+
+		// For every eigenvector the candidates with the largest responses, in descending order. At most nSamples
+		// points are taken from a list and at most nSamples of its entries can be used by other lists before.
+		const int nListed = std::min(nCandidates, 2 * nSamples);
+		std::vector<std::vector<std::pair<double, int>>> lists(6);
+		#pragma omp parallel for num_threads(std::min(nThreads, 6))
+		for (int k = 0; k < 6; ++k) {
+			auto& list = lists[k];
+			list.resize(nCandidates);
+			for (int c = 0; c < nCandidates; ++c)
+				list[c] = { -std::abs(constraint(candidates[c]).dot(eigenvectors.col(k))), candidates[c] };
+			std::partial_sort(list.begin(), list.begin() + nListed, list.end());
+			list.resize(nListed);
+		}
+
+		std::vector<bool> used(points.size(), false);
+		std::vector<int> positions(6, 0);
+		Vector6d accumulated = Vector6d::Zero();
+		indices.reserve(nSamples);
+		while (int(indices.size()) < nSamples) {
+			int k = -1;
+			for (int j = 0; j < 6; ++j) {
+				if (positions[j] < nListed && (k < 0 || accumulated[j] < accumulated[k]))
+					k = j;
+			}
+			if (k < 0)
+				break;
+
+			const int i = lists[k][positions[k]++].second;
+			if (used[i])
+				continue;
+			used[i] = true;
+			indices.push_back(i);
+
+			const Vector6d v = constraint(i);
+			accumulated += (eigenvectors.transpose() * v).cwiseAbs2();
+		}
+		std::sort(indices.begin(), indices.end());
+	}
+};
+
+
+/**
+ * Cache of the deterministic index lists of a cloud, keyed by strategy. Thread-safe, lists are handed out as
+ * shared pointers, so clearing the cache doesn't invalidate lists that are still in use.
+ */
+class SampleCache {
+public:
+	typedef std::shared_ptr<const std::vector<int>> IndexList;
+
+	IndexList get(const SamplingStrategy& strategy, const PointSoA& points, const PointSoA& normals) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_lists.find(strategy);
+		if (it != m_lists.end())
+			return it->second;
+
+		// Deterministic strategies draw from a fixed seed.
+		std::mt19937 rng(0);
+		auto indices = std::make_shared<std::vector<int>>();
+		PointSampler::select(strategy, points, normals, rng, *indices);
+		m_lists[strategy] = indices;
+		return indices;
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_lists.clear();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::map<SamplingStrategy, IndexList> m_lists;
+};
@@ -2,8 +2,18 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cctype>
 
 #include "Eigen.h"
+#include "Parallel.h"
+#include "MappedFile.h"
+#include "TextFormat.h"
+#include "PlyFormat.h"
 
 struct Vertex {
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -31,89 +41,136 @@ public:
 	SimpleMesh() {}
 
 	/**
-	 * Constructs a mesh from the current color and depth image.
+	 * Constructs a mesh from the current color and depth image (see the raw-buffer constructor). Without
+	 * withColor, the color frame isn't read and all vertices are white.
 	 */
-	SimpleMesh(VirtualSensor& sensor, const Matrix4f& cameraPose, float edgeThreshold = 0.01f) {
-		// Get ptr to the current depth frame.
-		// Depth is stored in row major (get dimensions via sensor.GetDepthImageWidth() / GetDepthImageHeight()).
-		float* depthMap = sensor.getDepth();
-		// Get ptr to the current color frame.
-		// Color is stored as RGBX in row major (4 byte values per pixel, get dimensions via sensor.GetColorImageWidth() / GetColorImageHeight()).
-		BYTE* colorMap = sensor.getColorRGBX();
-
-		// Get depth intrinsics.
-		Matrix3f depthIntrinsics = sensor.getDepthIntrinsics();
-		float fovX = depthIntrinsics(0, 0);
-		float fovY = depthIntrinsics(1, 1);
-		float cX = depthIntrinsics(0, 2);
-		float cY = depthIntrinsics(1, 2);
-
-		// Compute inverse depth extrinsics.
-		Matrix4f depthExtrinsicsInv = sensor.getDepthExtrinsics().inverse();
-
-		// Compute inverse camera pose (mapping from camera CS to world CS).
-		Matrix4f cameraPoseInverse = cameraPose.inverse();
+	SimpleMesh(VirtualSensor& sensor, const Matrix4f& cameraPose, float edgeThreshold = 0.01f, bool withColor = true) :
+		SimpleMesh(sensor.getDepth(), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), cameraPose, edgeThreshold,
+			withColor ? sensor.getColorRGBX() : nullptr, sensor.getColorIntrinsics(), sensor.getColorExtrinsics(), sensor.getColorImageWidth(), sensor.getColorImageHeight())
+	{ }
+
+	/**
+	 * Constructs a mesh from a depth map (row major, MINF for invalid pixels) and optionally an RGBX color map.
+	 * Every pixel becomes a vertex in world space (invalid pixels get MINF positions), neighboring pixels are
+	 * connected by two triangles per pixel quad if all their edges are shorter than edgeThreshold.
+	 * The camera-to-world and camera-to-color transformations are combined once per frame, vertices are computed
+	 * in parallel over rows. Triangles are flagged per row in parallel and written in parallel at the row offsets
+	 * given by a prefix sum of the row counts, so they come out in row-major order.
+	 * Without a color map (colorMap = nullptr) the color lookup is skipped and all vertices are white. Without a
+	 * depth map (depthMap = nullptr, e.g. a frame that failed to decode) the mesh is empty.
+	 */
+	SimpleMesh(const float* depthMap, const Matrix3f& depthIntrinsics, const Matrix4f& depthExtrinsics, unsigned width, unsigned height, const Matrix4f& cameraPose, float edgeThreshold = 0.01f,
+		const unsigned char* colorMap = nullptr, const Matrix3f& colorIntrinsics = Matrix3f::Identity(), const Matrix4f& colorExtrinsics = Matrix4f::Identity(), unsigned colorWidth = 0, unsigned colorHeight = 0) {
+		if (!depthMap)
+			return;
+
+		const int w = int(width);
+		const int h = int(height);
+
+		const float fovX = depthIntrinsics(0, 0);
+		const float fovY = depthIntrinsics(1, 1);
+		const float cX = depthIntrinsics(0, 2);
+		const float cY = depthIntrinsics(1, 2);
+
+		// Back-projection and transformation to world space: world = cameraPose^-1 * depthExtrinsics^-1 * camera.
+		const Matrix4f worldFromCamera = cameraPose.inverse() * depthExtrinsics.inverse();
+		// Projection of world points to the color map, combined with the back-projection above.
+		Eigen::Matrix<float, 3, 4> colorFromCamera = colorIntrinsics * (colorExtrinsics * cameraPose * worldFromCamera).topRows<3>();
+
+		std::vector<float> rayX(w);
+		for (int u = 0; u < w; ++u)
+			rayX[u] = (u - cX) / fovX;
 
 		// Compute vertices with back-projection.
-		m_vertices.resize(sensor.getDepthImageWidth() * sensor.getDepthImageHeight());
-		// For every pixel row.
-		for (unsigned int v = 0; v < sensor.getDepthImageHeight(); ++v) {
-			// For every pixel in a row.
-			for (unsigned int u = 0; u < sensor.getDepthImageWidth(); ++u) {
-				unsigned int idx = v*sensor.getDepthImageWidth() + u; // linearized index
-				float depth = depthMap[idx];
-				if (depth == MINF) {
-					m_vertices[idx].position = Vector4f(MINF, MINF, MINF, MINF);
-					m_vertices[idx].color = Vector4uc(0, 0, 0, 0);
+		m_vertices.resize(size_t(w) * h);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int v = 0; v < h; ++v) {
+			const float rayY = (v - cY) / fovY;
+			// Camera point (x, y, depth, 1) = depth * (rayX, rayY, 1, 0) + (0, 0, 0, 1).
+			const Vector4f rowBase = worldFromCamera.col(1) * rayY + worldFromCamera.col(2);
+			const Vector3f colorRowBase = colorFromCamera.col(1) * rayY + colorFromCamera.col(2);
+
+			for (int u = 0; u < w; ++u) {
+				const size_t idx = size_t(v) * w + u; // linearized index
+				const float depth = depthMap[idx];
+				Vertex& vertex = m_vertices[idx];
+				if (!std::isfinite(depth)) {
+					vertex.position = Vector4f(MINF, MINF, MINF, MINF);
+					vertex.color = Vector4uc(0, 0, 0, 0);
+					continue;
 				}
-				else {
-					// Back-projection and tranformation to world space.
-					m_vertices[idx].position = cameraPoseInverse * depthExtrinsicsInv * Vector4f((u - cX) / fovX * depth, (v - cY) / fovY * depth, depth, 1.0f);
-
-					// Project position to color map.
-					Vector3f proj = sensor.getColorIntrinsics() * (sensor.getColorExtrinsics() * cameraPose * m_vertices[idx].position).block<3, 1>(0, 0);
-					proj /= proj.z(); // dehomogenization
-					unsigned int uCol = (unsigned int)std::floor(proj.x());
-					unsigned int vCol = (unsigned int)std::floor(proj.y());
-					if (uCol >= sensor.getColorImageWidth()) uCol = sensor.getColorImageWidth() - 1;
-					if (vCol >= sensor.getColorImageHeight()) vCol = sensor.getColorImageHeight() - 1;
-					unsigned int idxCol = vCol*sensor.getColorImageWidth() + uCol; // linearized index color
-																					//unsigned int idxCol = idx; // linearized index color
-
-					// Write color to vertex.
-					m_vertices[idx].color = Vector4uc(colorMap[4 * idxCol + 0], colorMap[4 * idxCol + 1], colorMap[4 * idxCol + 2], colorMap[4 * idxCol + 3]);
+
+				vertex.position = (worldFromCamera.col(0) * rayX[u] + rowBase) * depth + worldFromCamera.col(3);
+				if (!colorMap) {
+					vertex.color = Vector4uc(255, 255, 255, 255);
+					continue;
 				}
+
+				// Project position to color map.
+				Vector3f proj = (colorFromCamera.col(0) * rayX[u] + colorRowBase) * depth + colorFromCamera.col(3);
+				proj /= proj.z(); // dehomogenization
+				const int uCol = std::min(std::max(int(std::floor(proj.x())), 0), int(colorWidth) - 1);
+				const int vCol = std::min(std::max(int(std::floor(proj.y())), 0), int(colorHeight) - 1);
+				const unsigned char* color = colorMap + 4 * (size_t(vCol) * colorWidth + uCol); // linearized index color
+
+				// Write color to vertex.
+				vertex.color = Vector4uc(color[0], color[1], color[2], color[3]);
 			}
 		}
 
-		// Compute triangles (faces).
-		m_triangles.reserve((sensor.getDepthImageHeight() - 1) * (sensor.getDepthImageWidth() - 1) * 2);
-		for (unsigned int i = 0; i < sensor.getDepthImageHeight() - 1; i++) {
-			for (unsigned int j = 0; j < sensor.getDepthImageWidth() - 1; j++) {
-				unsigned int i0 = i*sensor.getDepthImageWidth() + j;
-				unsigned int i1 = (i + 1)*sensor.getDepthImageWidth() + j;
-				unsigned int i2 = i*sensor.getDepthImageWidth() + j + 1;
-				unsigned int i3 = (i + 1)*sensor.getDepthImageWidth() + j + 1;
-
-				bool valid0 = m_vertices[i0].position.allFinite();
-				bool valid1 = m_vertices[i1].position.allFinite();
-				bool valid2 = m_vertices[i2].position.allFinite();
-				bool valid3 = m_vertices[i3].position.allFinite();
-
-				if (valid0 && valid1 && valid2) {
-					float d0 = (m_vertices[i0].position - m_vertices[i1].position).norm();
-					float d1 = (m_vertices[i0].position - m_vertices[i2].position).norm();
-					float d2 = (m_vertices[i1].position - m_vertices[i2].position).norm();
-					if (edgeThreshold > d0 && edgeThreshold > d1 && edgeThreshold > d2)
-						addFace(i0, i1, i2);
-				}
-				if (valid1 && valid2 && valid3) {
-					float d0 = (m_vertices[i3].position - m_vertices[i1].position).norm();
-					float d1 = (m_vertices[i3].position - m_vertices[i2].position).norm();
-					float d2 = (m_vertices[i1].position - m_vertices[i2].position).norm();
-					if (edgeThreshold > d0 && edgeThreshold > d1 && edgeThreshold > d2)
-						addFace(i1, i3, i2);
-				}
+		// Compute triangles (faces): flag the two possible triangles of every pixel quad and count them per row.
+		if (w < 2 || h < 2)
+			return;
+		const int nCells = w - 1;
+		std::vector<unsigned char> faceFlags(size_t(nCells) * (h - 1));
+		std::vector<unsigned int> rowOffsets(h, 0);
+
+		auto isShortTriangle = [&](unsigned int i0, unsigned int i1, unsigned int i2) {
+			const Vector4f& p0 = m_vertices[i0].position;
+			const Vector4f& p1 = m_vertices[i1].position;
+			const Vector4f& p2 = m_vertices[i2].position;
+			if (!p0.allFinite() || !p1.allFinite() || !p2.allFinite())
+				return false;
+			return edgeThreshold > (p0 - p1).norm() && edgeThreshold > (p0 - p2).norm() && edgeThreshold > (p1 - p2).norm();
+		};
+
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < h - 1; i++) {
+			unsigned int count = 0;
+			for (int j = 0; j < nCells; j++) {
+				const unsigned int i0 = i * w + j;
+				const unsigned int i1 = (i + 1) * w + j;
+				const unsigned int i2 = i * w + j + 1;
+				const unsigned int i3 = (i + 1) * w + j + 1;
+
+				const unsigned char flags = (isShortTriangle(i0, i1, i2) ? 1 : 0) | (isShortTriangle(i3, i1, i2) ? 2 : 0);
+				faceFlags[size_t(i) * nCells + j] = flags;
+				count += (flags & 1) + (flags >> 1);
+			}
+			rowOffsets[i + 1] = count;
+		}
+
+		// Prefix sum of the row counts gives the first triangle of every row.
+		for (int i = 1; i < h; i++)
+			rowOffsets[i] += rowOffsets[i - 1];
+		m_triangles.resize(rowOffsets[h - 1]);
+
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < h - 1; i++) {
+			unsigned int fIdx = rowOffsets[i];
+			for (int j = 0; j < nCells; j++) {
+				const unsigned char flags = faceFlags[size_t(i) * nCells + j];
+				if (flags == 0)
+					continue;
+
+				const unsigned int i0 = i * w + j;
+				const unsigned int i1 = (i + 1) * w + j;
+				const unsigned int i2 = i * w + j + 1;
+				const unsigned int i3 = (i + 1) * w + j + 1;
+				if (flags & 1)
+					m_triangles[fIdx++] = Triangle(i0, i1, i2);
+				if (flags & 2)
+					m_triangles[fIdx++] = Triangle(i1, i3, i2);
 			}
 		}
 	}
@@ -158,102 +215,319 @@ public:
 		}
 	}
 
+	/**
+	 * Reads an OFF or COFF file (triangles only), or a binary PLY file if the name ends with ".ply" (see loadPly()).
+	 * The OFF file is memory-mapped; vertex and face lines are located
+	 * with a fast scan for line breaks and parsed in parallel. Files that don't have one element per line are
+	 * parsed serially with the same tokenizer.
+	 */
 	bool loadMesh(const std::string& filename) {
-		// Read off file (Important: Only .off files are supported).
+		if (hasExtension(filename, ".ply"))
+			return loadPly(filename);
+
+		// Read off file (Important: Only .off and .ply files are supported).
 		m_vertices.clear();
 		m_triangles.clear();
 
-		std::ifstream file(filename);
-		if (!file.is_open()) {
+		std::shared_ptr<const MappedFile> file = MappedFile::open(filename);
+		if (!file) {
 			std::cout << "Mesh file wasn't read successfully." << std::endl;
 			return false;
 		}
 
+		TextReader reader{ file->data(), file->data() + file->size() };
+
 		// First line should say 'COFF'.
-		char string1[5];
-		file >> string1;
+		std::string type;
+		reader.readToken(type);
+		const bool hasColors = type == "COFF";
+		if (!hasColors && type != "OFF") {
+			std::cout << "Incorrect mesh file type." << std::endl;
+			return false;
+		}
 
 		// Read header.
 		unsigned int numV = 0;
 		unsigned int numP = 0;
 		unsigned int numE = 0;
-		file >> numV >> numP >> numE;
-
-		m_vertices.reserve(numV);
-		m_triangles.reserve(numP);
-
-		// Read vertices.
-		if (std::string(string1).compare("COFF") == 0) {
-			// We have color information.
-			for (unsigned int i = 0; i < numV; i++) {
-				Vertex v;
-				file >> v.position.x() >> v.position.y() >> v.position.z();
-				v.position.w() = 1.f;
-				// Colors are stored as integers. We need to convert them.
-				Vector4i colorInt;
-				file >> colorInt.x() >> colorInt.y() >> colorInt.z() >> colorInt.w();
-				v.color = Vector4uc((unsigned char)colorInt.x(), (unsigned char)colorInt.y(), (unsigned char)colorInt.z(), (unsigned char)colorInt.w());
-				m_vertices.push_back(v);
-			}
-		}
-		else if (std::string(string1).compare("OFF") == 0) {
-			// We only have vertex information.
-			for (unsigned int i = 0; i < numV; i++) {
-				Vertex v;
-				file >> v.position.x() >> v.position.y() >> v.position.z();
-				v.position.w() = 1.f;
-				v.color.x() = 0;
-				v.color.y() = 0;
-				v.color.z() = 0;
-				v.color.w() = 255;
-				m_vertices.push_back(v);
-			}
-		}
-		else {
-			std::cout << "Incorrect mesh file type." << std::endl;
+		if (!reader.readUInt(numV) || !reader.readUInt(numP) || !reader.readUInt(numE)) {
+			std::cout << "Incorrect mesh file header." << std::endl;
 			return false;
 		}
+		reader.skipLine();
+
+		m_vertices.resize(numV);
+		m_triangles.resize(numP);
+
+		bool success = parseElementLines(reader, hasColors);
+		if (!success) {
+			// Elements spanning several lines (or several elements per line).
+			TextReader serialReader = reader;
+			success = true;
+			for (unsigned int i = 0; i < numV && success; i++)
+				success = parseVertex(serialReader, hasColors, m_vertices[i]);
+			for (unsigned int i = 0; i < numP && success; i++)
+				success = parseTriangle(serialReader, m_triangles[i]);
+		}
+
+		// Faces must only reference vertices of the file.
+		for (unsigned int i = 0; i < numP && success; i++)
+			success = m_triangles[i].idx0 < numV && m_triangles[i].idx1 < numV && m_triangles[i].idx2 < numV;
 
-		// Read faces (i.e. triangles).
-		for (unsigned int i = 0; i < numP; i++) {
-			unsigned int num_vs;
-			file >> num_vs;
-			ASSERT(num_vs == 3 && "We can only read triangular mesh.");
-			
-			Triangle t;
-			file >> t.idx0 >> t.idx1 >> t.idx2;
-			m_triangles.push_back(t);
+		if (!success) {
+			std::cout << "Mesh file " << filename << " is corrupt, or not a triangular mesh." << std::endl;
+			m_vertices.clear();
+			m_triangles.clear();
+			return false;
 		}
 
 		return true;
 	}
 
+	/**
+	 * Writes a COFF file, or a binary PLY file if the name ends with ".ply" (see writePly()). Vertex and face lines are formatted in parallel chunks into memory (6 significant digits,
+	 * like the stream output) and written with a few large writes.
+	 */
 	bool writeMesh(const std::string& filename) {
+		if (hasExtension(filename, ".ply"))
+			return writePly(filename);
+
 		// Write off file.
-		std::ofstream outFile(filename);
+		std::ofstream outFile(filename, std::ios::out | std::ios::binary);
 		if (!outFile.is_open()) return false;
 
 		// Write header.
-		outFile << "COFF" << std::endl;
-		outFile << m_vertices.size() << " " << m_triangles.size() << " 0" << std::endl;
+		std::string header = "COFF\n";
+		TextWriter::appendUInt(header, unsigned(m_vertices.size()));
+		header.push_back(' ');
+		TextWriter::appendUInt(header, unsigned(m_triangles.size()));
+		header += " 0\n";
+		outFile.write(header.data(), header.size());
+
+		const int chunkSize = 16384;
+		const int nVertexChunks = int((m_vertices.size() + chunkSize - 1) / chunkSize);
+		const int nTriangleChunks = int((m_triangles.size() + chunkSize - 1) / chunkSize);
+		std::vector<std::string> chunks(nVertexChunks + nTriangleChunks);
+
+		#pragma omp parallel for schedule(dynamic) num_threads(Parallel::getNumThreads())
+		for (int c = 0; c < nVertexChunks + nTriangleChunks; ++c) {
+			std::string& chunk = chunks[c];
+			if (c < nVertexChunks) {
+				// Save vertices.
+				const size_t begin = size_t(c) * chunkSize;
+				const size_t end = std::min(begin + chunkSize, m_vertices.size());
+				chunk.reserve((end - begin) * 48);
+				for (size_t i = begin; i < end; i++) {
+					const auto& vertex = m_vertices[i];
+					if (vertex.position.allFinite()) {
+						for (int k = 0; k < 3; ++k) {
+							TextWriter::appendFloat(chunk, vertex.position[k]);
+							chunk.push_back(' ');
+						}
+						for (int k = 0; k < 4; ++k) {
+							TextWriter::appendUInt(chunk, vertex.color[k]);
+							chunk.push_back(k < 3 ? ' ' : '\n');
+						}
+					}
+					else {
+						chunk += "0.0 0.0 0.0 0 0 0 0\n";
+					}
+				}
+			}
+			else {
+				// Save faces.
+				const size_t begin = size_t(c - nVertexChunks) * chunkSize;
+				const size_t end = std::min(begin + chunkSize, m_triangles.size());
+				chunk.reserve((end - begin) * 24);
+				for (size_t i = begin; i < end; i++) {
+					chunk += "3 ";
+					TextWriter::appendUInt(chunk, m_triangles[i].idx0);
+					chunk.push_back(' ');
+					TextWriter::appendUInt(chunk, m_triangles[i].idx1);
+					chunk.push_back(' ');
+					TextWriter::appendUInt(chunk, m_triangles[i].idx2);
+					chunk.push_back('\n');
+				}
+			}
+		}
 
-		// Save vertices.
-		for (unsigned int i = 0; i < m_vertices.size(); i++) {
-			const auto& vertex = m_vertices[i];
-			if (vertex.position.allFinite())
-				outFile << vertex.position.x() << " " << vertex.position.y() << " " << vertex.position.z() << " "
-				<< int(vertex.color.x()) << " " << int(vertex.color.y()) << " " << int(vertex.color.z()) << " " << int(vertex.color.w()) << std::endl;
-			else
-				outFile << "0.0 0.0 0.0 0 0 0 0" << std::endl;
+		for (const auto& chunk : chunks)
+			outFile.write(chunk.data(), chunk.size());
+
+		// Close file.
+		outFile.close();
+
+		return bool(outFile);
+	}
+
+	/**
+	 * Writes a binary little-endian PLY file: float positions and uchar RGBA colors per vertex, triangles as
+	 * uchar/int lists. The records are packed in parallel, vertices and faces are written with one call each.
+	 * Like in writeMesh(), invalid vertices are written as black points at the origin.
+	 */
+	bool writePly(const std::string& filename) const {
+		if (!PlyFormat::isLittleEndianHost()) {
+			std::cout << "PLY files can only be written on little-endian hosts." << std::endl;
+			return false;
 		}
 
-		// Save faces.
-		for (unsigned int i = 0; i < m_triangles.size(); i++) {
-			outFile << "3 " << m_triangles[i].idx0 << " " << m_triangles[i].idx1 << " " << m_triangles[i].idx2 << std::endl;
+		std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+		if (!outFile.is_open()) return false;
+
+		const int nVertices = int(m_vertices.size());
+		const int nTriangles = int(m_triangles.size());
+
+		std::stringstream header;
+		header << "ply\nformat binary_little_endian 1.0\n"
+			<< "element vertex " << nVertices << "\n"
+			<< "property float x\nproperty float y\nproperty float z\n"
+			<< "property uchar red\nproperty uchar green\nproperty uchar blue\nproperty uchar alpha\n"
+			<< "element face " << nTriangles << "\n"
+			<< "property list uchar int vertex_indices\n"
+			<< "end_header\n";
+		const std::string headerText = header.str();
+		outFile.write(headerText.data(), headerText.size());
+
+		const size_t vertexSize = 3 * sizeof(float) + 4;
+		std::vector<char> vertexData(size_t(nVertices) * vertexSize);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nVertices; ++i) {
+			const auto& vertex = m_vertices[i];
+			const bool valid = vertex.position.allFinite();
+			char* record = &vertexData[size_t(i) * vertexSize];
+			for (int k = 0; k < 3; ++k)
+				PlyFormat::store(record + k * sizeof(float), valid ? vertex.position[k] : 0.f);
+			for (int k = 0; k < 4; ++k)
+				record[3 * sizeof(float) + k] = valid ? char(vertex.color[k]) : 0;
 		}
+		outFile.write(vertexData.data(), vertexData.size());
+
+		const size_t faceSize = 1 + 3 * sizeof(int32_t);
+		std::vector<char> faceData(size_t(nTriangles) * faceSize);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nTriangles; ++i) {
+			char* record = &faceData[size_t(i) * faceSize];
+			record[0] = 3;
+			PlyFormat::store(record + 1, int32_t(m_triangles[i].idx0));
+			PlyFormat::store(record + 1 + sizeof(int32_t), int32_t(m_triangles[i].idx1));
+			PlyFormat::store(record + 1 + 2 * sizeof(int32_t), int32_t(m_triangles[i].idx2));
+		}
+		outFile.write(faceData.data(), faceData.size());
 
-		// Close file.
 		outFile.close();
+		return bool(outFile);
+	}
+
+	/**
+	 * Reads a binary little-endian PLY file with x, y, z vertex properties (any numeric type) and optional
+	 * red, green, blue, alpha colors (integers in [0, 255] or floats in [0, 1]). Polygonal faces are split into
+	 * triangle fans.
+	 */
+	bool loadPly(const std::string& filename) {
+		m_vertices.clear();
+		m_triangles.clear();
+
+		std::shared_ptr<const MappedFile> file = MappedFile::open(filename);
+		if (!file) {
+			std::cout << "Mesh file wasn't read successfully." << std::endl;
+			return false;
+		}
+
+		PlyFormat::Header header;
+		if (!PlyFormat::isLittleEndianHost() || !PlyFormat::parseHeader(file->data(), file->size(), header)) {
+			std::cout << "Incorrect mesh file type (only binary little-endian PLY files are supported)." << std::endl;
+			return false;
+		}
+
+		const char* fileEnd = file->data() + file->size();
+		const PlyFormat::Element* vertexElement = header.findElement("vertex");
+		const char* vertexData = PlyFormat::findElementData(header, file->data(), file->size(), "vertex");
+		const size_t vertexSize = vertexElement ? vertexElement->recordSize() : 0;
+		if (!vertexData || vertexSize == 0 || vertexElement->count > size_t(fileEnd - vertexData) / vertexSize) {
+			std::cout << "Mesh file " << filename << " has no valid vertex data." << std::endl;
+			return false;
+		}
+		// The vertices are indexed with int.
+		if (vertexElement->count > size_t(std::numeric_limits<int>::max())) {
+			std::cout << "Mesh file " << filename << " has too many vertices." << std::endl;
+			return false;
+		}
+
+		const char* names[] = { "x", "y", "z", "red", "green", "blue", "alpha" };
+		int properties[7];
+		size_t offsets[7];
+		for (int k = 0; k < 7; ++k) {
+			properties[k] = vertexElement->findProperty(names[k]);
+			offsets[k] = properties[k] >= 0 ? vertexElement->propertyOffset(properties[k]) : 0;
+		}
+		if (properties[0] < 0 || properties[1] < 0 || properties[2] < 0) {
+			std::cout << "Mesh file " << filename << " has no vertex positions." << std::endl;
+			return false;
+		}
+
+		const int nVertices = int(vertexElement->count);
+		m_vertices.resize(nVertices);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nVertices; ++i) {
+			const char* record = vertexData + size_t(i) * vertexSize;
+			Vertex& v = m_vertices[i];
+			for (int k = 0; k < 3; ++k)
+				v.position[k] = float(PlyFormat::readValue(record + offsets[k], vertexElement->properties[properties[k]].type));
+			v.position.w() = 1.f;
+			v.color = Vector4uc(0, 0, 0, 255);
+			for (int k = 0; k < 4; ++k) {
+				if (properties[3 + k] >= 0)
+					v.color[k] = PlyFormat::readColor(record + offsets[3 + k], vertexElement->properties[properties[3 + k]].type);
+			}
+		}
+
+		const PlyFormat::Element* faceElement = header.findElement("face");
+		if (!faceElement)
+			return true;
+
+		int indexProperty = faceElement->findProperty("vertex_indices");
+		if (indexProperty < 0)
+			indexProperty = faceElement->findProperty("vertex_index");
+		const char* p = PlyFormat::findElementData(header, file->data(), file->size(), "face");
+		if (indexProperty < 0 || !faceElement->properties[indexProperty].isList || !p) {
+			std::cout << "Mesh file " << filename << " has no valid face data." << std::endl;
+			return false;
+		}
+
+		m_triangles.reserve(faceElement->count);
+		for (size_t i = 0; i < faceElement->count; ++i) {
+			for (int j = 0; j < int(faceElement->properties.size()); ++j) {
+				const auto& property = faceElement->properties[j];
+				if (j != indexProperty) {
+					// Other face properties are skipped.
+					PlyFormat::Element single;
+					single.properties.push_back(property);
+					if (!PlyFormat::skipRecord(single, p, fileEnd))
+						return failPly(filename);
+					continue;
+				}
+
+				const int countSize = PlyFormat::typeSize(property.countType);
+				const int indexSize = PlyFormat::typeSize(property.type);
+				if (p + countSize > fileEnd)
+					return failPly(filename);
+				const int count = int(PlyFormat::readValue(p, property.countType));
+				p += countSize;
+				if (count < 0 || p + size_t(count) * indexSize > fileEnd)
+					return failPly(filename);
+
+				// Triangle fan around the first index.
+				const unsigned int first = unsigned(PlyFormat::readValue(p, property.type));
+				for (int k = 1; k + 1 < count; ++k) {
+					const unsigned int idx1 = unsigned(PlyFormat::readValue(p + k * indexSize, property.type));
+					const unsigned int idx2 = unsigned(PlyFormat::readValue(p + (k + 1) * indexSize, property.type));
+					if (first >= unsigned(nVertices) || idx1 >= unsigned(nVertices) || idx2 >= unsigned(nVertices))
+						return failPly(filename);
+					m_triangles.push_back(Triangle{ first, idx1, idx2 });
+				}
+				p += size_t(count) * indexSize;
+			}
+		}
 
 		return true;
 	}
@@ -377,7 +651,7 @@ public:
 			{
 				auto& v = vertices[vIndex++];
 				float theta = float(i2) * 2.0f * M_PI / float(slices);
-				v.position = Vector4f{ p0.x() + radius * cosf(theta), p0.y() + radius * sinf(theta), p0.z() + height * float(i) / float(stacks), 1.f };
+				v.position = Vector4f{ radius * cosf(theta), radius * sinf(theta), height * float(i) / float(stacks), 1.f };
 				v.color = color;
 			}
 
@@ -406,34 +680,95 @@ public:
 	}
 
 private:
-	std::vector<Vertex> m_vertices;
-	std::vector<Triangle> m_triangles;
+	static bool hasExtension(const std::string& filename, const std::string& extension) {
+		if (filename.size() < extension.size())
+			return false;
+		for (size_t i = 0; i < extension.size(); ++i) {
+			if (std::tolower((unsigned char)filename[filename.size() - extension.size() + i]) != extension[i])
+				return false;
+		}
+		return true;
+	}
+
+	bool failPly(const std::string& filename) {
+		std::cout << "Mesh file " << filename << " has invalid face data." << std::endl;
+		m_vertices.clear();
+		m_triangles.clear();
+		return false;
+	}
+
+	static bool parseVertex(TextReader& reader, bool hasColors, Vertex& v) {
+		if (!reader.readFloat(v.position.x()) || !reader.readFloat(v.position.y()) || !reader.readFloat(v.position.z()))
+			return false;
+		v.position.w() = 1.f;
+
+		if (!hasColors) {
+			v.color = Vector4uc(0, 0, 0, 255);
+			return true;
+		}
+
+		// Colors are stored as integers. We need to convert them.
+		Vector4i colorInt;
+		if (!reader.readInt(colorInt.x()) || !reader.readInt(colorInt.y()) || !reader.readInt(colorInt.z()) || !reader.readInt(colorInt.w()))
+			return false;
+		v.color = Vector4uc((unsigned char)colorInt.x(), (unsigned char)colorInt.y(), (unsigned char)colorInt.z(), (unsigned char)colorInt.w());
+		return true;
+	}
+
+	static bool parseTriangle(TextReader& reader, Triangle& t) {
+		// We can only read triangular meshes.
+		unsigned int num_vs;
+		return reader.readUInt(num_vs) && num_vs == 3 && reader.readUInt(t.idx0) && reader.readUInt(t.idx1) && reader.readUInt(t.idx2);
+	}
 
 	/**
-	 * Returns a rotation that transforms vector vA into vector vB.
+	 * Fast path of loadMesh: finds the start of the next (numV + numP) lines that aren't empty or comments, then
+	 * parses one vertex or face per line in parallel. Returns false if any line doesn't hold exactly one element.
 	 */
-	static Matrix3f face(const Vector3f& vA, const Vector3f& vB) {
-		auto a = vA.normalized();
-		auto b = vB.normalized();
-		auto axis = b.cross(a);
-		float angle = acosf(a.dot(b));
-		
-		if (angle == 0.0f) {  // No rotation
-			return Matrix3f::Identity();
+	bool parseElementLines(const TextReader& reader, bool hasColors) {
+		const size_t nElements = m_vertices.size() + m_triangles.size();
+		const char* position = reader.position();
+		const char* fileEnd = reader.end();
+
+		std::vector<const char*> lineStarts;
+		lineStarts.reserve(nElements + 1);
+		while (position < fileEnd && lineStarts.size() < nElements) {
+			const char* lineEnd = static_cast<const char*>(std::memchr(position, '\n', size_t(fileEnd - position)));
+			lineEnd = lineEnd ? lineEnd + 1 : fileEnd;
+
+			const char* first = position;
+			while (first < lineEnd && (*first == ' ' || *first == '\t' || *first == '\r' || *first == '\n'))
+				++first;
+			if (first < lineEnd && *first != '#')
+				lineStarts.push_back(position);
+			position = lineEnd;
+		}
+		if (lineStarts.size() < nElements)
+			return false;
+		lineStarts.push_back(position);
+
+		const int nVertices = int(m_vertices.size());
+		int nFailures = 0;
+		#pragma omp parallel for reduction(+:nFailures) num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < int(nElements); ++i) {
+			TextReader lineReader{ lineStarts[i], lineStarts[i + 1] };
+			const bool parsed = i < nVertices ? parseVertex(lineReader, hasColors, m_vertices[i]) : parseTriangle(lineReader, m_triangles[i - nVertices]);
+			if (!parsed || !lineReader.atEnd())
+				++nFailures;
 		}
 
-		// Convert the rotation from SO3 to matrix notation.
-		// First we create a skew symetric matrix from the axis vector.
-		Matrix3f skewSymetricMatrix;
-		skewSymetricMatrix.setIdentity();
-		skewSymetricMatrix(0, 0) = 0;			skewSymetricMatrix(0, 1) = -axis.z();	skewSymetricMatrix(0, 2) = axis.y();
-		skewSymetricMatrix(1, 0) = axis.z();	skewSymetricMatrix(1, 1) = 0;			skewSymetricMatrix(1, 2) = -axis.x();
-		skewSymetricMatrix(2, 0) = -axis.y();	skewSymetricMatrix(2, 1) = axis.x();	skewSymetricMatrix(2, 2) = 0;
+		return nFailures == 0;
+	}
 
-		// We compute a rotation matrix using Rodrigues formula.
-		Matrix3f rotation = Matrix3f::Identity() + sinf(angle) * skewSymetricMatrix + (1 - cos(angle)) * skewSymetricMatrix * skewSymetricMatrix;
+	std::vector<Vertex> m_vertices;
+	std::vector<Triangle> m_triangles;
 
-		return rotation;
+	/**
+	 * Returns a rotation that transforms vector vA into vector vB.
+	 */
+	static Matrix3f face(const Vector3f& vA, const Vector3f& vB) {
+		// Rotation that maps the direction of vA onto the direction of vB.
+		return Eigen::Quaternionf::FromTwoVectors(vA, vB).toRotationMatrix();
 	}
 };
 
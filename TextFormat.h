@@ -0,0 +1,315 @@
+#pragma once
+
+#include <string>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+/**
+ * Tokenizer for whitespace-separated text formats (OFF, ...) working directly on a character buffer (e.g. a
+ * memory-mapped file). '#' starts a comment up to the end of the line.
+ * Numbers are parsed by hand, without locale handling or stream state: decimal mantissas up to 2^53 with an
+ * exponent in [-22, 22] are converted with one exactly representable power of ten; other numbers (and inf/nan)
+ * fall back to strtod.
+ */
+class TextReader {
+public:
+	TextReader(const char* begin, const char* end) : m_position{ begin }, m_end{ end } {}
+
+	const char* position() const {
+		return m_position;
+	}
+
+	const char* end() const {
+		return m_end;
+	}
+
+	/**
+	 * Skips whitespace and comments, returns true if the end of the buffer is reached.
+	 */
+	bool atEnd() {
+		skipWhitespace();
+		return m_position >= m_end;
+	}
+
+	bool readToken(std::string& token) {
+		skipWhitespace();
+		const char* begin = m_position;
+		while (m_position < m_end && !isWhitespace(*m_position))
+			++m_position;
+		token.assign(begin, m_position);
+		return m_position > begin;
+	}
+
+	bool readUInt(unsigned int& value) {
+		skipWhitespace();
+		const char* begin = m_position;
+		uint64_t result = 0;
+		while (m_position < m_end && isDigit(*m_position) && result <= 0xFFFFFFFFu) {
+			result = result * 10 + unsigned(*m_position - '0');
+			++m_position;
+		}
+		if (m_position == begin || result > 0xFFFFFFFFu || !atTokenEnd())
+			return false;
+		value = unsigned(result);
+		return true;
+	}
+
+	bool readInt(int& value) {
+		skipWhitespace();
+		const bool negative = m_position < m_end && *m_position == '-';
+		if (negative || (m_position < m_end && *m_position == '+'))
+			++m_position;
+		unsigned int magnitude;
+		if (!readUInt(magnitude) || magnitude > 0x80000000u || (!negative && magnitude == 0x80000000u))
+			return false;
+		value = negative ? int(-int64_t(magnitude)) : int(magnitude);
+		return true;
+	}
+
+	bool readFloat(float& value) {
+		double result;
+		if (!readDouble(result))
+			return false;
+		value = float(result);
+		return true;
+	}
+
+	bool readDouble(double& value) {
+		skipWhitespace();
+		const char* begin = m_position;
+		const char* p = m_position;
+
+		const bool negative = p < m_end && *p == '-';
+		if (p < m_end && (*p == '-' || *p == '+'))
+			++p;
+
+		uint64_t mantissa = 0;
+		int nDigits = 0;
+		int exponent = 0;
+		bool hasDigits = false;
+		bool truncated = false;
+		while (p < m_end && isDigit(*p)) {
+			hasDigits = true;
+			if (nDigits < 19) {
+				mantissa = mantissa * 10 + unsigned(*p - '0');
+				if (mantissa > 0)
+					++nDigits;
+			}
+			else {
+				truncated = truncated || *p != '0';
+				++exponent;
+			}
+			++p;
+		}
+		if (p < m_end && *p == '.') {
+			++p;
+			while (p < m_end && isDigit(*p)) {
+				hasDigits = true;
+				if (nDigits < 19) {
+					mantissa = mantissa * 10 + unsigned(*p - '0');
+					if (mantissa > 0)
+						++nDigits;
+					--exponent;
+				}
+				else {
+					truncated = truncated || *p != '0';
+				}
+				++p;
+			}
+		}
+		if (hasDigits && p < m_end && (*p == 'e' || *p == 'E')) {
+			const char* exponentStart = p;
+			++p;
+			const bool negativeExponent = p < m_end && *p == '-';
+			if (p < m_end && (*p == '-' || *p == '+'))
+				++p;
+			if (p < m_end && isDigit(*p)) {
+				int explicitExponent = 0;
+				while (p < m_end && isDigit(*p)) {
+					if (explicitExponent < 100000)
+						explicitExponent = explicitExponent * 10 + (*p - '0');
+					++p;
+				}
+				exponent += negativeExponent ? -explicitExponent : explicitExponent;
+			}
+			else {
+				p = exponentStart;
+			}
+		}
+
+		m_position = p;
+		if (hasDigits && atTokenEnd() && !truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+			// Mantissas below 2^53 are exact in double, so one correctly rounded multiplication/division remains.
+			const double magnitude = exponent < 0 ? double(mantissa) / powerOfTen(-exponent) : double(mantissa) * powerOfTen(exponent);
+			value = negative ? -magnitude : magnitude;
+			return true;
+		}
+
+		// Rare forms: very long mantissas, large exponents, inf, nan.
+		m_position = begin;
+		while (m_position < m_end && !isWhitespace(*m_position))
+			++m_position;
+		const std::string token(begin, m_position);
+		char* parsedEnd = nullptr;
+		value = std::strtod(token.c_str(), &parsedEnd);
+		return !token.empty() && parsedEnd == token.c_str() + token.size();
+	}
+
+	/**
+	 * Skips the rest of the current line (including the line break).
+	 */
+	void skipLine() {
+		const void* lineEnd = std::memchr(m_position, '\n', size_t(m_end - m_position));
+		m_position = lineEnd ? static_cast<const char*>(lineEnd) + 1 : m_end;
+	}
+
+private:
+	const char* m_position;
+	const char* m_end;
+
+	static bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	static bool isWhitespace(char c) {
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v';
+	}
+
+	bool atTokenEnd() const {
+		return m_position >= m_end || isWhitespace(*m_position) || *m_position == '#';
+	}
+
+	void skipWhitespace() {
+		while (m_position < m_end) {
+			if (isWhitespace(*m_position))
+				++m_position;
+			else if (*m_position == '#')
+				skipLine();
+			else
+				break;
+		}
+	}
+
+	static double powerOfTen(int exponent) {
+		static const double powers[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+		return powers[exponent];
+	}
+};
+
+
+/**
+ * Number formatting for text formats, appending to a string buffer (no streams, no locale).
+ */
+class TextWriter {
+public:
+	static void appendUInt(std::string& buffer, unsigned int value) {
+		char digits[10];
+		int n = 0;
+		do {
+			digits[n++] = char('0' + value % 10);
+			value /= 10;
+		} while (value > 0);
+		while (n > 0)
+			buffer.push_back(digits[--n]);
+	}
+
+	static void appendInt(std::string& buffer, int value) {
+		if (value < 0) {
+			buffer.push_back('-');
+			appendUInt(buffer, unsigned(-int64_t(value)));
+		}
+		else {
+			appendUInt(buffer, unsigned(value));
+		}
+	}
+
+	/**
+	 * Appends value with 6 significant digits in the shortest of fixed and scientific notation, like the default
+	 * stream formatting (printf "%g"), so existing files keep their look.
+	 */
+	static void appendFloat(std::string& buffer, float value) {
+		if (!std::isfinite(value)) {
+			buffer += std::isnan(value) ? "nan" : (value < 0.f ? "-inf" : "inf");
+			return;
+		}
+		if (value == 0.f) {
+			buffer += std::signbit(value) ? "-0" : "0";
+			return;
+		}
+
+		double magnitude = std::abs(double(value));
+		if (value < 0.f)
+			buffer.push_back('-');
+
+		// 6 significant digits: digits = round(magnitude / 10^(exponent - 5)), ties to even like printf.
+		int exponent = int(std::floor(std::log10(magnitude)));
+		int64_t digits = roundDigits(magnitude, exponent);
+		if (digits >= 1000000) {
+			++exponent;
+			digits = roundDigits(magnitude, exponent);
+		}
+		else if (digits < 100000) {
+			--exponent;
+			digits = roundDigits(magnitude, exponent);
+		}
+
+		char text[6];
+		for (int i = 5; i >= 0; --i) {
+			text[i] = char('0' + digits % 10);
+			digits /= 10;
+		}
+		// Trailing zeros are dropped.
+		int nDigits = 6;
+		while (nDigits > 1 && text[nDigits - 1] == '0')
+			--nDigits;
+
+		if (exponent < -4 || exponent >= 6) {
+			buffer.push_back(text[0]);
+			if (nDigits > 1) {
+				buffer.push_back('.');
+				buffer.append(text + 1, nDigits - 1);
+			}
+			buffer.push_back('e');
+			buffer.push_back(exponent < 0 ? '-' : '+');
+			const int absExponent = std::abs(exponent);
+			if (absExponent < 10)
+				buffer.push_back('0');
+			appendUInt(buffer, unsigned(absExponent));
+		}
+		else if (exponent < 0) {
+			buffer += "0.";
+			buffer.append(size_t(-exponent - 1), '0');
+			buffer.append(text, nDigits);
+		}
+		else {
+			buffer.append(text, exponent + 1);
+			if (nDigits > exponent + 1) {
+				buffer.push_back('.');
+				buffer.append(text + exponent + 1, nDigits - exponent - 1);
+			}
+		}
+	}
+
+private:
+	static int64_t roundDigits(double magnitude, int exponent) {
+		// Floats have decimal exponents in [-45, 38], so |shift| stays below 64.
+		static const PowerTable powers;
+		const int shift = 5 - exponent;
+		const double scaled = shift >= 0 ? magnitude * powers.values[shift] : magnitude / powers.values[-shift];
+		return int64_t(std::nearbyint(scaled));
+	}
+
+	struct PowerTable {
+		double values[64];
+
+		PowerTable() {
+			for (int i = 0; i < 64; ++i)
+				values[i] = std::pow(10.0, i);
+		}
+	};
+};
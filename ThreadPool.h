@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "Parallel.h"
+
+/**
+ * Fixed-size pool of worker threads executing tasks in FIFO order.
+ * Tasks are submitted as callables, their results are returned as futures.
+ */
+class ThreadPool {
+public:
+	/**
+	 * Starts the given number of worker threads (0 selects the number of hardware threads).
+	 */
+	explicit ThreadPool(unsigned nThreads = 0) : m_bStop{ false } {
+		if (nThreads == 0)
+			nThreads = Parallel::getHardwareThreads();
+
+		m_workers.reserve(nThreads);
+		for (unsigned i = 0; i < nThreads; ++i) {
+			m_workers.emplace_back([this]() { workerLoop(); });
+		}
+	}
+
+	/**
+	 * Finishes all queued tasks and joins the workers.
+	 */
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bStop = true;
+		}
+		m_condition.notify_all();
+		for (auto& worker : m_workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	template <typename F>
+	std::future<typename std::result_of<F()>::type> submit(F&& task) {
+		using Result = typename std::result_of<F()>::type;
+
+		auto packagedTask = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+		std::future<Result> result = packagedTask->get_future();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push([packagedTask]() { (*packagedTask)(); });
+		}
+		m_condition.notify_one();
+
+		return result;
+	}
+
+	unsigned getNbOfThreads() const {
+		return (unsigned)m_workers.size();
+	}
+
+private:
+	std::vector<std::thread> m_workers;
+	std::queue<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_bStop;
+
+	void workerLoop() {
+		// The pool already runs one task per core, loops inside the tasks stay on their thread.
+		Parallel::setLocalNumThreads(1);
+
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_condition.wait(lock, [this]() { return m_bStop || !m_tasks.empty(); });
+				if (m_bStop && m_tasks.empty())
+					return;
+
+				task = std::move(m_tasks.front());
+				m_tasks.pop();
+			}
+			task();
+		}
+	}
+};
@@ -4,24 +4,65 @@
 #include <iostream>
 #include <cstring>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 #include "Eigen.h"
 #include "FreeImageHelper.h"
+#include "ImageDecimation.h"
+#include "ThreadPool.h"
+#include "FrameStore.h"
 
 typedef unsigned char BYTE;
 
-// reads sensor files according to https://vision.in.tum.de/data/datasets/rgbd-dataset/file_formats
+/**
+ * Renders synthetic frames for VirtualSensor::initSynthetic() (see MeshRenderer). render() is called from the
+ * prefetching threads, so it has to be thread-safe.
+ */
+class FrameRenderer {
+public:
+	virtual ~FrameRenderer() { }
+
+	/**
+	 * Renders frame frameIdx seen with the given trajectory transformation (world to camera) and camera into depth
+	 * (metric, MINF for invalid) and RGBX color, each of them may be null if it isn't needed.
+	 */
+	virtual bool render(unsigned int frameIdx, const Eigen::Matrix4f& trajectory, const Eigen::Matrix3f& intrinsics,
+		unsigned int width, unsigned int height, float* depth, BYTE* color) const = 0;
+};
+
+// reads sensor files according to https://vision.in.tum.de/data/datasets/rgbd-dataset/file_formats,
+// a frame store (see FrameStore) converted from them, or renders synthetic frames (see FrameRenderer)
 class VirtualSensor {
 public:
+	// channels of a frame, see setChannels()
+	enum Channel {
+		CHANNEL_DEPTH = 1,
+		CHANNEL_COLOR = 2
+	};
 
-	VirtualSensor() : m_currentIdx(-1), m_increment(1) { }
+	VirtualSensor() : m_currentIdx(-1), m_increment(1), m_channels(CHANNEL_DEPTH), m_loadedChannels(0), m_failedChannels(0), m_depthFrame(nullptr), m_colorFrame(nullptr), m_maxTimeStampDifference(0.0), m_bInterpolatePoses(true), m_decimation(1), m_decimationMode(ImageDecimation::DEPTH_MEDIAN), m_frameDecimation(1), m_nPrefetchFrames(0), m_nPrefetchThreads(1), m_nextPrefetchIdx(0), m_currentSlot(-1) { }
 
 	~VirtualSensor() {
-		SAFE_DELETE_ARRAY(m_depthFrame);
-		SAFE_DELETE_ARRAY(m_colorFrame);
+		// Running decodes write into the slots, so the workers are joined first.
+		m_prefetchPool.reset();
 	}
 
+	/**
+	 * Opens a dataset directory or, for a path ending in ".frames", a frame store written by convert_dataset.
+	 */
 	bool init(const std::string& datasetDir) {
+		releaseFrames();
+
+		const std::string frameStoreExtension = ".frames";
+		if (datasetDir.size() > frameStoreExtension.size() && datasetDir.compare(datasetDir.size() - frameStoreExtension.size(), frameStoreExtension.size(), frameStoreExtension) == 0)
+			return initFrameStore(datasetDir);
+
+		m_frameStore.reset();
+		m_renderer.reset();
 		m_baseDir = datasetDir;
 
 		// Read filename lists
@@ -31,70 +72,210 @@ public:
 		// Read tracking
 		if (!readTrajectoryFile(datasetDir + "groundtruth.txt", m_trajectory, m_trajectoryTimeStamps)) return false;
 
-		if (m_filenameDepthImages.size() != m_filenameColorImages.size()) return false;
+		if (m_maxTimeStampDifference > 0.0) associateTimeStamps();
+		else if (m_filenameDepthImages.size() != m_filenameColorImages.size()) return false;
+		buildPoseIndex();
 
-		// Image resolutions
-		m_colorImageWidth = 640;
-		m_colorImageHeight = 480;
-		m_depthImageWidth = 640;
-		m_depthImageHeight = 480;
+		// Image resolutions and intrinsics of the cameras, decimated afterwards
+		if (!initCamera(m_depthCamera, m_filenameDepthImages, m_depthImageWidth, m_depthImageHeight, m_depthIntrinsics)) return false;
+		if (!initCamera(m_colorCamera, m_filenameColorImages, m_colorImageWidth, m_colorImageHeight, m_colorIntrinsics)) return false;
 
-		// Intrinsics
-		m_colorIntrinsics << 525.0f, 0.0f, 319.5f,
-			0.0f, 525.0f, 239.5f,
-			0.0f, 0.0f, 1.0f;
+		m_colorExtrinsics.setIdentity();
+		m_depthExtrinsics.setIdentity();
 
-		m_depthIntrinsics = m_colorIntrinsics;
+		applyDecimation();
+		initFrameBuffers();
+		return true;
+	}
 
+	/**
+	 * Opens a frame store. Its frames are served from the mapping without decoding (float depth and color
+	 * without copying), prefetching is not used.
+	 */
+	bool initFrameStore(const std::string& filename) {
+		releaseFrames();
+		m_frameStore = FrameStore::open(filename);
+		if (!m_frameStore) return false;
+		m_renderer.reset();
+
+		m_baseDir.clear();
+		m_filenameDepthImages.clear();
+		m_filenameColorImages.clear();
+		m_trajectory.clear();
+		m_trajectoryTimeStamps.clear();
+		m_framePoses.resize(m_frameStore->getNbOfFrames());
+		m_depthImagesTimeStamps.resize(m_frameStore->getNbOfFrames());
+		m_colorImagesTimeStamps.resize(m_frameStore->getNbOfFrames());
+		for (unsigned int i = 0; i < m_frameStore->getNbOfFrames(); ++i) {
+			m_depthImagesTimeStamps[i] = m_frameStore->getDepthTimeStamp(i);
+			m_colorImagesTimeStamps[i] = m_frameStore->getColorTimeStamp(i);
+			m_framePoses[i] = m_frameStore->getTrajectory(i);
+		}
+
+		m_depthImageWidth = m_frameStore->getDepthImageWidth();
+		m_depthImageHeight = m_frameStore->getDepthImageHeight();
+		m_depthIntrinsics = m_frameStore->getDepthIntrinsics();
+		m_depthExtrinsics = m_frameStore->getDepthExtrinsics();
+		// Without stored color, the frames are white in the resolution of the depth frames.
+		m_colorImageWidth = m_frameStore->hasColor() ? m_frameStore->getColorImageWidth() : m_depthImageWidth;
+		m_colorImageHeight = m_frameStore->hasColor() ? m_frameStore->getColorImageHeight() : m_depthImageHeight;
+		m_colorIntrinsics = m_frameStore->hasColor() ? m_frameStore->getColorIntrinsics() : m_depthIntrinsics;
+		m_colorExtrinsics = m_frameStore->hasColor() ? m_frameStore->getColorExtrinsics() : m_depthExtrinsics;
+
+		applyDecimation();
+		initFrameBuffers();
+		return true;
+	}
+
+	/**
+	 * Renders the frames with renderer instead of reading them, seen from every transformation of trajectory
+	 * (world to camera like getTrajectory(), the exact ground truth) at frameRate frames per second. The camera is
+	 * the depth camera of setDepthCamera() (640x480 with the TUM intrinsics by default), decimated like dataset
+	 * frames, color is rendered with it as well.
+	 */
+	bool initSynthetic(std::shared_ptr<const FrameRenderer> renderer, const std::vector<Eigen::Matrix4f>& trajectory, double frameRate = 30.0) {
+		releaseFrames();
+		if (!renderer || frameRate <= 0.0) return false;
+		m_frameStore.reset();
+		m_renderer = renderer;
+
+		m_baseDir.clear();
+		m_filenameDepthImages.clear();
+		m_filenameColorImages.clear();
+		m_trajectory.clear();
+		m_trajectoryTimeStamps.clear();
+		m_framePoses = trajectory;
+		m_depthImagesTimeStamps.resize(trajectory.size());
+		for (unsigned int i = 0; i < trajectory.size(); ++i)
+			m_depthImagesTimeStamps[i] = i / frameRate;
+		m_colorImagesTimeStamps = m_depthImagesTimeStamps;
+
+		initCamera(m_depthCamera, m_filenameDepthImages, m_depthImageWidth, m_depthImageHeight, m_depthIntrinsics);
+		m_colorImageWidth = m_depthImageWidth;
+		m_colorImageHeight = m_depthImageHeight;
+		m_colorIntrinsics = m_depthIntrinsics;
 		m_colorExtrinsics.setIdentity();
 		m_depthExtrinsics.setIdentity();
 
-		m_depthFrame = new float[m_depthImageWidth * m_depthImageHeight];
-		for (unsigned int i = 0; i < m_depthImageWidth * m_depthImageHeight; ++i) m_depthFrame[i] = 0.5f;
+		applyDecimation();
+		initFrameBuffers();
+		return true;
+	}
+
+	/**
+	 * Decodes the next nFrames frames on nThreads background threads while the current frame is processed
+	 * (0 frames disables prefetching). The frames are decoded into a ring of nFrames + 1 preallocated buffers,
+	 * processNextFrame() hands out the buffer of the next frame without copying it. The buffer returned by
+	 * getDepth() and getColorRGBX() stays valid until the next call of processNextFrame().
+	 */
+	void setPrefetching(unsigned int nFrames, unsigned int nThreads = 1) {
+		m_nPrefetchFrames = nFrames;
+		m_nPrefetchThreads = nThreads;
+		m_prefetchPool.reset();
+		// The current frame may live in a slot, it's moved to the own buffers before the slots are released.
+		if (m_currentSlot != -1) {
+			m_depthBuffer.assign(m_depthFrame, m_depthFrame + m_depthImageWidth * m_depthImageHeight);
+			m_colorBuffer.assign(m_colorFrame, m_colorFrame + 4 * m_colorImageWidth * m_colorImageHeight);
+			m_depthFrame = m_depthBuffer.data();
+			m_colorFrame = m_colorBuffer.data();
+		}
+		m_prefetchSlots.clear();
+		m_currentSlot = -1;
+		// Before init() only the settings are kept, frame stores don't need prefetching.
+		if (nFrames == 0 || m_depthBuffer.empty() || m_frameStore)
+			return;
+
+		for (unsigned int i = 0; i < nFrames + 1; ++i) {
+			m_prefetchSlots.emplace_back(new FrameSlot());
+			m_prefetchSlots.back()->depth.resize(m_depthImageWidth * m_depthImageHeight);
+			m_prefetchSlots.back()->color.resize(4 * m_colorImageWidth * m_colorImageHeight);
+		}
+		m_prefetchPool.reset(new ThreadPool(std::max(nThreads, 1u)));
+		m_nextPrefetchIdx = m_currentIdx == -1 ? 0 : m_currentIdx + m_increment;
+		schedulePrefetching();
+	}
+
+	/**
+	 * Declares the channels (CHANNEL_DEPTH | CHANNEL_COLOR) that are decoded with every frame (and prefetched).
+	 * The other channels are decoded on the first getDepth() / getColorRGBX() call for a frame, so depth-only
+	 * tracking doesn't pay for the color images. The default is CHANNEL_DEPTH.
+	 */
+	void setChannels(unsigned int channels) {
+		m_channels = channels;
+	}
 
-		m_colorFrame = new BYTE[4 * m_colorImageWidth * m_colorImageHeight];
-		for (unsigned int i = 0; i < 4 * m_colorImageWidth * m_colorImageHeight; ++i) m_colorFrame[i] = 255;
+	/**
+	 * Pairs depth and color images by timestamp in init(), like associate.py of the TUM tools: pairs closer than
+	 * maxDifference seconds are matched greedily by increasing difference, unmatched images are dropped. With
+	 * 0 (the default), the images are paired by their line in depth.txt and rgb.txt.
+	 */
+	void setTimeStampAssociation(double maxDifference) {
+		m_maxTimeStampDifference = maxDifference;
+	}
 
+	/**
+	 * Sets the full resolution and intrinsics of the depth camera of a dataset. By default the resolution is read
+	 * from the first depth image and the intrinsics of the TUM sequences (525, 525, 319.5, 239.5 at 640x480) are
+	 * scaled to it. Takes effect in init(), frame stores have their own cameras.
+	 */
+	void setDepthCamera(unsigned int width, unsigned int height, const Eigen::Matrix3f& intrinsics) {
+		m_depthCamera.width = width;
+		m_depthCamera.height = height;
+		m_depthCamera.intrinsics = intrinsics;
+	}
 
-		m_currentIdx = -1;
-		return true;
+	/**
+	 * Sets the full resolution and intrinsics of the color camera, see setDepthCamera().
+	 */
+	void setColorCamera(unsigned int width, unsigned int height, const Eigen::Matrix3f& intrinsics) {
+		m_colorCamera.width = width;
+		m_colorCamera.height = height;
+		m_colorCamera.intrinsics = intrinsics;
+	}
+
+	/**
+	 * Decimates the frames by factor (1 to ImageDecimation::MAX_FACTOR) while they are decoded: depth by the
+	 * minimum or median of every factor x factor block, color by the mean. The image sizes and intrinsics of the
+	 * sensor are those of the decimated frames. Takes effect in init(), default is 1.
+	 */
+	void setDecimation(unsigned int factor, ImageDecimation::DepthMode depthMode = ImageDecimation::DEPTH_MEDIAN) {
+		m_decimation = factor < 1 ? 1 : factor > ImageDecimation::MAX_FACTOR ? ImageDecimation::MAX_FACTOR : factor;
+		m_decimationMode = depthMode;
+	}
+
+	/**
+	 * Interpolates the ground-truth pose at the depth timestamp (SLERP for the rotation, linear for the
+	 * translation) instead of taking the nearest ground-truth pose. Takes effect in init(), default is on.
+	 */
+	void setPoseInterpolation(bool bInterpolatePoses) {
+		m_bInterpolatePoses = bInterpolatePoses;
 	}
 
 	bool processNextFrame() {
 		if (m_currentIdx == -1) m_currentIdx = 0;
 		else m_currentIdx += m_increment;
 
-		if ((unsigned int)m_currentIdx >= (unsigned int)m_filenameColorImages.size()) return false;
-
-		std::cout << "ProcessNextFrame [" << m_currentIdx << " | " << m_filenameColorImages.size() << "]" << std::endl;
+		if ((unsigned int)m_currentIdx >= getNbOfFrames()) return false;
 
-		FreeImageB rgbImage;
-		rgbImage.LoadImageFromFile(m_baseDir + m_filenameColorImages[m_currentIdx]);
-		memcpy(m_colorFrame, rgbImage.data, 4 * 640 * 480);
+		std::cout << "ProcessNextFrame [" << m_currentIdx << " | " << getNbOfFrames() << "]" << std::endl;
 
-		// depth images are scaled by 5000 (see https://vision.in.tum.de/data/datasets/rgbd-dataset/file_formats)
-		FreeImageU16F dImage;
-		dImage.LoadImageFromFile(m_baseDir + m_filenameDepthImages[m_currentIdx]);
-
-		for (unsigned int i = 0; i < m_depthImageWidth * m_depthImageHeight; ++i) {
-			if (dImage.data[i] == 0)
-				m_depthFrame[i] = MINF;
-			else
-				m_depthFrame[i] = dImage.data[i] * 1.0f / 5000.0f;
-		}
-
-		// find transformation (simple nearest neighbor, linear search)
-		double timestamp = m_depthImagesTimeStamps[m_currentIdx];
-		double min = std::numeric_limits<double>::max();
-		int idx = 0;
-		for (unsigned int i = 0; i < m_trajectory.size(); ++i) {
-			double d = abs(m_trajectoryTimeStamps[i] - timestamp);
-			if (min > d) {
-				min = d;
-				idx = i;
-			}
+		if (m_frameStore) {
+			processStoredFrame();
+			return true;
+		}
+		else if (m_prefetchSlots.empty()) {
+			m_depthFrame = m_depthBuffer.data();
+			m_colorFrame = m_colorBuffer.data();
+			m_loadedChannels = 0;
+			m_failedChannels = 0;
+			if (!loadChannels(m_channels)) return false;
 		}
-		m_currentTrajectory = m_trajectory[idx];
+		else if (!processPrefetchedFrame()) {
+			return false;
+		}
+
+		// ground-truth pose of the frame, precomputed in init()
+		m_currentTrajectory = m_framePoses.empty() ? Eigen::Matrix4f::Identity() : m_framePoses[m_currentIdx];
 
 		return true;
 	}
@@ -103,14 +284,27 @@ public:
 		return (unsigned int)m_currentIdx;
 	}
 
-	// get current color data
+	unsigned int getNbOfFrames() {
+		return (unsigned int)m_depthImagesTimeStamps.size();
+	}
+
+	// timestamps of the current depth and color image
+	double getDepthTimeStamp() {
+		return m_depthImagesTimeStamps[m_currentIdx];
+	}
+
+	double getColorTimeStamp() {
+		return m_colorImagesTimeStamps[m_currentIdx];
+	}
+
+	// get current color data (decoded on the first call if CHANNEL_COLOR isn't declared, nullptr if that fails)
 	BYTE* getColorRGBX() {
-		return m_colorFrame;
+		return loadChannels(CHANNEL_COLOR) ? m_colorFrame : nullptr;
 	}
 
-	// get current depth data
+	// get current depth data (decoded on the first call if CHANNEL_DEPTH isn't declared, nullptr if that fails)
 	float* getDepth() {
-		return m_depthFrame;
+		return loadChannels(CHANNEL_DEPTH) ? m_depthFrame : nullptr;
 	}
 
 	// color camera info
@@ -153,6 +347,375 @@ public:
 	}
 
 private:
+	/**
+	 * Drops the frames of a previous sequence (queued decodes read the file lists).
+	 */
+	void releaseFrames() {
+		m_prefetchPool.reset();
+		m_prefetchSlots.clear();
+		m_currentSlot = -1;
+		m_depthFrame = nullptr;
+		m_colorFrame = nullptr;
+	}
+
+	/**
+	 * Full-resolution camera of a dataset, a width of 0 if it isn't configured.
+	 */
+	struct CameraConfig {
+		unsigned int width = 0;
+		unsigned int height = 0;
+		Eigen::Matrix3f intrinsics = Eigen::Matrix3f::Identity();
+	};
+
+	/**
+	 * Resolution and intrinsics of a camera: the configured ones or the size of the first image (640x480 without
+	 * images) with the TUM intrinsics scaled to it.
+	 */
+	bool initCamera(const CameraConfig& config, const std::vector<std::string>& filenames, unsigned int& width, unsigned int& height, Eigen::Matrix3f& intrinsics) const {
+		if (config.width > 0 && config.height > 0) {
+			width = config.width;
+			height = config.height;
+			intrinsics = config.intrinsics;
+			return true;
+		}
+
+		width = 640;
+		height = 480;
+		if (!filenames.empty() && !FreeImageGetImageSize(m_baseDir + filenames.front(), width, height)) {
+			std::cout << "Failed to read image " << filenames.front() << std::endl;
+			return false;
+		}
+		intrinsics << 525.0f, 0.0f, 319.5f,
+			0.0f, 525.0f, 239.5f,
+			0.0f, 0.0f, 1.0f;
+		intrinsics = scaleIntrinsics(intrinsics, width / 640.0f, height / 480.0f);
+		return true;
+	}
+
+	/**
+	 * Reduces the image sizes and intrinsics of the opened sequence to the decimated frames.
+	 */
+	void applyDecimation() {
+		m_frameDecimation = m_decimation;
+		if (m_frameDecimation == 1)
+			return;
+
+		const float scale = 1.0f / m_frameDecimation;
+		m_depthImageWidth /= m_frameDecimation;
+		m_depthImageHeight /= m_frameDecimation;
+		m_depthIntrinsics = scaleIntrinsics(m_depthIntrinsics, scale, scale);
+		m_colorImageWidth /= m_frameDecimation;
+		m_colorImageHeight /= m_frameDecimation;
+		m_colorIntrinsics = scaleIntrinsics(m_colorIntrinsics, scale, scale);
+	}
+
+	/**
+	 * Intrinsics of the image scaled by scaleX, scaleY (pixel centers at integer coordinates, so the principal
+	 * point keeps its position relative to the pixel corners).
+	 */
+	static Eigen::Matrix3f scaleIntrinsics(const Eigen::Matrix3f& intrinsics, float scaleX, float scaleY) {
+		Eigen::Matrix3f scaled = intrinsics;
+		scaled(0, 0) *= scaleX;
+		scaled(0, 1) *= scaleX;
+		scaled(1, 1) *= scaleY;
+		scaled(0, 2) = (intrinsics(0, 2) + 0.5f) * scaleX - 0.5f;
+		scaled(1, 2) = (intrinsics(1, 2) + 0.5f) * scaleY - 0.5f;
+		return scaled;
+	}
+
+	/**
+	 * Allocates the own frame buffers for the current resolution and restarts prefetching.
+	 */
+	void initFrameBuffers() {
+		m_depthBuffer.assign(m_depthImageWidth * m_depthImageHeight, 0.5f);
+		m_depthFrame = m_depthBuffer.data();
+
+		m_colorBuffer.assign(4 * m_colorImageWidth * m_colorImageHeight, 255);
+		m_colorFrame = m_colorBuffer.data();
+
+		m_currentIdx = -1;
+		m_loadedChannels = CHANNEL_DEPTH | CHANNEL_COLOR;
+		m_failedChannels = 0;
+		m_currentTrajectory.setIdentity();
+		if (m_nPrefetchFrames > 0)
+			setPrefetching(m_nPrefetchFrames, m_nPrefetchThreads);
+	}
+
+	/**
+	 * Prefetch buffer: the given channels of the frame frameIdx (-1 if the slot is free) are decoded into depth
+	 * and color.
+	 */
+	struct FrameSlot {
+		std::vector<float> depth;
+		std::vector<BYTE> color;
+		int frameIdx = -1;
+		unsigned int channels = 0;
+		std::future<bool> decoded;
+	};
+
+	/**
+	 * Loads (or renders) the given channels of a frame into the given buffers (can run on any thread).
+	 */
+	bool decodeFrame(int frameIdx, unsigned int channels, float* depthFrame, BYTE* colorFrame) const {
+		if (m_renderer) {
+			if (!m_renderer->render((unsigned int)frameIdx, m_framePoses[frameIdx], m_depthIntrinsics, m_depthImageWidth, m_depthImageHeight,
+				(channels & CHANNEL_DEPTH) ? depthFrame : nullptr, (channels & CHANNEL_COLOR) ? colorFrame : nullptr)) {
+				std::cout << "Failed to render frame " << frameIdx << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+		if (channels & CHANNEL_COLOR) {
+			if (!FreeImageB::LoadRGBXFromFile(m_baseDir + m_filenameColorImages[frameIdx], colorFrame, m_colorImageWidth, m_colorImageHeight, m_frameDecimation)) {
+				std::cout << "Failed to read color image " << m_filenameColorImages[frameIdx] << std::endl;
+				return false;
+			}
+		}
+
+		// depth images are scaled by 5000 (see https://vision.in.tum.de/data/datasets/rgbd-dataset/file_formats)
+		if (channels & CHANNEL_DEPTH) {
+			if (!FreeImageU16F::LoadDepthFromFile(m_baseDir + m_filenameDepthImages[frameIdx], depthFrame, m_depthImageWidth, m_depthImageHeight, 5000.0f, m_frameDecimation, m_decimationMode)) {
+				std::cout << "Failed to read depth image " << m_filenameDepthImages[frameIdx] << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Decodes the given channels of the current frame that aren't loaded yet into the current buffers.
+	 */
+	bool loadChannels(unsigned int channels) {
+		const unsigned int missingChannels = channels & ~m_loadedChannels;
+		if (missingChannels == 0 || m_currentIdx < 0)
+			return (channels & m_failedChannels) == 0;
+		// A failed channel isn't retried for this frame.
+		m_loadedChannels |= missingChannels;
+		if (!decodeFrame(m_currentIdx, missingChannels, m_depthFrame, m_colorFrame)) {
+			m_failedChannels |= missingChannels;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Queues the next frames into all free slots.
+	 */
+	void schedulePrefetching() {
+		for (auto& slot : m_prefetchSlots) {
+			if (slot->frameIdx != -1 || (unsigned int)m_nextPrefetchIdx >= getNbOfFrames())
+				continue;
+
+			FrameSlot* frameSlot = slot.get();
+			frameSlot->frameIdx = m_nextPrefetchIdx;
+			frameSlot->channels = m_channels;
+			frameSlot->decoded = m_prefetchPool->submit([this, frameSlot]() {
+				return decodeFrame(frameSlot->frameIdx, frameSlot->channels, frameSlot->depth.data(), frameSlot->color.data());
+			});
+			m_nextPrefetchIdx += m_increment;
+		}
+	}
+
+	/**
+	 * Hands out the slot of the current frame (waiting for its decode) and refills the slot of the previous one.
+	 */
+	bool processPrefetchedFrame() {
+		if (m_currentSlot != -1)
+			m_prefetchSlots[m_currentSlot]->frameIdx = -1;
+		m_currentSlot = -1;
+		schedulePrefetching();
+
+		// Frames are queued in order, so the current frame is always in one of the slots.
+		for (unsigned int i = 0; i < m_prefetchSlots.size(); ++i) {
+			if (m_prefetchSlots[i]->frameIdx == m_currentIdx)
+				m_currentSlot = int(i);
+		}
+		if (m_currentSlot == -1)
+			return false;
+
+		FrameSlot& slot = *m_prefetchSlots[m_currentSlot];
+		if (!slot.decoded.get())
+			return false;
+		m_depthFrame = slot.depth.data();
+		m_colorFrame = slot.color.data();
+		m_loadedChannels = slot.channels;
+		m_failedChannels = 0;
+		// Channels that were declared after the frame was queued are decoded now.
+		return loadChannels(m_channels);
+	}
+
+	/**
+	 * Points the frame buffers into the frame store (uint16 depth is converted into the own depth buffer).
+	 * Decimated frames are reduced from the mapping into the own buffers.
+	 */
+	void processStoredFrame() {
+		m_loadedChannels = CHANNEL_DEPTH | CHANNEL_COLOR;
+		m_failedChannels = 0;
+		m_currentTrajectory = m_frameStore->getTrajectory(m_currentIdx);
+		if (m_frameDecimation > 1) {
+			decimateStoredFrame();
+			return;
+		}
+
+		if (m_frameStore->getDepthFormat() == FrameStore::DEPTH_FLOAT32) {
+			m_depthFrame = m_frameStore->getDepth(m_currentIdx);
+		}
+		else {
+			m_frameStore->copyDepth(m_currentIdx, m_depthBuffer.data());
+			m_depthFrame = m_depthBuffer.data();
+		}
+		m_colorFrame = m_frameStore->hasColor() ? m_frameStore->getColorRGBX(m_currentIdx) : m_colorBuffer.data();
+	}
+
+	/**
+	 * Decimates the current stored frame into the own buffers.
+	 */
+	void decimateStoredFrame() {
+		const unsigned int depthWidth = m_frameStore->getDepthImageWidth();
+		if (m_frameStore->getDepthFormat() == FrameStore::DEPTH_FLOAT32) {
+			const float* depth = m_frameStore->getDepth(m_currentIdx);
+			ImageDecimation::decimateDepth<float>(m_depthImageWidth, m_depthImageHeight, m_frameDecimation, m_decimationMode,
+				[depth, depthWidth](unsigned int y) { return depth + (size_t)y * depthWidth; },
+				[](float value) { return value; },
+				m_depthBuffer.data());
+		}
+		else {
+			const uint16_t* depth = m_frameStore->getRawDepth(m_currentIdx);
+			const float depthScale = m_frameStore->getDepthScale();
+			ImageDecimation::decimateDepth<uint16_t>(m_depthImageWidth, m_depthImageHeight, m_frameDecimation, m_decimationMode,
+				[depth, depthWidth](unsigned int y) { return depth + (size_t)y * depthWidth; },
+				[depthScale](uint16_t value) { return float(value) / depthScale; },
+				m_depthBuffer.data());
+		}
+		m_depthFrame = m_depthBuffer.data();
+
+		// Without stored color the own buffer stays white.
+		if (m_frameStore->hasColor()) {
+			const BYTE* color = m_frameStore->getColorRGBX(m_currentIdx);
+			const unsigned int colorWidth = m_frameStore->getColorImageWidth();
+			const unsigned int channelOffsets[4] = { 0, 1, 2, 3 };
+			ImageDecimation::decimateColor(m_colorImageWidth, m_colorImageHeight, m_frameDecimation,
+				[color, colorWidth](unsigned int y) { return color + (size_t)4 * y * colorWidth; },
+				4, channelOffsets, m_colorBuffer.data());
+		}
+		m_colorFrame = m_colorBuffer.data();
+	}
+
+	/**
+	 * Replaces the depth and color lists by the associated pairs, in depth timestamp order. Candidate pairs are
+	 * collected with a sorted merge (only color images within the maximum difference of a depth image).
+	 */
+	void associateTimeStamps() {
+		std::vector<unsigned int> depthOrder(m_depthImagesTimeStamps.size());
+		std::vector<unsigned int> colorOrder(m_colorImagesTimeStamps.size());
+		for (unsigned int i = 0; i < depthOrder.size(); ++i) depthOrder[i] = i;
+		for (unsigned int i = 0; i < colorOrder.size(); ++i) colorOrder[i] = i;
+		std::sort(depthOrder.begin(), depthOrder.end(), [&](unsigned int a, unsigned int b) { return m_depthImagesTimeStamps[a] < m_depthImagesTimeStamps[b]; });
+		std::sort(colorOrder.begin(), colorOrder.end(), [&](unsigned int a, unsigned int b) { return m_colorImagesTimeStamps[a] < m_colorImagesTimeStamps[b]; });
+
+		struct Candidate {
+			double difference;
+			unsigned int depthIdx;
+			unsigned int colorIdx;
+		};
+		std::vector<Candidate> candidates;
+		size_t windowStart = 0;
+		for (unsigned int depthIdx : depthOrder) {
+			const double timestamp = m_depthImagesTimeStamps[depthIdx];
+			while (windowStart < colorOrder.size() && m_colorImagesTimeStamps[colorOrder[windowStart]] < timestamp - m_maxTimeStampDifference)
+				++windowStart;
+			for (size_t j = windowStart; j < colorOrder.size() && m_colorImagesTimeStamps[colorOrder[j]] < timestamp + m_maxTimeStampDifference; ++j)
+				candidates.push_back({ std::abs(m_colorImagesTimeStamps[colorOrder[j]] - timestamp), depthIdx, colorOrder[j] });
+		}
+		std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.difference < b.difference; });
+
+		std::vector<int> colorOfDepth(m_depthImagesTimeStamps.size(), -1);
+		std::vector<bool> colorUsed(m_colorImagesTimeStamps.size(), false);
+		for (const Candidate& candidate : candidates) {
+			if (colorOfDepth[candidate.depthIdx] != -1 || colorUsed[candidate.colorIdx])
+				continue;
+			colorOfDepth[candidate.depthIdx] = int(candidate.colorIdx);
+			colorUsed[candidate.colorIdx] = true;
+		}
+
+		std::vector<std::string> depthFilenames, colorFilenames;
+		std::vector<double> depthTimeStamps, colorTimeStamps;
+		for (unsigned int depthIdx : depthOrder) {
+			const int colorIdx = colorOfDepth[depthIdx];
+			if (colorIdx == -1)
+				continue;
+			depthFilenames.push_back(m_filenameDepthImages[depthIdx]);
+			depthTimeStamps.push_back(m_depthImagesTimeStamps[depthIdx]);
+			colorFilenames.push_back(m_filenameColorImages[colorIdx]);
+			colorTimeStamps.push_back(m_colorImagesTimeStamps[colorIdx]);
+		}
+		m_filenameDepthImages.swap(depthFilenames);
+		m_depthImagesTimeStamps.swap(depthTimeStamps);
+		m_filenameColorImages.swap(colorFilenames);
+		m_colorImagesTimeStamps.swap(colorTimeStamps);
+	}
+
+	/**
+	 * Computes the ground-truth pose of every frame at its depth timestamp with one merge of the sorted frame and
+	 * trajectory timestamps. Frames outside the trajectory get the first or last pose.
+	 */
+	void buildPoseIndex() {
+		m_framePoses.assign(m_depthImagesTimeStamps.size(), Eigen::Matrix4f::Identity());
+		if (m_trajectory.empty())
+			return;
+
+		std::vector<unsigned int> poseOrder(m_trajectory.size());
+		for (unsigned int i = 0; i < poseOrder.size(); ++i) poseOrder[i] = i;
+		std::stable_sort(poseOrder.begin(), poseOrder.end(), [&](unsigned int a, unsigned int b) { return m_trajectoryTimeStamps[a] < m_trajectoryTimeStamps[b]; });
+		std::vector<unsigned int> frameOrder(m_depthImagesTimeStamps.size());
+		for (unsigned int i = 0; i < frameOrder.size(); ++i) frameOrder[i] = i;
+		std::stable_sort(frameOrder.begin(), frameOrder.end(), [&](unsigned int a, unsigned int b) { return m_depthImagesTimeStamps[a] < m_depthImagesTimeStamps[b]; });
+
+		// next is the first pose after the frame timestamp
+		size_t next = 0;
+		for (unsigned int frameIdx : frameOrder) {
+			const double timestamp = m_depthImagesTimeStamps[frameIdx];
+			while (next < poseOrder.size() && m_trajectoryTimeStamps[poseOrder[next]] <= timestamp)
+				++next;
+
+			if (next == 0) {
+				m_framePoses[frameIdx] = m_trajectory[poseOrder.front()];
+				continue;
+			}
+			if (next == poseOrder.size()) {
+				m_framePoses[frameIdx] = m_trajectory[poseOrder.back()];
+				continue;
+			}
+
+			const unsigned int before = poseOrder[next - 1];
+			const unsigned int after = poseOrder[next];
+			const double t0 = m_trajectoryTimeStamps[before];
+			const double t1 = m_trajectoryTimeStamps[after];
+			if (!m_bInterpolatePoses || t1 <= t0) {
+				m_framePoses[frameIdx] = timestamp - t0 <= t1 - timestamp ? m_trajectory[before] : m_trajectory[after];
+				continue;
+			}
+			m_framePoses[frameIdx] = interpolatePose(m_trajectory[before], m_trajectory[after], float((timestamp - t0) / (t1 - t0)));
+		}
+	}
+
+	/**
+	 * Interpolates between two trajectory transformations (world to camera, see readTrajectoryFile()). The
+	 * camera poses are interpolated, SLERP for the rotation and linear for the position.
+	 */
+	static Eigen::Matrix4f interpolatePose(const Eigen::Matrix4f& trajectory0, const Eigen::Matrix4f& trajectory1, float alpha) {
+		const Eigen::Matrix4f pose0 = trajectory0.inverse();
+		const Eigen::Matrix4f pose1 = trajectory1.inverse();
+		const Eigen::Quaternionf rotation0(Eigen::Matrix3f(pose0.block<3, 3>(0, 0)));
+		const Eigen::Quaternionf rotation1(Eigen::Matrix3f(pose1.block<3, 3>(0, 0)));
+
+		Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+		pose.block<3, 3>(0, 0) = rotation0.slerp(alpha, rotation1).toRotationMatrix();
+		pose.block<3, 1>(0, 3) = (1.0f - alpha) * pose0.block<3, 1>(0, 3) + alpha * pose1.block<3, 1>(0, 3);
+		return pose.inverse();
+	}
+
 	bool readFileList(const std::string& filename, std::vector<std::string>& result, std::vector<double>& timestamps) {
 		std::ifstream fileDepthList(filename, std::ios::in);
 		if (!fileDepthList.is_open()) return false;
@@ -216,9 +779,16 @@ private:
 
 	int m_increment;
 
-	// frame data
+	// declared channels, channels of the current frame that are decoded and those that failed to decode
+	unsigned int m_channels;
+	unsigned int m_loadedChannels;
+	unsigned int m_failedChannels;
+
+	// frame data (points into the own buffers or into a prefetch slot)
 	float* m_depthFrame;
 	BYTE* m_colorFrame;
+	std::vector<float> m_depthBuffer;
+	std::vector<BYTE> m_colorBuffer;
 	Eigen::Matrix4f m_currentTrajectory;
 
 	// color camera info
@@ -245,4 +815,29 @@ private:
 	// trajectory
 	std::vector<Eigen::Matrix4f> m_trajectory;
 	std::vector<double> m_trajectoryTimeStamps;
+
+	// timestamp association and ground-truth pose of every frame
+	double m_maxTimeStampDifference;
+	bool m_bInterpolatePoses;
+	std::vector<Eigen::Matrix4f> m_framePoses;
+
+	// configured cameras and decimation, decimation of the opened sequence
+	CameraConfig m_depthCamera;
+	CameraConfig m_colorCamera;
+	unsigned int m_decimation;
+	ImageDecimation::DepthMode m_decimationMode;
+	unsigned int m_frameDecimation;
+
+	// frame store and synthetic backends (instead of the image files)
+	std::shared_ptr<FrameStore> m_frameStore;
+	std::shared_ptr<const FrameRenderer> m_renderer;
+
+	// prefetching: ring of decode buffers, next frame to queue and slot of the current frame
+	unsigned int m_nPrefetchFrames;
+	unsigned int m_nPrefetchThreads;
+	std::vector<std::unique_ptr<FrameSlot>> m_prefetchSlots;
+	int m_nextPrefetchIdx;
+	int m_currentSlot;
+	// declared last, so the workers are joined before the slots are destroyed
+	std::unique_ptr<ThreadPool> m_prefetchPool;
 };
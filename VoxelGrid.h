@@ -0,0 +1,243 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+#include "Eigen.h"
+#include "Parallel.h"
+#include "PointSoA.h"
+
+/**
+ * How the points falling into the same voxel are reduced to one point.
+ */
+enum class VoxelReduction {
+	Centroid,	// mean of the points (normals are averaged and renormalized)
+	FirstPoint	// the point with the smallest index, the cloud is only subsampled
+};
+
+
+/**
+ * Voxel-grid downsampling: space is divided into cubic voxels of the leaf size and every occupied voxel yields
+ * one point, so the density of the result is uniform in space (independent of the scan order).
+ * The voxel keys are computed in parallel and sorted with a parallel sort, equal keys are then reduced in parallel.
+ * A key holds 2^21 voxels per axis, the leaf size is enlarged for clouds that are wider than that.
+ */
+class VoxelGridFilter {
+public:
+	static constexpr float DEFAULT_LEAF_SIZE = 0.01f;
+
+	/**
+	 * A leaf size that is not positive and finite is replaced by DEFAULT_LEAF_SIZE.
+	 */
+	explicit VoxelGridFilter(float leafSize = DEFAULT_LEAF_SIZE, VoxelReduction reduction = VoxelReduction::Centroid) :
+		m_leafSize{ DEFAULT_LEAF_SIZE },
+		m_reduction{ reduction }
+	{
+		if (!setLeafSize(leafSize))
+			std::cout << "Voxel grid: using the default leaf size " << DEFAULT_LEAF_SIZE << std::endl;
+	}
+
+	static bool isValidLeafSize(float leafSize) {
+		return leafSize > 0.f && std::isfinite(leafSize);
+	}
+
+	/**
+	 * Returns false and keeps the current leaf size if leafSize is not positive and finite.
+	 */
+	bool setLeafSize(float leafSize) {
+		if (!isValidLeafSize(leafSize)) {
+			std::cout << "Voxel grid: invalid leaf size " << leafSize << std::endl;
+			return false;
+		}
+		m_leafSize = leafSize;
+		return true;
+	}
+
+	float getLeafSize() const {
+		return m_leafSize;
+	}
+
+	void setReduction(VoxelReduction reduction) {
+		m_reduction = reduction;
+	}
+
+	VoxelReduction getReduction() const {
+		return m_reduction;
+	}
+
+	/**
+	 * Filters points (and normals, if not null) into the outputs. Invalid points are dropped. Null or incomplete
+	 * normals count as no normals, filteredNormals is then cleared.
+	 * Every output point also gets the index of the first input point of its voxel (in firstIndices, if not null).
+	 */
+	void filter(const PointSoA& points, const PointSoA* normals, PointSoA& filteredPoints, PointSoA* filteredNormals, std::vector<int>* firstIndices = nullptr) const {
+		if (!normals || normals->size() != points.size()) {
+			if (filteredNormals)
+				filteredNormals->resize(0);
+			normals = nullptr;
+			filteredNormals = nullptr;
+		}
+
+		std::vector<std::pair<uint64_t, int>> keys;
+		std::vector<int> voxelStarts;
+		computeVoxels(points, keys, voxelStarts);
+
+		const int nVoxels = int(voxelStarts.size()) - 1;
+		filteredPoints.resize(nVoxels);
+		if (filteredNormals)
+			filteredNormals->resize(nVoxels);
+		if (firstIndices)
+			firstIndices->resize(nVoxels);
+
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nVoxels; ++i) {
+			const int begin = voxelStarts[i];
+			const int end = voxelStarts[i + 1];
+			const int first = keys[begin].second;
+
+			if (firstIndices)
+				(*firstIndices)[i] = first;
+
+			if (m_reduction == VoxelReduction::FirstPoint) {
+				filteredPoints.set(i, points[first]);
+				if (filteredNormals)
+					filteredNormals->set(i, (*normals)[first]);
+				continue;
+			}
+
+			Vector3f pointSum = Vector3f::Zero();
+			Vector3f normalSum = Vector3f::Zero();
+			for (int j = begin; j < end; ++j) {
+				const int idx = keys[j].second;
+				pointSum += points[idx];
+				if (filteredNormals && normals->isFinite(idx))
+					normalSum += (*normals)[idx];
+			}
+
+			filteredPoints.set(i, pointSum / float(end - begin));
+			if (filteredNormals) {
+				const float length = normalSum.norm();
+				filteredNormals->set(i, length > 0.f ? Vector3f(normalSum / length) : Vector3f(MINF, MINF, MINF));
+			}
+		}
+	}
+
+	void filter(const PointSoA& points, PointSoA& filteredPoints) const {
+		filter(points, nullptr, filteredPoints, nullptr);
+	}
+
+	/**
+	 * Index of a representative point of every occupied voxel (ascending voxel key), i.e. a subsampling that
+	 * doesn't copy any points. The representative is the first point, or the point closest to the centroid.
+	 */
+	void selectIndices(const PointSoA& points, std::vector<int>& indices) const {
+		std::vector<std::pair<uint64_t, int>> keys;
+		std::vector<int> voxelStarts;
+		computeVoxels(points, keys, voxelStarts);
+
+		const int nVoxels = int(voxelStarts.size()) - 1;
+		indices.resize(nVoxels);
+
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nVoxels; ++i) {
+			const int begin = voxelStarts[i];
+			const int end = voxelStarts[i + 1];
+			indices[i] = keys[begin].second;
+			if (m_reduction == VoxelReduction::FirstPoint || end - begin == 1)
+				continue;
+
+			Vector3f centroid = Vector3f::Zero();
+			for (int j = begin; j < end; ++j)
+				centroid += points[keys[j].second];
+			centroid /= float(end - begin);
+
+			float minSquaredDistance = std::numeric_limits<float>::max();
+			for (int j = begin; j < end; ++j) {
+				const float squaredDistance = (points[keys[j].second] - centroid).squaredNorm();
+				if (squaredDistance < minSquaredDistance) {
+					minSquaredDistance = squaredDistance;
+					indices[i] = keys[j].second;
+				}
+			}
+		}
+	}
+
+private:
+	float m_leafSize;
+	VoxelReduction m_reduction;
+
+	/**
+	 * Computes the sorted (voxel key, point index) pairs of all finite points and the start of every voxel in
+	 * that list (voxelStarts has one extra entry at the end).
+	 */
+	void computeVoxels(const PointSoA& points, std::vector<std::pair<uint64_t, int>>& keys, std::vector<int>& voxelStarts) const {
+		// 21 bits per axis, packed into one 63-bit key.
+		const int keyBits = 21;
+		const uint64_t invalidKey = ~uint64_t(0);
+		const int nPoints = int(points.size());
+
+		// Bounding box of the finite points, keys are relative to its minimum.
+		float minX = std::numeric_limits<float>::max();
+		float minY = std::numeric_limits<float>::max();
+		float minZ = std::numeric_limits<float>::max();
+		float maxX = std::numeric_limits<float>::lowest();
+		float maxY = std::numeric_limits<float>::lowest();
+		float maxZ = std::numeric_limits<float>::lowest();
+		#pragma omp parallel for reduction(min:minX,minY,minZ) reduction(max:maxX,maxY,maxZ) num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nPoints; ++i) {
+			if (points.isFinite(i)) {
+				minX = std::min(minX, points.x()[i]);
+				minY = std::min(minY, points.y()[i]);
+				minZ = std::min(minZ, points.z()[i]);
+				maxX = std::max(maxX, points.x()[i]);
+				maxY = std::max(maxY, points.y()[i]);
+				maxZ = std::max(maxZ, points.z()[i]);
+			}
+		}
+
+		// The cells are computed in double, so the offsets from the minimum can't overflow.
+		const double maxCell = double((1 << keyBits) - 1);
+		double leafSize = m_leafSize;
+		const double extent = std::max({ double(maxX) - minX, double(maxY) - minY, double(maxZ) - minZ, 0.0 });
+		if (extent / leafSize >= maxCell + 1.0) {
+			// Clamping the cells would merge the far points into the last voxel.
+			leafSize = extent / maxCell;
+			std::cout << "Voxel grid: the cloud extent " << extent << " needs more than 2^" << keyBits
+				<< " voxels per axis, using the leaf size " << leafSize << std::endl;
+		}
+		const double invLeafSize = 1.0 / leafSize;
+
+		keys.resize(nPoints);
+		#pragma omp parallel for num_threads(Parallel::getNumThreads())
+		for (int i = 0; i < nPoints; ++i) {
+			if (!points.isFinite(i)) {
+				keys[i] = { invalidKey, i };
+				continue;
+			}
+
+			// The clamp only catches rounding at the upper end of the bounding box.
+			const uint64_t cellX = uint64_t(std::min(std::floor((double(points.x()[i]) - minX) * invLeafSize), maxCell));
+			const uint64_t cellY = uint64_t(std::min(std::floor((double(points.y()[i]) - minY) * invLeafSize), maxCell));
+			const uint64_t cellZ = uint64_t(std::min(std::floor((double(points.z()[i]) - minZ) * invLeafSize), maxCell));
+			keys[i] = { (cellX << (2 * keyBits)) | (cellY << keyBits) | cellZ, i };
+		}
+
+		// Sorting by (key, index) groups the voxels, with the smallest point index first in every voxel.
+		Parallel::sort(keys.begin(), keys.end());
+
+		// Invalid points are sorted to the end.
+		keys.erase(std::lower_bound(keys.begin(), keys.end(), std::make_pair(invalidKey, 0)), keys.end());
+
+		voxelStarts.clear();
+		for (int i = 0; i < int(keys.size()); ++i) {
+			if (i == 0 || keys[i].first != keys[i - 1].first)
+				voxelStarts.push_back(i);
+		}
+		voxelStarts.push_back(int(keys.size()));
+	}
+};
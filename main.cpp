@@ -1,18 +1,123 @@
 #include <iostream>
 #include <fstream>
+#include <chrono>
 
 #include "Eigen.h"
 #include "VirtualSensor.h"
 #include "SimpleMesh.h"
+#include "MeshBuilder.h"
 #include "ICPOptimizer.h"
 #include "ProcrustesAligner.h"
 #include "PointCloud.h"
+#include "Parallel.h"
+#include "BatchRegistration.h"
+#include "DepthFilter.h"
+#include "OutlierRemoval.h"
+#include "MeshExporter.h"
+#include "MeshRenderer.h"
 
 #define USE_POINT_TO_PLANE	1
 
 #define RUN_PROCRUSTES		0
 #define RUN_SHAPE_ICP		0
 #define RUN_SEQUENCE_ICP	1
+#define RUN_BATCH_ICP		0
+
+// Estimate the normals of the bunny clouds from their k nearest neighbors instead of the mesh triangles.
+#define ESTIMATE_NORMALS	0
+
+// Number of threads used by the parallel loops, FLANN and Ceres (0 = all hardware threads).
+#define NUM_THREADS			0
+
+// Voxel-grid leaf sizes (in meters) of the source and target clouds in the sequence ICP (0 = no filter).
+#define SOURCE_LEAF_SIZE	0.0f
+#define TARGET_LEAF_SIZE	0.0f
+
+// Number of source points picked by normal-space sampling in the sequence ICP (0 = stride or voxel-grid sampling).
+#define NORMAL_SPACE_SAMPLES	0
+
+// Window radius of the integral-image normals of the depth frames (0 = central differences).
+#define NORMAL_WINDOW_RADIUS	0
+
+// Format of the result meshes: ".off" (ASCII) or ".ply" (binary, smaller and faster to write).
+#define MESH_EXTENSION		".off"
+
+// Input sequence: the dataset directory, or a frame store converted from it with convert_dataset
+// (e.g. "/data/rgbd_dataset_freiburg1_xyz.frames"), which is read without decoding images.
+#define DATASET_PATH		"/data/rgbd_dataset_freiburg1_xyz/"
+
+// Frames decoded ahead by a background thread of the virtual sensor (0 = decode on demand).
+#define PREFETCH_FRAMES		2
+
+// Decimation of the sensor frames while they are decoded (block median depth, 1 = full resolution).
+#define SENSOR_DECIMATION	1
+
+// Mesh rendered by a synthetic sensor on an orbit around it instead of reading DATASET_PATH (e.g. "/data/bunny/bunny.off"),
+// with exact ground truth for benchmarks ("" reads the dataset). Depth noise as in MeshRenderer::setNoise().
+#define SYNTHETIC_MESH		""
+#define SYNTHETIC_FRAMES	300
+#define SYNTHETIC_DEPTH_NOISE	0.0012f
+
+// Threads writing the result meshes of the room reconstruction, and frames that may wait for them before tracking blocks.
+#define MESH_EXPORT_THREADS	1
+#define MESH_EXPORT_QUEUE	4
+
+// Bilateral filtering of the depth frames before back-projection (spatial sigma in pixels, range sigma in meters).
+#define FILTER_DEPTH		0
+#define DEPTH_SPATIAL_SIGMA	1.5f
+#define DEPTH_RANGE_SIGMA	0.03f
+
+// Statistical outlier removal of the input clouds (mean distance to the k nearest neighbors above mean + multiplier * stddev).
+#define REMOVE_OUTLIERS		0
+#define OUTLIER_NEIGHBORS	8
+#define OUTLIER_STDDEV_MULTIPLIER	1.0f
+
+/**
+ * Optional filters of the depth frames before back-projection (FILTER_DEPTH, then REMOVE_OUTLIERS).
+ */
+struct DepthPreprocessing {
+	BilateralDepthFilter depthFilter{ DEPTH_SPATIAL_SIGMA, DEPTH_RANGE_SIGMA };
+	StatisticalOutlierFilter outlierFilter{ OUTLIER_NEIGHBORS, OUTLIER_STDDEV_MULTIPLIER };
+	std::vector<float> filteredDepth;
+
+	/**
+	 * Depth map of the current frame that is back-projected: the sensor depth, or its filtered copy.
+	 */
+	const float* process(VirtualSensor& sensor) {
+		if (!FILTER_DEPTH && !REMOVE_OUTLIERS)
+			return sensor.getDepth();
+
+		const unsigned width = sensor.getDepthImageWidth();
+		const unsigned height = sensor.getDepthImageHeight();
+		filteredDepth.resize(size_t(width) * height);
+
+		const float* depth = sensor.getDepth();
+		if (FILTER_DEPTH) {
+			depthFilter.apply(depth, filteredDepth.data(), width, height);
+			depth = filteredDepth.data();
+		}
+		if (REMOVE_OUTLIERS)
+			outlierFilter.apply(depth, sensor.getDepthIntrinsics(), width, height, filteredDepth.data());
+		return filteredDepth.data();
+	}
+};
+
+/**
+ * Opens the input sequence: DATASET_PATH, or the frames rendered from SYNTHETIC_MESH.
+ */
+bool initSensor(VirtualSensor& sensor, const std::string& filenameIn) {
+	sensor.setDecimation(SENSOR_DECIMATION);
+	if (std::string(SYNTHETIC_MESH).empty())
+		return sensor.init(filenameIn);
+
+	SimpleMesh mesh;
+	if (!mesh.loadMesh(PROJECT_DIR + std::string(SYNTHETIC_MESH)))
+		return false;
+	std::shared_ptr<MeshRenderer> renderer = std::make_shared<MeshRenderer>(mesh);
+	renderer->setNoise(SYNTHETIC_DEPTH_NOISE, 0.0f);
+	const float radius = renderer->getRadius();
+	return sensor.initSynthetic(renderer, MeshRenderer::orbitTrajectory(renderer->getCenter(), 3.0f * radius, radius, SYNTHETIC_FRAMES));
+}
 
 void debugCorrespondenceMatching() {
 	// Load the source and target mesh.
@@ -42,33 +147,35 @@ void debugCorrespondenceMatching() {
 
 	// Visualize the correspondences with lines.
 	SimpleMesh resultingMesh = SimpleMesh::joinMeshes(sourceMesh, targetMesh, Matrix4f::Identity());
-	auto sourcePoints = source.getPoints();
-	auto targetPoints = target.getPoints();
+	MeshBuilder builder{ resultingMesh };
+	const auto& sourcePoints = source.getPoints();
+	const auto& targetPoints = target.getPoints();
 
 	for (unsigned i = 0; i < 100; ++i) { // sourcePoints.size()
 		const auto match = matches[i];
 		if (match.idx >= 0) {
-			const auto& sourcePoint = sourcePoints[i];
-			const auto& targetPoint = targetPoints[match.idx];
-			resultingMesh = SimpleMesh::joinMeshes(SimpleMesh::cylinder(sourcePoint, targetPoint, 0.002f, 2, 15), resultingMesh, Matrix4f::Identity());
+			const Vector3f sourcePoint = sourcePoints[i];
+			const Vector3f targetPoint = targetPoints[match.idx];
+			builder.addCylinder(sourcePoint, targetPoint, 0.002f, 2, 15);
 		}
 	}
 
-	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/correspondences.off"));
+	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/correspondences") + MESH_EXTENSION);
 }
 
 int debugReconstructRoomCorrespondences() {
-	std::string filenameIn = PROJECT_DIR + std::string("/data/rgbd_dataset_freiburg1_xyz/");
+	std::string filenameIn = PROJECT_DIR + std::string(DATASET_PATH);
 	std::string filenameBaseOut = PROJECT_DIR + std::string("/results/mesh_");
 	bool saveAll = false;
 
 	// Load video
 	std::cout << "Initialize virtual sensor..." << std::endl;
 	VirtualSensor sensor;
-	if (!sensor.init(filenameIn)) {
+	if (!initSensor(sensor, filenameIn)) {
 		std::cout << "Failed to initialize the sensor!\nCheck file path!" << std::endl;
 		return -1;
 	}
+	sensor.setPrefetching(PREFETCH_FRAMES);
 
 	// We store a first frame as a reference frame. All next frames are tracked relatively to the first frame.
 	sensor.processNextFrame();
@@ -81,6 +188,10 @@ int debugReconstructRoomCorrespondences() {
 	// Setup the optimizer.
 	ICPOptimizer optimizer;
 	optimizer.setMatchingMaxDistance(0.1f);
+	optimizer.setSourceLeafSize(SOURCE_LEAF_SIZE);
+	optimizer.setTargetLeafSize(TARGET_LEAF_SIZE);
+	if (NORMAL_SPACE_SAMPLES > 0)
+		optimizer.setSampling(SamplingStrategy::normalSpace(NORMAL_SPACE_SAMPLES));
 	if (USE_POINT_TO_PLANE) {
 		optimizer.usePointToPlaneConstraints(true);
 		optimizer.setNbOfIterations(1); //10
@@ -96,13 +207,12 @@ int debugReconstructRoomCorrespondences() {
 	Matrix4f currentCameraToWorld = Matrix4f::Identity();
 	estimatedPoses.push_back(currentCameraToWorld.inverse());
 
-	SimpleMesh currentDepthMeshTargetCorres{ sensor, estimatedPoses.back(), 0.1f };
-	SimpleMesh currentCameraMeshTargetCorres = SimpleMesh::camera(estimatedPoses.back(), 0.0015f);
-	SimpleMesh resultingMeshTargetCorres = SimpleMesh::joinMeshes(currentDepthMeshTargetCorres, currentCameraMeshTargetCorres, Matrix4f::Identity());
+	SimpleMesh resultingMeshTargetCorres{ sensor, estimatedPoses.back(), 0.1f };
+	MeshBuilder{ resultingMeshTargetCorres }.addCamera(estimatedPoses.back(), 0.0015f);
 	std::string corres_class = std::string("/Debug_Nearest_Correspondences");
 	if(PROJECTIVE)
 		corres_class = std::string("/Debug_Projective_Correspondences");
-	resultingMeshTargetCorres.writeMesh(PROJECT_DIR + std::string("/results") + corres_class + std::string("/target_correspondences") + std::string(".off"));
+	resultingMeshTargetCorres.writeMesh(PROJECT_DIR + std::string("/results") + corres_class + std::string("/target_correspondences") + MESH_EXTENSION);
 
 	int i = 0;
 	const int iMax = 1;
@@ -118,10 +228,9 @@ int debugReconstructRoomCorrespondences() {
 		
 		currentCameraToWorld = optimizer.estimatePose(source, target, currentCameraToWorld, i);
 		
-		SimpleMesh currentDepthMeshSourceCorres{ sensor, estimatedPoses.back(), 0.1f };
-		SimpleMesh currentCameraMeshSourceCorres = SimpleMesh::camera(estimatedPoses.back(), 0.0015f);
-		SimpleMesh resultingMeshSourceCorres = SimpleMesh::joinMeshes(currentDepthMeshSourceCorres, currentCameraMeshSourceCorres, Matrix4f::Identity());
-		resultingMeshSourceCorres.writeMesh(PROJECT_DIR +  std::string("/results") + corres_class + std::string("/source_correspondences") + std::to_string(i) + std::string(".off"));
+		SimpleMesh resultingMeshSourceCorres{ sensor, estimatedPoses.back(), 0.1f };
+		MeshBuilder{ resultingMeshSourceCorres }.addCamera(estimatedPoses.back(), 0.0015f);
+		resultingMeshSourceCorres.writeMesh(PROJECT_DIR +  std::string("/results") + corres_class + std::string("/source_correspondences") + std::to_string(i) + MESH_EXTENSION);
 		// Invert the transformation matrix to get the current camera pose.
 		Matrix4f currentCameraPose = currentCameraToWorld.inverse();
 		std::cout << "Current camera pose: " << std::endl << currentCameraPose << std::endl;
@@ -130,12 +239,11 @@ int debugReconstructRoomCorrespondences() {
 		//if (i % 5 == 0) 
 		{
 			// We write out the mesh to file for debugging.
-			SimpleMesh currentDepthMesh{ sensor, estimatedPoses.back(), 0.1f };
-			SimpleMesh currentCameraMesh = SimpleMesh::camera(estimatedPoses.back(), 0.0015f);
-			SimpleMesh resultingMesh = SimpleMesh::joinMeshes(currentDepthMesh, currentCameraMesh, Matrix4f::Identity());
+			SimpleMesh resultingMesh{ sensor, estimatedPoses.back(), 0.1f };
+			MeshBuilder{ resultingMesh }.addCamera(estimatedPoses.back(), 0.0015f);
 
 			std::stringstream ss;
-			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << ".off";
+			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << MESH_EXTENSION;
 			if (!resultingMesh.writeMesh(ss.str())) {
 				std::cout << "Failed to write mesh!\nCheck file path!" << std::endl;
 				return -1;
@@ -185,13 +293,14 @@ int alignBunnyWithProcrustes() {
 
 	// Visualize the resulting joined mesh. We add triangulated spheres for point matches.
 	SimpleMesh resultingMesh = SimpleMesh::joinMeshes(sourceMesh, targetMesh, estimatedPose);
+	MeshBuilder builder{ resultingMesh };
 	for (const auto& sourcePoint : sourcePoints) {
-		resultingMesh = SimpleMesh::joinMeshes(SimpleMesh::sphere(sourcePoint, 0.002f), resultingMesh, estimatedPose);
+		builder.addSphere((estimatedPose * sourcePoint.homogeneous()).head<3>(), 0.002f);
 	}
 	for (const auto& targetPoint : targetPoints) {
-		resultingMesh = SimpleMesh::joinMeshes(SimpleMesh::sphere(targetPoint, 0.002f), resultingMesh, Matrix4f::Identity());
+		builder.addSphere(targetPoint, 0.002f);
 	}
-	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/bunny_procrustes.off"));
+	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/bunny_procrustes") + MESH_EXTENSION);
 	std::cout << "Resulting mesh written." << std::endl;
 	
 	return 0;
@@ -243,13 +352,21 @@ int alignBunnyWithICP() {
 
 	PointCloud source{ sourceMesh };
 	PointCloud target{ targetMesh };
+	if (REMOVE_OUTLIERS) {
+		source = source.statisticalOutlierFilter(OUTLIER_NEIGHBORS, OUTLIER_STDDEV_MULTIPLIER);
+		target = target.statisticalOutlierFilter(OUTLIER_NEIGHBORS, OUTLIER_STDDEV_MULTIPLIER);
+	}
+	if (ESTIMATE_NORMALS) {
+		source.estimateNormals();
+		target.estimateNormals();
+	}
 
 	Matrix4f estimatedPose = optimizer.estimatePose(source, target);
 	std::cout << "Estimated pose: " << std::endl << estimatedPose << std::endl;
 	
 	// Visualize the resulting joined mesh. 
 	SimpleMesh resultingMesh = SimpleMesh::joinMeshes(sourceMesh, targetMesh, estimatedPose);
-	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/bunny_icp.off"));
+	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/bunny_icp") + MESH_EXTENSION);
 	std::cout << "Resulting mesh written." << std::endl;	
 
 	// Visualize the resulting joined mesh. We add triangulated spheres for point matches.
@@ -258,9 +375,10 @@ int alignBunnyWithICP() {
 	const auto translation = estimatedPose.block(0, 3, 3, 1);
 	float error=0;
 	int i=0;
+	MeshBuilder builder{ resultingMesh };
 	for (const auto& sourcePoint : sourcePoints) {
-		resultingMesh = SimpleMesh::joinMeshes(SimpleMesh::sphere(sourcePoint, 0.002f), resultingMesh, estimatedPose);
 		transformedSourcePoints.push_back(rotation * sourcePoint + translation);
+		builder.addSphere(transformedSourcePoints.back(), 0.002f);
 		float error_point = (transformedSourcePoints[i] - targetPoints[i]).norm();
 		std::cout<<"Error for point "<<(i+1)<<" : "<<error_point<<std::endl;
 		error += error_point;
@@ -268,40 +386,90 @@ int alignBunnyWithICP() {
 	}
 	std::cout<<"Error calculated: "<<error<<std::endl;
 	for (const auto& targetPoint : targetPoints) {
-		resultingMesh = SimpleMesh::joinMeshes(SimpleMesh::sphere(targetPoint, 0.002f, { 0, 255, 0, 255 }), resultingMesh, Matrix4f::Identity());
+		builder.addSphere(targetPoint, 0.002f, { 0, 255, 0, 255 });
 	}
 
 
-	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/bunny_icp_spheres.off"));
+	resultingMesh.writeMesh(PROJECT_DIR + std::string("/results/bunny_icp_spheres") + MESH_EXTENSION);
 	std::cout << "Resulting mesh written." << std::endl;
 
 	return 0;
 }
 
+int alignBunnyBatch() {
+	// Load the source and target mesh.
+	const std::string filenameSource = PROJECT_DIR + std::string("/data/bunny/bunny.off");
+	const std::string filenameTarget = PROJECT_DIR + std::string("/data/bunny/bunny_trans.off");
+
+	SimpleMesh sourceMesh;
+	if (!sourceMesh.loadMesh(filenameSource)) {
+		std::cout << "Mesh file wasn't read successfully at location: " << filenameSource << std::endl;
+		return -1;
+	}
+
+	SimpleMesh targetMesh;
+	if (!targetMesh.loadMesh(filenameTarget)) {
+		std::cout << "Mesh file wasn't read successfully at location: " << filenameTarget << std::endl;
+		return -1;
+	}
+
+	auto source = std::make_shared<const PointCloud>(sourceMesh);
+	auto target = std::make_shared<const PointCloud>(targetMesh);
+
+	// Register the same pair from several initial poses (rotations around the up axis) concurrently.
+	// All jobs share one index of the target.
+	BatchRegistration batch;
+	batch.setMatchingMaxDistance(0.0003f);
+	batch.usePointToPlaneConstraints(USE_POINT_TO_PLANE);
+	batch.setNbOfIterations(USE_POINT_TO_PLANE ? 10 : 20);
+
+	RegistrationJobs jobs;
+	for (int i = -4; i <= 4; ++i) {
+		RegistrationJob job;
+		job.source = source;
+		job.target = target;
+		job.initialPose.block(0, 0, 3, 3) = AngleAxisf(i * 0.05f, Vector3f::UnitY()).toRotationMatrix();
+		jobs.push_back(job);
+	}
+
+	auto results = batch.submit(jobs);
+	for (unsigned i = 0; i < results.size(); ++i) {
+		std::cout << "Estimated pose for job " << i << ": " << std::endl << results[i].get() << std::endl;
+	}
+
+	return 0;
+}
+
 int reconstructRoom() {
-	std::string filenameIn = PROJECT_DIR + std::string("/data/rgbd_dataset_freiburg1_xyz/");
+	std::string filenameIn = PROJECT_DIR + std::string(DATASET_PATH);
 	std::string filenameBaseOut = PROJECT_DIR + std::string("/results/mesh_");
 	bool saveAll = false;
 
 	// Load video
 	std::cout << "Initialize virtual sensor..." << std::endl;
 	VirtualSensor sensor;
-	if (!sensor.init(filenameIn)) {
+	if (!initSensor(sensor, filenameIn)) {
 		std::cout << "Failed to initialize the sensor!\nCheck file path!" << std::endl;
 		return -1;
 	}
+	sensor.setPrefetching(PREFETCH_FRAMES);
 
 	// We store a first frame as a reference frame. All next frames are tracked relatively to the first frame.
 	sensor.processNextFrame();
 	if(PROJECTIVE)
 		saveAll = true;
 		
-	PointCloud target{ sensor.getDepth(), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 1, 0.1f, saveAll };
+	DepthPreprocessing preprocessing;
+	PointCloud target{ preprocessing.process(sensor), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 1, 0.1f, saveAll, NORMAL_WINDOW_RADIUS };
 	//std::cout<<"Depth Extrinsic for target frame : "<<sensor.getDepthExtrinsics();
 	
 	// Setup the optimizer.
 	ICPOptimizer optimizer;
 	optimizer.setMatchingMaxDistance(0.1f);
+	optimizer.setSourceLeafSize(SOURCE_LEAF_SIZE);
+	optimizer.setTargetLeafSize(TARGET_LEAF_SIZE);
+	if (NORMAL_SPACE_SAMPLES > 0)
+		optimizer.setSampling(SamplingStrategy::normalSpace(NORMAL_SPACE_SAMPLES));
 	if (USE_POINT_TO_PLANE) {
 		std::cout<<"POINT TO PLANE"<<std::endl;
 		optimizer.usePointToPlaneConstraints(true);
@@ -313,6 +481,9 @@ int reconstructRoom() {
 		optimizer.setNbOfIterations(20);
 	}
 
+	// Meshes of the tracked frames are written in the background.
+	AsyncMeshExporter exporter{ MESH_EXPORT_THREADS, MESH_EXPORT_QUEUE };
+
 	// We store the estimated camera poses.
 	std::vector<Matrix4f> estimatedPoses;
 	Matrix4f currentCameraToWorld = Matrix4f::Identity();
@@ -329,7 +500,7 @@ int reconstructRoom() {
 
 		// Estimate the current camera pose from source to target mesh with ICP optimization.
 		// We downsample the source image to speed up the correspondence matching.
-		PointCloud source{ sensor.getDepth(), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 8 };
+		PointCloud source{ preprocessing.process(sensor), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 8, 0.1f, false, NORMAL_WINDOW_RADIUS };
 		currentCameraToWorld = optimizer.estimatePose(source, target, currentCameraToWorld);
 		
 		// Invert the transformation matrix to get the current camera pose.
@@ -338,14 +509,10 @@ int reconstructRoom() {
 		estimatedPoses.push_back(currentCameraPose);
 
 		if (i % 5 == 0) {
-			// We write out the mesh to file for debugging.
-			SimpleMesh currentDepthMesh{ sensor, currentCameraPose, 0.1f };
-			SimpleMesh currentCameraMesh = SimpleMesh::camera(currentCameraPose, 0.0015f);
-			SimpleMesh resultingMesh = SimpleMesh::joinMeshes(currentDepthMesh, currentCameraMesh, Matrix4f::Identity());
-
+			// We write out the mesh to file for debugging (on the export thread).
 			std::stringstream ss;
-			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << ".off";
-			if (!resultingMesh.writeMesh(ss.str())) {
+			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << MESH_EXTENSION;
+			if (!exporter.submit(sensor, currentCameraPose, ss.str())) {
 				std::cout << "Failed to write mesh!\nCheck file path!" << std::endl;
 				return -1;
 			}
@@ -354,21 +521,27 @@ int reconstructRoom() {
 		i++;
 	}
 
+	if (!exporter.flush()) {
+		std::cout << "Failed to write mesh!\nCheck file path!" << std::endl;
+		return -1;
+	}
+
 	return 0;
 }
 
 int reconstructRoomGetSources() {
-	std::string filenameIn = PROJECT_DIR + std::string("/data/rgbd_dataset_freiburg1_xyz/");
+	std::string filenameIn = PROJECT_DIR + std::string(DATASET_PATH);
 	std::string filenameBaseOut = PROJECT_DIR + std::string("/results/mesh_");
 	bool saveAll = false;
 
 	// Load video
 	std::cout << "Initialize virtual sensor..." << std::endl;
 	VirtualSensor sensor;
-	if (!sensor.init(filenameIn)) {
+	if (!initSensor(sensor, filenameIn)) {
 		std::cout << "Failed to initialize the sensor!\nCheck file path!" << std::endl;
 		return -1;
 	}
+	sensor.setPrefetching(PREFETCH_FRAMES);
 
 	// We store a first frame as a reference frame. All next frames are tracked relatively to the first frame.
 	sensor.processNextFrame();
@@ -394,12 +567,11 @@ int reconstructRoomGetSources() {
 
 		if (i % 5 == 0) {
 			// We write out the mesh to file for debugging.
-			SimpleMesh currentDepthMesh{ sensor, mIdentity, 0.1f };
-			SimpleMesh currentCameraMesh = SimpleMesh::camera(mIdentity, 0.0015f);
-			SimpleMesh resultingMesh = SimpleMesh::joinMeshes(currentDepthMesh, currentCameraMesh, Matrix4f::Identity());
+			SimpleMesh resultingMesh{ sensor, mIdentity, 0.1f };
+			MeshBuilder{ resultingMesh }.addCamera(mIdentity, 0.0015f);
 
 			std::stringstream ss;
-			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << ".off";
+			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << MESH_EXTENSION;
 			if (!resultingMesh.writeMesh(ss.str())) {
 				std::cout << "Failed to write mesh!\nCheck file path!" << std::endl;
 				return -1;
@@ -413,24 +585,30 @@ int reconstructRoomGetSources() {
 }
 
 int reconstructRoom2() {
-	std::string filenameIn = PROJECT_DIR + std::string("/data/rgbd_dataset_freiburg1_xyz/");
+	std::string filenameIn = PROJECT_DIR + std::string(DATASET_PATH);
 	std::string filenameBaseOut = PROJECT_DIR + std::string("/results/mesh_");
 
 	// Load video
 	std::cout << "Initialize virtual sensor..." << std::endl;
 	VirtualSensor sensor;
-	if (!sensor.init(filenameIn)) {
+	if (!initSensor(sensor, filenameIn)) {
 		std::cout << "Failed to initialize the sensor!\nCheck file path!" << std::endl;
 		return -1;
 	}
+	sensor.setPrefetching(PREFETCH_FRAMES);
 
 	// We store a first frame as a reference frame. All next frames are tracked relatively to the first frame.
 	sensor.processNextFrame();
-	PointCloud target{ sensor.getDepth(), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight() };
+	DepthPreprocessing preprocessing;
+	PointCloud target{ preprocessing.process(sensor), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 1, 0.1f, false, NORMAL_WINDOW_RADIUS };
 	
 	// Setup the optimizer.
 	ICPOptimizer optimizer;
 	optimizer.setMatchingMaxDistance(0.1f);
+	optimizer.setSourceLeafSize(SOURCE_LEAF_SIZE);
+	optimizer.setTargetLeafSize(TARGET_LEAF_SIZE);
+	if (NORMAL_SPACE_SAMPLES > 0)
+		optimizer.setSampling(SamplingStrategy::normalSpace(NORMAL_SPACE_SAMPLES));
 	if (USE_POINT_TO_PLANE) {
 		optimizer.usePointToPlaneConstraints(true);
 		optimizer.setNbOfIterations(10);
@@ -440,6 +618,9 @@ int reconstructRoom2() {
 		optimizer.setNbOfIterations(20);
 	}
 
+	// Meshes of the tracked frames are written in the background.
+	AsyncMeshExporter exporter{ MESH_EXPORT_THREADS, MESH_EXPORT_QUEUE };
+
 	// We store the estimated camera poses.
 	std::vector<Matrix4f> estimatedPoses;
 	std::vector<Matrix4f> transformedEstC2WPoses;
@@ -458,7 +639,7 @@ int reconstructRoom2() {
 
 		// Estimate the current camera pose from source to target mesh with ICP optimization.
 		// We downsample the source image to speed up the correspondence matching.
-		PointCloud source{ sensor.getDepth(), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 8 };
+		PointCloud source{ preprocessing.process(sensor), sensor.getDepthIntrinsics(), sensor.getDepthExtrinsics(), sensor.getDepthImageWidth(), sensor.getDepthImageHeight(), 8, 0.1f, false, NORMAL_WINDOW_RADIUS };
 		currentCameraToWorld = optimizer.estimatePose(source, target, Matrix4f::Identity());
 		
 		//Multiplying the current estimated transform from the previous frame to the current.
@@ -471,44 +652,51 @@ int reconstructRoom2() {
 		estimatedPoses.push_back(currentCameraPose);
 
 		if (i % 5 == 0) {
-			// We write out the mesh to file for debugging.
-			SimpleMesh currentDepthMesh{ sensor, currentCameraPose, 0.1f };
-			SimpleMesh currentCameraMesh = SimpleMesh::camera(currentCameraPose, 0.0015f);
-			SimpleMesh resultingMesh = SimpleMesh::joinMeshes(currentDepthMesh, currentCameraMesh, Matrix4f::Identity());
-
+			// We write out the mesh to file for debugging (on the export thread).
 			std::stringstream ss;
-			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << ".off";
-			if (!resultingMesh.writeMesh(ss.str())) {
+			ss << filenameBaseOut << sensor.getCurrentFrameCnt() << MESH_EXTENSION;
+			if (!exporter.submit(sensor, currentCameraPose, ss.str())) {
 				std::cout << "Failed to write mesh!\nCheck file path!" << std::endl;
 				return -1;
 			}
 		}
 
-		target = source;
+		// The current frame becomes the next target, its buffers are moved instead of copied.
+		target = std::move(source);
 		
 		i++;
 	}
 
+	if (!exporter.flush()) {
+		std::cout << "Failed to write mesh!\nCheck file path!" << std::endl;
+		return -1;
+	}
+
 	return 0;
 }
 
 int main() {
 	int result = -1;
 
-	clock_t begin = clock();
+	Parallel::setNumThreads(NUM_THREADS);
+	std::cout << "Running with " << Parallel::getNumThreads() << " thread(s)." << std::endl;
+
+	auto begin = std::chrono::steady_clock::now();
 	
 	if (RUN_PROCRUSTES)
 		result = alignBunnyWithProcrustes();
 	else if (RUN_SHAPE_ICP)
 		result = alignBunnyWithICP();
+	else if (RUN_BATCH_ICP)
+		result = alignBunnyBatch();
 	else if (RUN_SEQUENCE_ICP)
 		//result = reconstructRoomGetSources();
 		//result = debugReconstructRoomCorrespondences();
 		result = reconstructRoom();
 
-	clock_t end = clock();
+	auto end = std::chrono::steady_clock::now();
 
-	double elapsedSecs = double(end - begin) / CLOCKS_PER_SEC;
+	double elapsedSecs = std::chrono::duration<double>(end - begin).count();
 	std::cout << "Completed in " << elapsedSecs << " seconds." << std::endl;
 
 	return result;
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <iostream>
+#include <cmath>
+
+#include "Eigen.h"
+
+/**
+ * Minimal checks for the test executables: a failed check is reported with its location and counted, main()
+ * returns the number of failures (0 = passed, as ctest expects).
+ */
+namespace Check {
+	inline int& failures() {
+		static int nFailures = 0;
+		return nFailures;
+	}
+
+	inline void report(bool condition, const char* expression, const char* file, int line) {
+		if (condition)
+			return;
+		std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+		++failures();
+	}
+
+	/**
+	 * Equal vectors, invalid (non-finite) components have to be invalid in both.
+	 */
+	inline bool near(const Vector3f& a, const Vector3f& b, float tolerance) {
+		for (int k = 0; k < 3; ++k) {
+			if (std::isfinite(a[k]) != std::isfinite(b[k]))
+				return false;
+			if (std::isfinite(a[k]) && std::abs(a[k] - b[k]) > tolerance)
+				return false;
+		}
+		return true;
+	}
+}
+
+#define CHECK(condition) Check::report(bool(condition), #condition, __FILE__, __LINE__)
@@ -0,0 +1,132 @@
+// Behaviour of the voxel-grid filter and the kNN normal estimation.
+
+#include <iostream>
+#include <vector>
+
+#include "Eigen.h"
+#include "VirtualSensor.h"
+#include "PointCloud.h"
+#include "VoxelGrid.h"
+#include "NormalEstimation.h"
+#include "Check.h"
+
+namespace {
+	/**
+	 * n x n x n points with the given spacing, every 11th point is invalid if bInvalidPoints.
+	 */
+	PointSoA gridPoints(int n, float spacing, bool bInvalidPoints) {
+		PointSoA points;
+		points.resize(size_t(n) * n * n);
+		for (int i = 0; i < int(points.size()); ++i) {
+			if (bInvalidPoints && i % 11 == 5)
+				points.set(i, Vector3f(MINF, MINF, MINF));
+			else
+				points.set(i, spacing * Vector3f(float(i % n), float(i / n % n), float(i / (n * n))));
+		}
+		return points;
+	}
+}
+
+void testVoxelGrid() {
+	// 10 points per axis, 2 per voxel and axis.
+	const PointSoA points = gridPoints(10, 0.1f, false);
+	PointSoA filtered;
+	std::vector<int> firstIndices;
+	VoxelGridFilter{ 0.2f }.filter(points, nullptr, filtered, nullptr, &firstIndices);
+	CHECK(filtered.size() == 125);
+	CHECK(firstIndices.size() == 125);
+
+	// Centroid of the first voxel (the points 0 and 0.1 on every axis).
+	CHECK(firstIndices[0] == 0);
+	CHECK(Check::near(filtered[0], Vector3f::Constant(0.05f), 1e-6f));
+
+	// FirstPoint reduction keeps input points.
+	VoxelGridFilter firstPoint{ 0.2f, VoxelReduction::FirstPoint };
+	firstPoint.filter(points, nullptr, filtered, nullptr, &firstIndices);
+	bool bInputPoints = filtered.size() == 125;
+	for (size_t i = 0; i < filtered.size() && bInputPoints; ++i)
+		bInputPoints = filtered[i] == points[firstIndices[i]];
+	CHECK(bInputPoints);
+
+	// Invalid points are dropped.
+	VoxelGridFilter{ 0.05f }.filter(gridPoints(10, 0.1f, true), filtered);
+	CHECK(filtered.size() == 1000 - 91);
+
+	// Normals are averaged per voxel.
+	PointSoA normals;
+	normals.resize(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+		normals.set(i, Vector3f(0.f, 0.f, 1.f));
+	PointSoA filteredNormals;
+	VoxelGridFilter{ 0.2f }.filter(points, &normals, filtered, &filteredNormals);
+	CHECK(filteredNormals.size() == filtered.size());
+	CHECK(Check::near(filteredNormals[7], Vector3f(0.f, 0.f, 1.f), 1e-6f));
+
+	// Invalid leaf sizes are rejected.
+	VoxelGridFilter filter{ 0.2f };
+	CHECK(!filter.setLeafSize(0.f));
+	CHECK(!filter.setLeafSize(-1.f));
+	CHECK(!filter.setLeafSize(std::numeric_limits<float>::quiet_NaN()));
+	CHECK(!filter.setLeafSize(std::numeric_limits<float>::infinity()));
+	CHECK(filter.getLeafSize() == 0.2f);
+	CHECK(VoxelGridFilter{ -1.f }.getLeafSize() == VoxelGridFilter::DEFAULT_LEAF_SIZE);
+
+	// Points further apart than the key covers (2^21 leaves) aren't merged.
+	PointSoA farPoints;
+	farPoints.resize(3);
+	farPoints.set(0, Vector3f(0.f, 0.f, 0.f));
+	farPoints.set(1, Vector3f(1e5f, 0.f, 0.f));
+	farPoints.set(2, Vector3f(-1e5f, 0.f, 0.f));
+	VoxelGridFilter{ 0.01f }.filter(farPoints, filtered);
+	CHECK(filtered.size() == 3);
+}
+
+void testNormalEstimation() {
+	// Plane z = 1 (a grid of 20 x 20 points), the normals point towards the viewpoint at the origin.
+	PointSoA points;
+	points.resize(400);
+	for (int i = 0; i < 400; ++i)
+		points.set(i, Vector3f(0.01f * (i % 20), 0.01f * (i / 20), 1.f));
+
+	NormalEstimator estimator{ 8 };
+	PointSoA normals;
+	estimator.compute(points, normals);
+	bool bPlaneNormals = normals.size() == points.size();
+	for (size_t i = 0; i < normals.size() && bPlaneNormals; ++i)
+		bPlaneNormals = Check::near(normals[i], Vector3f(0.f, 0.f, -1.f), 1e-4f);
+	CHECK(bPlaneNormals);
+
+	// Invalid points get invalid normals and don't disturb the others.
+	for (int i = 0; i < 400; i += 7)
+		points.set(i, Vector3f(MINF, MINF, MINF));
+	estimator.compute(points, normals);
+	bool bValidNormals = normals.size() == points.size();
+	for (size_t i = 0; i < normals.size() && bValidNormals; ++i) {
+		const Vector3f expected = points.isFinite(i) ? Vector3f(0.f, 0.f, -1.f) : Vector3f(MINF, MINF, MINF);
+		bValidNormals = Check::near(normals[i], expected, 1e-4f);
+	}
+	CHECK(bValidNormals);
+
+	// The viewpoint decides the orientation.
+	estimator.setViewpoint(Vector3f(0.f, 0.f, 2.f));
+	estimator.compute(points, normals);
+	CHECK(Check::near(normals[1], Vector3f(0.f, 0.f, 1.f), 1e-4f));
+
+	// Too few neighbors give invalid normals.
+	PointSoA twoPoints;
+	twoPoints.resize(2);
+	twoPoints.set(0, Vector3f(0.f, 0.f, 1.f));
+	twoPoints.set(1, Vector3f(0.1f, 0.f, 1.f));
+	estimator.compute(twoPoints, normals);
+	CHECK(!normals.isFinite(0) && !normals.isFinite(1));
+}
+
+int main() {
+	std::cout.setstate(std::ios::failbit);
+	testVoxelGrid();
+	testNormalEstimation();
+	std::cout.clear();
+
+	std::cout << (Check::failures() == 0 ? "passed" : "FAILED") << std::endl;
+	return Check::failures();
+}
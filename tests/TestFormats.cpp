@@ -0,0 +1,191 @@
+// Round trips of the file formats: binary cloud files, cloud and mesh PLY, OFF meshes and frame stores.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Eigen.h"
+#include "VirtualSensor.h"
+#include "SimpleMesh.h"
+#include "PointCloud.h"
+#include "FrameStore.h"
+#include "Check.h"
+
+namespace {
+	const unsigned int kWidth = 32;
+	const unsigned int kHeight = 24;
+
+	Matrix3f testIntrinsics() {
+		Matrix3f intrinsics;
+		intrinsics << 30.f, 0.f, 15.5f,
+			0.f, 30.f, 11.5f,
+			0.f, 0.f, 1.f;
+		return intrinsics;
+	}
+
+	/**
+	 * Slanted plane in front of the camera, every 7th pixel is invalid.
+	 */
+	std::vector<float> testDepth(unsigned int frame) {
+		std::vector<float> depth(kWidth * kHeight);
+		for (unsigned int i = 0; i < depth.size(); ++i)
+			depth[i] = i % 7 == 3 ? MINF : 1.f + 0.01f * (i % kWidth) + 0.1f * frame;
+		return depth;
+	}
+
+	std::vector<unsigned char> testColor(unsigned int frame) {
+		std::vector<unsigned char> color(4 * kWidth * kHeight);
+		for (unsigned int i = 0; i < color.size(); ++i)
+			color[i] = (unsigned char)(i * 7 + frame);
+		return color;
+	}
+
+	bool sameCloud(const PointCloud& a, const PointCloud& b, bool bPixelIndices) {
+		if (a.getPoints().size() != b.getPoints().size() || a.getNormals().size() != b.getNormals().size())
+			return false;
+		for (size_t i = 0; i < a.getPoints().size(); ++i) {
+			if (!Check::near(a.getPoints()[i], b.getPoints()[i], 0.f) || !Check::near(a.getNormals()[i], b.getNormals()[i], 0.f))
+				return false;
+		}
+		return !bPixelIndices || a.getPointIndices() == b.getPointIndices();
+	}
+
+	SimpleMesh testMesh() {
+		SimpleMesh mesh;
+		for (int i = 0; i < 4; ++i) {
+			Vertex v;
+			v.position = Vector4f(0.125f * i, 1.5f - i, 0.25f * i * i, 1.f);
+			v.color = Vector4uc((unsigned char)(60 * i), 255, (unsigned char)(10 + i), 255);
+			mesh.getVertices().push_back(v);
+		}
+		mesh.addFace(0, 1, 2);
+		mesh.addFace(1, 3, 2);
+		return mesh;
+	}
+
+	bool sameMesh(const SimpleMesh& a, const SimpleMesh& b, float tolerance) {
+		if (a.getVertices().size() != b.getVertices().size() || a.getTriangles().size() != b.getTriangles().size())
+			return false;
+		for (size_t i = 0; i < a.getVertices().size(); ++i) {
+			if (!Check::near(a.getVertices()[i].position.head<3>(), b.getVertices()[i].position.head<3>(), tolerance))
+				return false;
+			if (a.getVertices()[i].color != b.getVertices()[i].color)
+				return false;
+		}
+		for (size_t i = 0; i < a.getTriangles().size(); ++i) {
+			const Triangle& s = a.getTriangles()[i];
+			const Triangle& t = b.getTriangles()[i];
+			if (s.idx0 != t.idx0 || s.idx1 != t.idx1 || s.idx2 != t.idx2)
+				return false;
+		}
+		return true;
+	}
+}
+
+void testCloudFile() {
+	// saveAll keeps the intrinsics and the resolution with the cloud.
+	const std::vector<float> depth = testDepth(0);
+	PointCloud cloud{ depth.data(), testIntrinsics(), Matrix4f::Identity(), kWidth, kHeight, 1, 0.1f, true };
+	CHECK(cloud.getPoints().size() > 0);
+
+	CHECK(cloud.writeMappedFile("cloud.bin"));
+	PointCloud loaded;
+	CHECK(loaded.loadMappedFile("cloud.bin"));
+	CHECK(sameCloud(cloud, loaded, true));
+	CHECK(loaded.getDepthIntrinsics() == testIntrinsics());
+	CHECK(loaded.getWidth() == kWidth && loaded.getHeight() == kHeight);
+
+	// A truncated file is rejected.
+	std::ifstream is("cloud.bin", std::ios::binary);
+	std::vector<char> bytes((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+	std::ofstream("cloud_truncated.bin", std::ios::binary).write(bytes.data(), bytes.size() / 2);
+	PointCloud truncated;
+	CHECK(!truncated.loadMappedFile("cloud_truncated.bin"));
+}
+
+void testCloudPly() {
+	const std::vector<float> depth = testDepth(1);
+	PointCloud cloud{ depth.data(), testIntrinsics(), Matrix4f::Identity(), kWidth, kHeight };
+
+	CHECK(cloud.writePly("cloud.ply"));
+	PointCloud loaded;
+	CHECK(loaded.loadPly("cloud.ply"));
+	CHECK(sameCloud(cloud, loaded, false));
+}
+
+void testMeshFiles() {
+	SimpleMesh mesh = testMesh();
+
+	// OFF stores 6 significant digits.
+	CHECK(mesh.writeMesh("mesh.off"));
+	SimpleMesh loadedOff;
+	CHECK(loadedOff.loadMesh("mesh.off"));
+	CHECK(sameMesh(mesh, loadedOff, 1e-5f));
+
+	CHECK(mesh.writeMesh("mesh.ply"));
+	SimpleMesh loadedPly;
+	CHECK(loadedPly.loadMesh("mesh.ply"));
+	CHECK(sameMesh(mesh, loadedPly, 0.f));
+
+	// Faces referencing missing vertices are rejected.
+	std::ofstream("mesh_invalid.off") << "OFF\n3 1 0\n0 0 0\n1 0 0\n0 1 0\n3 0 1 3\n";
+	SimpleMesh invalid;
+	CHECK(!invalid.loadMesh("mesh_invalid.off"));
+}
+
+void testFrameStore(FrameStore::DepthFormat depthFormat) {
+	const float depthScale = 5000.f;
+	const unsigned int nFrames = 3;
+	{
+		FrameStoreWriter writer;
+		CHECK(writer.open("frames.bin", depthFormat, depthScale, kWidth, kHeight, testIntrinsics(), Matrix4f::Identity(),
+			kWidth, kHeight, testIntrinsics(), Matrix4f::Identity()));
+		for (unsigned int frame = 0; frame < nFrames; ++frame) {
+			Matrix4f trajectory = Matrix4f::Identity();
+			trajectory(0, 3) = float(frame);
+			CHECK(writer.addFrame(testDepth(frame).data(), testColor(frame).data(), 10.0 + frame, 10.5 + frame, trajectory));
+		}
+		CHECK(writer.close());
+	}
+
+	std::shared_ptr<const FrameStore> store = FrameStore::open("frames.bin");
+	CHECK(store);
+	if (!store)
+		return;
+	CHECK(store->getNbOfFrames() == nFrames);
+	CHECK(store->getDepthFormat() == depthFormat);
+	CHECK(store->getDepthIntrinsics() == testIntrinsics());
+
+	// uint16 depth is quantized to 1 / depthScale.
+	const float tolerance = depthFormat == FrameStore::DEPTH_UINT16 ? 0.5f / depthScale : 0.f;
+	std::vector<float> depth(kWidth * kHeight);
+	for (unsigned int frame = 0; frame < nFrames; ++frame) {
+		CHECK(store->getDepthTimeStamp(frame) == 10.0 + frame);
+		CHECK(store->getColorTimeStamp(frame) == 10.5 + frame);
+		CHECK(store->getTrajectory(frame)(0, 3) == float(frame));
+
+		store->copyDepth(frame, depth.data());
+		const std::vector<float> expectedDepth = testDepth(frame);
+		bool bSameDepth = true;
+		for (size_t i = 0; i < depth.size(); ++i)
+			bSameDepth = bSameDepth && Check::near(Vector3f::Constant(depth[i]), Vector3f::Constant(expectedDepth[i]), tolerance);
+		CHECK(bSameDepth);
+
+		const std::vector<unsigned char> expectedColor = testColor(frame);
+		CHECK(std::equal(expectedColor.begin(), expectedColor.end(), store->getColorRGBX(frame)));
+	}
+}
+
+int main() {
+	std::cout.setstate(std::ios::failbit);
+	testCloudFile();
+	testCloudPly();
+	testMeshFiles();
+	testFrameStore(FrameStore::DEPTH_FLOAT32);
+	testFrameStore(FrameStore::DEPTH_UINT16);
+	std::cout.clear();
+
+	std::cout << (Check::failures() == 0 ? "passed" : "FAILED") << std::endl;
+	return Check::failures();
+}